@@ -0,0 +1,462 @@
+#include <lodepng.h>
+#include <omp.h>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <ctime>
+#ifdef _WIN32
+// without NOMINMAX, Windows.h defines min and max macros that break std::min and std::max
+#define NOMINMAX
+#include <Windows.h>
+#endif
+
+#include "../common/zncc_common.h"
+#include "../common/stereo_backend.h"
+#include "../CPU_ZNCC_Implementation/zncc_stages.h"
+#include "../OpenMP_ZNCC_Implementation/zncc_openmp_stages.h"
+#include "../OpenCL_ZNCC_Optimized/zncc_opencl_stages.h"
+
+// The stages of every backend are linked from their own sources, so every stage is timed with the same code that
+// the implementation's own project runs
+
+// Result of one benchmark, named and reported like Google Benchmark does | stage/backend/input[/win:N/ndisp:N]
+struct benchmark_result {
+    std::string name;
+    std::string stage;
+    std::string backend;
+    std::string input;
+    int windowSize = 0;         // 0 for stages that don't depend on it
+    int ndisp = 0;              // resized disparities searched per pixel | 0 for stages that don't search
+    long long iterations = 0;
+    double realTime = 0;        // nanoseconds per iteration
+    double cpuTime = 0;         // CPU time of every thread of the process in nanoseconds per iteration
+    double pixels = 0;          // pixels processed per iteration
+};
+
+// Iterations of a benchmark grow until they run for at least minBenchmarkTime seconds, like in Google Benchmark
+// a stage slower than that, e.g. the single threaded ZNCC, is reported after its first run
+const double minBenchmarkTime = 0.5;
+const long long maxBenchmarkIterations = 1000000000;
+
+// CPU seconds the process has used so far, summed over all of its threads | the OpenMP threads and those of a CPU
+// OpenCL device are counted as well, so a parallel stage uses more CPU time than real time
+double ProcessCPUSeconds()
+{
+#ifdef _WIN32
+    // std::clock measures wall time on Windows
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+    auto ticks = [](const FILETIME& time) { return (static_cast<unsigned long long>(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+    return (ticks(kernelTime) + ticks(userTime)) * 1e-7;
+#else
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+// Run body iterations times | returns the real seconds and sets cpuSeconds to the CPU seconds of the process
+template <typename Body>
+double TimeIterations(Body& body, long long iterations, double& cpuSeconds)
+{
+    double cpuStart = ProcessCPUSeconds();
+    auto start = std::chrono::steady_clock::now();
+    for (long long i = 0; i < iterations; i++)
+    {
+        body();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cpuSeconds = ProcessCPUSeconds() - cpuStart;
+    return seconds;
+}
+
+// Times body and adds the result | benchmarks whose name doesn't contain filter are skipped
+template <typename Body>
+void RunBenchmark(benchmark_result result, Body body, const std::string& filter, std::vector<benchmark_result>& results)
+{
+    std::ostringstream name;
+    name << result.stage << "/" << result.backend << "/" << result.input;
+    if (result.windowSize > 0) name << "/win:" << result.windowSize;
+    if (result.ndisp > 0) name << "/ndisp:" << result.ndisp;
+    result.name = name.str();
+    if (result.name.find(filter) == std::string::npos) return;
+
+    // the first run warms up the caches and the buffers of the OpenCL runtime, so it only counts if it is already
+    // longer than the minimum time
+    long long iterations = 1;
+    double cpuSeconds = 0;
+    double seconds = TimeIterations(body, iterations, cpuSeconds);
+    if (seconds < minBenchmarkTime)
+    {
+        seconds = 0;
+        while (seconds < minBenchmarkTime && iterations < maxBenchmarkIterations)
+        {
+            seconds = TimeIterations(body, iterations, cpuSeconds);
+            if (seconds >= minBenchmarkTime) break;
+
+            // aim 40% past the minimum time, growing by at most 10x per step
+            double multiplier = seconds <= minBenchmarkTime / 10 ? 10 : minBenchmarkTime * 1.4 / seconds;
+            iterations = std::min(maxBenchmarkIterations, std::max(iterations + 1, static_cast<long long>(iterations * multiplier)));
+        }
+    }
+    result.iterations = iterations;
+    result.realTime = seconds * 1e9 / iterations;
+    result.cpuTime = cpuSeconds * 1e9 / iterations;
+
+    std::cout << std::left << std::setw(56) << result.name << std::right << std::setw(14) << std::fixed << std::setprecision(0)
+        << result.realTime << " ns" << std::setw(14) << result.cpuTime << " ns" << std::setw(12) << result.iterations << "   pixels/s=" << std::scientific << std::setprecision(3)
+        << result.pixels * 1e9 / result.realTime;
+    if (result.ndisp > 0) std::cout << " pixel_disparities/s=" << result.pixels * result.ndisp * 1e9 / result.realTime;
+    std::cout << std::endl;
+    results.push_back(result);
+}
+
+// Stereo pair the stages run on, as decoded RGBA images
+struct benchmark_input {
+    std::string name;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    std::vector<unsigned char> left;
+    std::vector<unsigned char> right;
+    std::vector<unsigned char> leftPNG;     // the encoded left image, decoded by the decode benchmark
+};
+
+// Random texture seen by two cameras shift pixels apart | the same seed gives the same pair on every machine
+benchmark_input SyntheticInput(unsigned int width, unsigned int height, unsigned int shift)
+{
+    benchmark_input input;
+    input.name = "synthetic_" + std::to_string(width) + "x" + std::to_string(height);
+    input.width = width;
+    input.height = height;
+
+    // the texture is wider than the image, so the right image has no made up border
+    unsigned int textureWidth = width + shift;
+    std::vector<unsigned char> texture(static_cast<size_t>(textureWidth) * height);
+    unsigned int seed = 12345;
+    for (unsigned char& value : texture)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        value = static_cast<unsigned char>(seed >> 24);
+    }
+
+    input.left.resize(static_cast<size_t>(width) * height * 4);
+    input.right.resize(input.left.size());
+    for (unsigned int y = 0; y < height; y++)
+    {
+        for (unsigned int x = 0; x < width; x++)
+        {
+            // the point at left x is at right x - shift, so the left disparity is shift everywhere
+            unsigned char leftValue = texture[static_cast<size_t>(y) * textureWidth + x + shift];
+            unsigned char rightValue = texture[static_cast<size_t>(y) * textureWidth + x];
+            size_t i = (static_cast<size_t>(y) * width + x) * 4;
+            input.left[i + 0] = input.left[i + 1] = input.left[i + 2] = leftValue;
+            input.right[i + 0] = input.right[i + 1] = input.right[i + 2] = rightValue;
+            input.left[i + 3] = input.right[i + 3] = 255;
+        }
+    }
+    lodepng::encode(input.leftPNG, input.left, width, height);
+    return input;
+}
+
+// Stereo pair from PNG files | false if either can't be decoded or their sizes differ
+bool ImageInput(const std::string& name, const std::string& leftPath, const std::string& rightPath, benchmark_input& input)
+{
+    input.name = name;
+    unsigned int rightWidth = 0, rightHeight = 0;
+    if (lodepng::load_file(input.leftPNG, leftPath)) return false;
+    if (lodepng::decode(input.left, input.width, input.height, input.leftPNG)) return false;
+    if (lodepng::decode(input.right, rightWidth, rightHeight, rightPath)) return false;
+    return rightWidth == input.width && rightHeight == input.height;
+}
+
+// Runs every stage of every backend on input | the window sizes and disparity ranges are given for the full resolution,
+// like in the pipelines, and the post-processing stages all start from the same maps, computed with the first of each
+void RunInputBenchmarks(const benchmark_input& input, unsigned int resizeFactor, const std::vector<int>& windowSizes,
+    const std::vector<int>& ndisps, int crossDiff, int neighbours, const std::vector<cl::Device>& devices,
+    const std::string& kernelSource, const std::string& filter, std::vector<benchmark_result>& results)
+{
+    unsigned int width = input.width, height = input.height;
+    int resizedWidth = static_cast<int>(width / resizeFactor);
+    int resizedHeight = static_cast<int>(height / resizeFactor);
+    double pixels = static_cast<double>(width) * height;
+    double resizedPixels = static_cast<double>(resizedWidth) * resizedHeight;
+    size_t resizedSize = static_cast<size_t>(resizedWidth) * resizedHeight;
+
+    benchmark_result result;
+    result.input = input.name;
+
+    //// decode and encode | lodepng for every backend
+    result.backend = "lodepng";
+    result.stage = "decode";
+    result.pixels = pixels;
+    std::vector<unsigned char> decoded;
+    RunBenchmark(result, [&]() {
+        unsigned int decodedWidth, decodedHeight;
+        lodepng::decode(decoded, decodedWidth, decodedHeight, input.leftPNG);
+    }, filter, results);
+
+    //// inputs of the later stages, from the OpenMP implementation
+    std::vector<unsigned char> leftGray(static_cast<size_t>(width) * height), rightGray(leftGray.size());
+    std::vector<unsigned char> leftResized(resizedSize), rightResized(resizedSize);
+    openmp::GrayScaleImageConversion(input.left, width, height, leftGray);
+    openmp::GrayScaleImageConversion(input.right, width, height, rightGray);
+    openmp::ResizeImage(leftGray, width, height, resizeFactor, leftResized);
+    openmp::ResizeImage(rightGray, width, height, resizeFactor, rightResized);
+
+    int referenceDisp = ndisps.front() / static_cast<int>(resizeFactor);
+    std::vector<int> leftMap(resizedSize), rightMap(resizedSize), crossChecked(resizedSize), filled(resizedSize);
+    std::vector<unsigned char> normalized(resizedSize);
+    openmp::CalcZNCC(leftResized, rightResized, resizedWidth, resizedHeight, windowSizes.front(), referenceDisp, leftMap, 1);
+    openmp::CalcZNCC(rightResized, leftResized, resizedWidth, resizedHeight, windowSizes.front(), referenceDisp, rightMap, -1);
+    openmp::CrossCheck(leftMap, rightMap, resizedWidth, resizedHeight, crossDiff, crossChecked);
+    openmp::OcclusionFilling(crossChecked, resizedWidth, resizedHeight, neighbours, filled);
+    openmp::NormalizeToChar(filled, resizedWidth, resizedHeight, referenceDisp, normalized);
+
+    result.stage = "encode";
+    result.pixels = resizedPixels;
+    std::vector<unsigned char> encoded;
+    RunBenchmark(result, [&]() {
+        encoded.clear();
+        lodepng::encode(encoded, normalized, resizedWidth, resizedHeight, LCT_GREY, 8);
+    }, filter, results);
+
+    //// host backends | every output is allocated before timing, like the workspace of the pipelines
+    std::vector<unsigned char> gray(leftGray.size()), resized(resizedSize), norm(resizedSize);
+    std::vector<int> map(resizedSize), checked(resizedSize), filledMap(resizedSize);
+
+    result.backend = "cpu";
+    result.stage = "grayscale";
+    result.pixels = pixels;
+    RunBenchmark(result, [&]() { cpu::GrayScaleImageConversion(input.left, width, height, gray); }, filter, results);
+    result.stage = "resize";
+    RunBenchmark(result, [&]() { cpu::ResizeImage(leftGray, width, height, resizeFactor, resized); }, filter, results);
+    result.stage = "cross_check";
+    result.pixels = resizedPixels;
+    RunBenchmark(result, [&]() { cpu::CrossCheck(leftMap, rightMap, resizedWidth, resizedHeight, crossDiff, checked); }, filter, results);
+    result.stage = "occlusion_fill";
+    RunBenchmark(result, [&]() { cpu::OcclusionFilling(crossChecked, resizedWidth, resizedHeight, neighbours, filledMap); }, filter, results);
+    result.stage = "normalize";
+    RunBenchmark(result, [&]() { cpu::NormalizeToChar(filled, resizedWidth, resizedHeight, referenceDisp, norm); }, filter, results);
+
+    result.backend = "openmp";
+    result.stage = "grayscale";
+    result.pixels = pixels;
+    RunBenchmark(result, [&]() { openmp::GrayScaleImageConversion(input.left, width, height, gray); }, filter, results);
+    result.stage = "resize";
+    RunBenchmark(result, [&]() { openmp::ResizeImage(leftGray, width, height, resizeFactor, resized); }, filter, results);
+    result.stage = "cross_check";
+    result.pixels = resizedPixels;
+    RunBenchmark(result, [&]() { openmp::CrossCheck(leftMap, rightMap, resizedWidth, resizedHeight, crossDiff, checked); }, filter, results);
+    result.stage = "occlusion_fill";
+    RunBenchmark(result, [&]() { openmp::OcclusionFilling(crossChecked, resizedWidth, resizedHeight, neighbours, filledMap); }, filter, results);
+    result.stage = "normalize";
+    RunBenchmark(result, [&]() { openmp::NormalizeToChar(filled, resizedWidth, resizedHeight, referenceDisp, norm); }, filter, results);
+
+    for (int windowSize : windowSizes)
+    {
+        for (int ndisp : ndisps)
+        {
+            result.stage = "zncc";
+            result.windowSize = windowSize;
+            result.ndisp = ndisp / static_cast<int>(resizeFactor);
+            result.backend = "cpu";
+            RunBenchmark(result, [&]() {
+                cpu::CalcZNCC(leftResized, rightResized, resizedWidth, resizedHeight, windowSize, result.ndisp, map, 1);
+            }, filter, results);
+            result.backend = "openmp";
+            RunBenchmark(result, [&]() {
+                openmp::CalcZNCC(leftResized, rightResized, resizedWidth, resizedHeight, windowSize, result.ndisp, map, 1);
+            }, filter, results);
+        }
+    }
+    result.windowSize = 0;
+    result.ndisp = 0;
+
+    //// OpenCL | the kernels block until they finished, so the host clock times them
+    if (devices.empty()) return;
+
+    // tuned settings of the device for this size are loaded, so the kernels run like in the pipeline
+    opencl::InitDevice(devices.front(), kernelSource, resizedWidth, resizedHeight);
+    opencl::cl_info_obj.printProfiling = false;
+    opencl::cl_info_obj.recordTrace = false;
+
+    cl::Context& context = opencl::cl_info_obj.context;
+    std::vector<unsigned char> leftImage(input.left);
+    cl::Buffer leftBuffer = opencl::WrapRGBA(leftImage.data(), width, height);
+    cl::Buffer leftResizedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, resizedSize, leftResized.data());
+    cl::Buffer rightResizedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, resizedSize, rightResized.data());
+    cl::Buffer leftMapBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * resizedSize, leftMap.data());
+    cl::Buffer rightMapBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * resizedSize, rightMap.data());
+    cl::Buffer crossCheckedBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * resizedSize, crossChecked.data());
+    cl::Buffer filledBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * resizedSize, filled.data());
+
+    result.backend = "opencl";
+    // grayscale conversion and resizing are one kernel on the device
+    result.stage = "grayscale_resize";
+    result.pixels = pixels;
+    RunBenchmark(result, [&]() { opencl::EnqueueGrayScaleResize(leftBuffer, width, height, resizeFactor); }, filter, results);
+    result.stage = "cross_check";
+    result.pixels = resizedPixels;
+    RunBenchmark(result, [&]() {
+        opencl::EnqueueCrossCheck(leftMapBuffer, rightMapBuffer, resizedWidth, resizedHeight, crossDiff);
+    }, filter, results);
+    result.stage = "occlusion_fill";
+    RunBenchmark(result, [&]() { opencl::EnqueueOcclusionFilling(crossCheckedBuffer, resizedWidth, resizedHeight, neighbours); }, filter, results);
+    result.stage = "normalize";
+    RunBenchmark(result, [&]() { opencl::EnqueueNormalizeToChar(filledBuffer, resizedWidth, resizedHeight, referenceDisp); }, filter, results);
+
+    for (int windowSize : windowSizes)
+    {
+        for (int ndisp : ndisps)
+        {
+            // the window statistics are part of the ZNCC on the device, the host implementations compute them per pixel
+            result.stage = "zncc";
+            result.windowSize = windowSize;
+            result.ndisp = ndisp / static_cast<int>(resizeFactor);
+            RunBenchmark(result, [&]() {
+                auto leftStats = opencl::EnqueueBoxStats(leftResizedBuffer, resizedWidth, resizedHeight, windowSize);
+                auto rightStats = opencl::EnqueueBoxStats(rightResizedBuffer, resizedWidth, resizedHeight, windowSize);
+                opencl::EnqueueZNCC(leftResizedBuffer, rightResizedBuffer, leftStats, rightStats, resizedWidth, resizedHeight,
+                    windowSize, result.ndisp, 1);
+            }, filter, results);
+        }
+    }
+}
+
+// Results in the layout of Google Benchmark's JSON output, so its compare.py and plotting tools read them
+bool WriteBenchmarkJson(const std::string& path, const std::vector<benchmark_result>& results, unsigned int resizeFactor,
+    const std::string& deviceName)
+{
+    opencl::json_value context;
+    context.Set("num_cpus", opencl::JsonNumber(std::thread::hardware_concurrency()));
+    context.Set("omp_max_threads", opencl::JsonNumber(omp_get_max_threads()));
+    context.Set("opencl_device", opencl::JsonString(deviceName));
+    context.Set("resize_factor", opencl::JsonNumber(resizeFactor));
+    context.Set("min_time", opencl::JsonNumber(minBenchmarkTime));
+
+    opencl::json_value benchmarks;
+    benchmarks.type = opencl::json_value::array_type;
+    for (const benchmark_result& result : results)
+    {
+        opencl::json_value benchmark;
+        benchmark.Set("name", opencl::JsonString(result.name));
+        benchmark.Set("run_type", opencl::JsonString("iteration"));
+        benchmark.Set("stage", opencl::JsonString(result.stage));
+        benchmark.Set("backend", opencl::JsonString(result.backend));
+        benchmark.Set("input", opencl::JsonString(result.input));
+        if (result.windowSize > 0) benchmark.Set("win_size", opencl::JsonNumber(result.windowSize));
+        if (result.ndisp > 0) benchmark.Set("ndisp", opencl::JsonNumber(result.ndisp));
+        benchmark.Set("iterations", opencl::JsonNumber(static_cast<double>(result.iterations)));
+        benchmark.Set("real_time", opencl::JsonNumber(result.realTime));
+        benchmark.Set("cpu_time", opencl::JsonNumber(result.cpuTime));
+        benchmark.Set("time_unit", opencl::JsonString("ns"));
+        benchmark.Set("items_per_second", opencl::JsonNumber(result.pixels * 1e9 / result.realTime));
+        if (result.ndisp > 0)
+        {
+            benchmark.Set("pixel_disparities_per_second", opencl::JsonNumber(result.pixels * result.ndisp * 1e9 / result.realTime));
+        }
+        benchmarks.items.push_back(benchmark);
+    }
+
+    opencl::json_value root;
+    root.Set("context", context);
+    root.Set("benchmarks", benchmarks);
+
+    std::ofstream file(path);
+    if (!file) return false;
+    file.precision(15);
+    opencl::WriteJson(file, root);
+    file << std::endl;
+    return true;
+}
+
+int main()
+{
+    // full resolution parameters like in the pipelines | ZNCC is benchmarked for every window size and disparity range,
+    // the other stages once per input
+    unsigned int resizeFactor = 4;
+    std::vector<int> windowSizes = { 9, 11, 15 };
+    std::vector<int> ndisps = { 64, 260 };
+    int crossDiff = 32;
+    int neighbours = 8;
+
+    // synthetic pairs of these full resolution sizes, shifted by syntheticShift pixels | the Middlebury pair below is
+    // added if it exists
+    std::vector<std::pair<unsigned int, unsigned int>> syntheticSizes = { { 736, 504 }, { 1472, 1008 } };
+    unsigned int syntheticShift = 40;
+    std::vector<std::pair<std::string, std::string>> imagePairs = {
+        { "../img/im0.png", "../img/im1.png" },
+    };
+
+    // OpenCL device the kernels run on, see SelectDevices | a CPU device, so the backends share the same cores
+    std::string deviceSelector = "cpu";
+
+    // only benchmarks whose name contains filter run, like --benchmark_filter | e.g. "zncc/" or "/opencl/"
+    std::string filter = "";
+
+    const char* benchmarkOut = "../profiling/benchmark.json";
+
+    std::vector<benchmark_input> inputs;
+    for (const auto& size : syntheticSizes)
+    {
+        inputs.push_back(SyntheticInput(size.first, size.second, syntheticShift));
+    }
+    for (size_t i = 0; i < imagePairs.size(); i++)
+    {
+        benchmark_input input;
+        if (ImageInput("img_" + std::to_string(i), imagePairs[i].first, imagePairs[i].second, input))
+        {
+            inputs.push_back(input);
+        }
+        else
+        {
+            std::cout << "Skipping image pair " << imagePairs[i].first << ", " << imagePairs[i].second << ": it can't be decoded" << std::endl;
+        }
+    }
+
+    try
+    {
+        std::vector<cl::Device> devices = opencl::SelectDevices(deviceSelector);
+        std::string deviceName;
+        if (devices.empty())
+        {
+            std::cout << "No OpenCL device matches \"" << deviceSelector << "\", only the host backends are benchmarked" << std::endl;
+        }
+        else
+        {
+            devices.resize(1);
+            deviceName = devices.front().getInfo<CL_DEVICE_NAME>();
+        }
+
+        std::ifstream kernelFile("../kernels/zncc_kernels_optimized.cl");
+        std::string src(std::istreambuf_iterator<char>(kernelFile), (std::istreambuf_iterator<char>()));
+
+        std::cout << "------------BENCHMARKS------------" << std::endl;
+        std::vector<benchmark_result> results;
+        for (const benchmark_input& input : inputs)
+        {
+            RunInputBenchmarks(input, resizeFactor, windowSizes, ndisps, crossDiff, neighbours, devices, src, filter, results);
+        }
+
+        if (WriteBenchmarkJson(benchmarkOut, results, resizeFactor, deviceName))
+        {
+            std::cout << "Wrote " << results.size() << " benchmarks to " << benchmarkOut << std::endl;
+        }
+        else
+        {
+            std::cerr << "ERROR: could not write " << benchmarkOut << std::endl;
+        }
+    }
+    catch (const cl::Error& err)
+    {
+        std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -3,233 +3,874 @@
 #include <iostream>
 #include <math.h> 
 #include <vector>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <limits>
+#include <chrono>
+// without NOMINMAX, Windows.h defines min and max macros that break std::min and std::max
+#define NOMINMAX
 #include <Windows.h>
 
+#include "../common/zncc_common.h"
+#include "../common/heap_allocations.h"
+#include "../common/stereo_workspace.h"
+#include "zncc_stages.h"
 
-void GrayScaleImageConversion(const std::vector<unsigned char>& image, unsigned int width, unsigned int height, std::vector<unsigned char>& imageGray)
+using namespace cpu;
+
+// State a video stream carries from frame to frame | the cross-checked disparities of the previous frame
+// limit the search of the next one to searchRadius around them
+struct temporal_state : temporal_base {
+    std::vector<int> prior;     // cross-checked disparities of the previous frame | empty before the first frame
+};
+
+// CalcZNCC with the search of every pixel limited to state.searchRadius around its prior disparity
+// pixels without a valid prior search the full range and so do pixels whose peak degrades, i.e. whose best score
+// is below state.minScore or whose best disparity is on the edge of the limited range | the missing part of the range
+// is then searched, so the result is the same as CalcZNCC for them | evaluated disparities are added to state
+// the full range is minDisparity up to maxDisparity
+void CalcZNCCTemporal(const std::vector<unsigned char>& leftImage,
+    const std::vector<unsigned char>& rightImage,
+    int width, int height,
+    int windowSize, int maxDisparity,
+    temporal_state& state,
+    std::vector<int>& disparityMap,
+    char isLeftImage = 1, int minDisparity = 0)
 {
-    // iterate over every four values, as input is 4 channeled RGBA
-    char channel = 4;
-    for (size_t i = 0; i < image.size(); i += channel)
+    int halfWindowSize = (windowSize - 1) / 2;
+
+    for (int y = 0; y < height; y++)
     {
-        // Add up R, G and B values and divide to get grayscale value.
-        // We don't care about the A value, so it is not used.
-        imageGray[i / channel] = (image[i + 0] + image[i + 1] + image[i + 2]) / 3;
+        for (int x = 0; x < width; x++)
+        {
+            int bestDisp = 0;
+
+            // handle borders | keep bestDisp at 0, so borders will be black
+            if (!IsBorderPixel(x, y, width, height, halfWindowSize))
+            {
+                int prior = state.prior[y * width + x];
+                int first = prior > 0 ? std::max(minDisparity, prior - state.searchRadius) : minDisparity;
+                int last = prior > 0 ? std::max(first, std::min(maxDisparity, prior + state.searchRadius + 1)) : maxDisparity;
+
+                float bestScore;
+                bestDisp = PixelDisparity(leftImage, rightImage, width, height, x, y, halfWindowSize, last, isLeftImage, &bestScore, first);
+                state.evaluations += std::max(0, last - first);
+                state.fullEvaluations += std::max(0, maxDisparity - minDisparity);
+
+                bool onEdge = (bestDisp == first && first > minDisparity) || (bestDisp == last - 1 && last < maxDisparity);
+                if (prior > 0 && (bestScore < state.minScore || onEdge))
+                {
+                    // search below and above the limited range | ties go to the smaller disparity like in CalcZNCC
+                    float belowScore, aboveScore;
+                    int below = PixelDisparity(leftImage, rightImage, width, height, x, y, halfWindowSize, first, isLeftImage, &belowScore, minDisparity);
+                    int above = PixelDisparity(leftImage, rightImage, width, height, x, y, halfWindowSize, maxDisparity, isLeftImage, &aboveScore, last);
+                    state.evaluations += (first - minDisparity) + (maxDisparity - last);
+
+                    if (belowScore >= bestScore && belowScore > -100.0f)
+                    {
+                        bestScore = belowScore;
+                        bestDisp = below;
+                    }
+                    if (aboveScore > bestScore)
+                    {
+                        bestScore = aboveScore;
+                        bestDisp = above;
+                    }
+                }
+            }
+
+            disparityMap[y * width + x] = bestDisp;
+        }
+    }
+}
+
+// Reset the per-frame counters and drop the prior on keyframes, so that they search the full range
+void BeginTemporalFrame(temporal_state& state, int width, int height)
+{
+    state.evaluations = 0;
+    state.fullEvaluations = 0;
+    if (state.prior.size() != static_cast<size_t>(width) * height || state.frame % state.keyframeInterval == 0)
+    {
+        state.prior.assign(static_cast<size_t>(width) * height, 0);
     }
 }
 
-void ResizeImage(std::vector<unsigned char> image, unsigned int width, unsigned int height, unsigned int resizeFactor, std::vector<unsigned char>& imageResized)
+// Keep the cross-checked disparities of the frame as the prior of the next one
+void EndTemporalFrame(temporal_state& state, const std::vector<int>& crossCheckedMap)
 {
-    // Divide image into resizeFactor x resizeFactor blocks and then use the average value of said blocks as the value of the new pixel
-    imageResized.resize((width * height) / (resizeFactor * resizeFactor));
+    state.prior = crossCheckedMap;
+    state.frame++;
+}
 
-    int newWidth = width / resizeFactor;
-    int newHeight = height / resizeFactor;
+// Sub-pixel offset of the ZNCC peak at d from the scores at d - 1, d and d + 1, in [-0.5, 0.5] | a parabola through
+// the three scores, or with equiangular two lines of opposite slope through them, 0 if d is not a peak
+float SubpixelOffset(float below, float peak, float above, bool equiangular)
+{
+    if (peak < below || peak < above) return 0.0f;
 
-    for (int i = 0; i < newHeight; ++i)
+    float offset;
+    if (equiangular)
+    {
+        float slope = peak - std::min(below, above);
+        if (slope <= 0.0f) return 0.0f;
+        offset = 0.5f * (above - below) / slope;
+    }
+    else
     {
-        for (int j = 0; j < newWidth; ++j)
+        float curvature = below - 2.0f * peak + above;
+        if (curvature >= 0.0f) return 0.0f;
+        offset = 0.5f * (below - above) / curvature;
+    }
+    return std::max(-0.5f, std::min(0.5f, offset));
+}
+
+// Float disparities of the occlusion filled map | pixels whose disparity was kept by the cross-check are refined with
+// the ZNCC scores of the left image at the neighbouring disparities, filled pixels keep their integer disparity
+void RefineSubpixel(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    int width, int height, int windowSize, int maxDisparity, const std::vector<int>& crossCheckedMap,
+    const std::vector<int>& dispMapFilled, bool equiangular, std::vector<float>& refinedMap)
+{
+    int halfWindowSize = (windowSize - 1) / 2;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
         {
-            int sum = 0;
-            for (int k = i * resizeFactor; k < (i + 1) * resizeFactor; k++) {
-                for (int l = j * resizeFactor; l < (j + 1) * resizeFactor; l++) {
-                    sum += image[k * width + l];
+            int d = crossCheckedMap[y * width + x];
+            float disparity = static_cast<float>(dispMapFilled[y * width + x]);
+
+            // the scores on both sides of d are needed | cross-checked disparities are never on the border
+            if (d > 0 && d + 1 < maxDisparity)
+            {
+                float below = WindowZNCC(leftImage, rightImage, width, height, x, y, halfWindowSize, d - 1, 1);
+                float peak = WindowZNCC(leftImage, rightImage, width, height, x, y, halfWindowSize, d, 1);
+                float above = WindowZNCC(leftImage, rightImage, width, height, x, y, halfWindowSize, d + 1, 1);
+                if (below != -100.0f && above != -100.0f)
+                {
+                    disparity = d + SubpixelOffset(below, peak, above, equiangular);
                 }
             }
-            imageResized[i * (newWidth) + j] = sum / (resizeFactor * resizeFactor);
+            refinedMap[y * width + x] = disparity;
         }
     }
 }
 
+// Write float disparities as a PFM image, the format of the Middlebury ground truth | rows are stored bottom to top
+bool WritePFM(const std::string& fileName, const std::vector<float>& dispMap, int width, int height)
+{
+    std::ofstream file(fileName, std::ios::binary);
+    if (!file) return false;
 
-// Apply ZNCC algorithm for a given window size and max disparity
-void CalcZNCC(const std::vector<unsigned char>& leftImage,
-    const std::vector<unsigned char>& rightImage,
-    int width, int height,
-    int windowSize, int maxDisparity,
-    std::vector<int>& disparityMap,
-    char isLeftImage = 1
-    ) 
+    // a negative scale marks little-endian floats
+    file << "Pf\n" << width << " " << height << "\n-1\n";
+    for (int y = height - 1; y >= 0; y--)
+    {
+        file.write(reinterpret_cast<const char*>(&dispMap[static_cast<size_t>(y) * width]), sizeof(float) * width);
+    }
+    return static_cast<bool>(file);
+}
+
+// Read a PFM image, e.g. the disp0.pfm ground truth of Middlebury | rows are stored bottom to top
+// a negative scale marks little-endian floats, which is what the Middlebury files use
+bool ReadPFM(const std::string& fileName, std::vector<float>& image, int& width, int& height)
 {
-    int imgSize = width * height;
+    std::ifstream file(fileName, std::ios::binary);
+    std::string type;
+    float scale = 0;
+    if (!(file >> type >> width >> height >> scale) || type != "Pf" || scale >= 0) return false;
+    file.get();
 
-    int halfWindowSize = (windowSize - 1) / 2;
+    image.resize(static_cast<size_t>(width) * height);
+    for (int y = height - 1; y >= 0; y--)
+    {
+        file.read(reinterpret_cast<char*>(&image[static_cast<size_t>(y) * width]), sizeof(float) * width);
+    }
+    return static_cast<bool>(file);
+}
 
+// Accuracy of a disparity map of the resized image against the full resolution ground truth, which is sampled at
+// the top left pixel of every resized block | pixels without ground truth (inf) are skipped
+struct disparity_accuracy {
+    double badRate = -1;    // share of the pixels off by more than the threshold in full resolution pixels, invalid ones included
+    double coverage = -1;   // share of the pixels with a valid (non-zero) disparity
+    double meanError = -1;  // mean absolute error of the valid pixels in full resolution pixels
+};
+
+disparity_accuracy EvaluateDisparities(const std::vector<int>& dispMap, int width, int height,
+    const std::vector<float>& groundTruth, int groundTruthWidth, int resizeFactor, float badThreshold)
+{
+    disparity_accuracy accuracy;
+    if (groundTruth.empty()) return accuracy;
+
+    long long known = 0, bad = 0, valid = 0;
+    double errorSum = 0;
     for (int y = 0; y < height; y++)
     {
         for (int x = 0; x < width; x++)
         {
-            int bestDisp = 0;
-            float bestZNCC = -100.0;
-            bool isBorderPixel = false;
+            float truth = groundTruth[static_cast<size_t>(y) * resizeFactor * groundTruthWidth + x * resizeFactor];
+            if (!(truth < std::numeric_limits<float>::infinity())) continue;
+            known++;
 
-            // handle borders | keep bestDisp at 0, so borders will be black
-            if (y >= height - halfWindowSize || x >= width - halfWindowSize ||
-                y <= halfWindowSize || x <= halfWindowSize)
+            int disparity = dispMap[y * width + x];
+            float error = std::abs(disparity * static_cast<float>(resizeFactor) - truth);
+            if (disparity == 0 || error > badThreshold) bad++;
+            if (disparity != 0)
             {
-                isBorderPixel = true;
+                valid++;
+                errorSum += error;
             }
+        }
+    }
+    if (known == 0) return accuracy;
 
-            if (!isBorderPixel)
-            {
-                for (int d = 0; d < maxDisparity; d++)
-                {
-                    float zncc = 0.0;
-                    float numerator = 0.0, denominator1 = 0.0, denominator2 = 0.0;
-                    float leftMean = 0.0, rightMean = 0.0;
+    accuracy.badRate = static_cast<double>(bad) / known;
+    accuracy.coverage = static_cast<double>(valid) / known;
+    accuracy.meanError = valid > 0 ? errorSum / valid : 0;
+    return accuracy;
+}
 
-                    // calculate mean for each window - changes for different disparities, as the rightmean is calculated based on the disparity
-                    int avgCount = 0;
-                    for (int winY = -halfWindowSize; winY < halfWindowSize; winY++)
-                    {
-                        for (int winX = -halfWindowSize; winX < halfWindowSize; winX++)
-                        {
-                            // don't allow pixel to go to previous row
-                            if (d > x + winX)
-                            {
-                                continue;
-                            }
-
-                            int leftPixelIndex = (y + winY) * width + (x + winX);
-                            int rightPixelIndex = (y + winY) * width + (x + winX - isLeftImage * d);
-                            if (rightPixelIndex >= imgSize ||
-                                rightPixelIndex <= 0)
-                            {
-                                continue;
-                            }
-
-                            leftMean += leftImage[leftPixelIndex];
-                            rightMean += rightImage[rightPixelIndex];
-                            avgCount++;
-                        }
+// FNV-1a hash of the resized images and search parameters a ZNCC cache file was computed from
+unsigned long long ZNCCCacheKey(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    int windowSize, int maxDisparity, int minDisparity)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    auto add = [&hash](unsigned char byte) { hash = (hash ^ byte) * 1099511628211ULL; };
+    for (unsigned char pixel : leftImage) add(pixel);
+    for (unsigned char pixel : rightImage) add(pixel);
+    for (int value : { windowSize, maxDisparity, minDisparity })
+    {
+        for (int i = 0; i < 4; i++) add(static_cast<unsigned char>(value >> (8 * i)));
+    }
+    return hash;
+}
 
-                    }
-                    leftMean = leftMean / avgCount;
-                    rightMean = rightMean / avgCount;
+// ZNCC maps of both directions stored as 16 bit disparities after the key and the size
+// false if the file is missing or was computed from other images or parameters
+bool LoadZNCCCache(const std::string& fileName, unsigned long long key, int width, int height,
+    std::vector<int>& leftDisparity, std::vector<int>& rightDisparity)
+{
+    std::ifstream file(fileName, std::ios::binary);
+    unsigned long long fileKey = 0;
+    int fileWidth = 0, fileHeight = 0;
+    file.read(reinterpret_cast<char*>(&fileKey), sizeof(fileKey));
+    file.read(reinterpret_cast<char*>(&fileWidth), sizeof(fileWidth));
+    file.read(reinterpret_cast<char*>(&fileHeight), sizeof(fileHeight));
+    if (!file || fileKey != key || fileWidth != width || fileHeight != height) return false;
 
-                    for (int winY = -halfWindowSize; winY < halfWindowSize; winY++)
-                    {
-                        for (int winX = -halfWindowSize; winX < halfWindowSize; winX++)
-                        {
-                            // don't allow pixel to go to previous row
-                            if (d > x + winX)
-                            {
-                                continue;
-                            }
-
-                            int leftPixelIndex = (y + winY) * width + (x + winX);
-                            int rightPixelIndex = (y + winY) * width + (x + winX - isLeftImage * d);
-                            if (rightPixelIndex >= imgSize ||
-                                rightPixelIndex <= 0)
-                            {
-                                continue;
-                            }
-
-                            // calculate zncc value for each window
-                            numerator += (leftImage[leftPixelIndex] - leftMean) * (rightImage[rightPixelIndex] - rightMean);
-                            denominator1 += pow(leftImage[leftPixelIndex] - leftMean, 2);
-                            denominator2 += pow(rightImage[rightPixelIndex] - rightMean, 2);
-
-                        }
+    std::vector<unsigned short> packed(static_cast<size_t>(width) * height * 2);
+    file.read(reinterpret_cast<char*>(packed.data()), sizeof(unsigned short) * packed.size());
+    if (!file) return false;
 
-                    }
+    leftDisparity.assign(packed.begin(), packed.begin() + packed.size() / 2);
+    rightDisparity.assign(packed.begin() + packed.size() / 2, packed.end());
+    return true;
+}
 
-                    float denominator = sqrt(denominator1) * sqrt(denominator2);
-                    if (denominator == 0) {
-                        continue;
-                    }
+bool SaveZNCCCache(const std::string& fileName, unsigned long long key, int width, int height,
+    const std::vector<int>& leftDisparity, const std::vector<int>& rightDisparity)
+{
+    std::ofstream file(fileName, std::ios::binary);
+    std::vector<unsigned short> packed(leftDisparity.begin(), leftDisparity.end());
+    packed.insert(packed.end(), rightDisparity.begin(), rightDisparity.end());
+    file.write(reinterpret_cast<const char*>(&key), sizeof(key));
+    file.write(reinterpret_cast<const char*>(&width), sizeof(width));
+    file.write(reinterpret_cast<const char*>(&height), sizeof(height));
+    file.write(reinterpret_cast<const char*>(packed.data()), sizeof(unsigned short) * packed.size());
+    return static_cast<bool>(file);
+}
 
-                    zncc = numerator / denominator;
-                    if (zncc > bestZNCC)
-                    {
-                        bestZNCC = zncc;
-                        bestDisp = d;
-                    }
-                }
+// One point of a parameter sweep | zncc is the time of the ZNCC maps of its window size, 0 if they came from the cache
+// postProcessing the time of its cross-check and occlusion filling
+struct sweep_point {
+    int windowSize, crossDiff, neighbours;
+    double znccSeconds = 0, postProcessingSeconds = 0;
+    disparity_accuracy accuracy;
+};
+
+// Evaluate every combination of the window sizes, cross-check differences and neighbourhoods on the resized images
+// the ZNCC maps are computed once per window size and kept in cacheDirectory, so later sweeps over other
+// post-processing settings skip them | the combinations are then cross-checked and filled by all threads
+std::vector<sweep_point> RunSweep(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    int width, int height, int maxDisparity, int minDisparity, int resizeFactor,
+    const std::vector<int>& windowSizes, const std::vector<int>& crossDiffs, const std::vector<int>& neighbourCounts,
+    const std::string& cacheDirectory, const std::vector<float>& groundTruth, int groundTruthWidth, float badThreshold)
+{
+    // ZNCC maps per window size, from the cache if it has them
+    std::vector<std::vector<int>> leftMaps(windowSizes.size()), rightMaps(windowSizes.size());
+    std::vector<double> znccSeconds(windowSizes.size(), 0);
+    for (size_t w = 0; w < windowSizes.size(); w++)
+    {
+        unsigned long long key = ZNCCCacheKey(leftImage, rightImage, windowSizes[w], maxDisparity, minDisparity);
+        std::string cacheFile = cacheDirectory + "zncc_cache_" + std::to_string(windowSizes[w]) + ".bin";
+        if (LoadZNCCCache(cacheFile, key, width, height, leftMaps[w], rightMaps[w]))
+        {
+            std::cout << "Window " << windowSizes[w] << ": ZNCC maps loaded from " << cacheFile << std::endl;
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        leftMaps[w].resize(static_cast<size_t>(width) * height);
+        rightMaps[w].resize(static_cast<size_t>(width) * height);
+        CalcZNCC(leftImage, rightImage, width, height, windowSizes[w], maxDisparity, leftMaps[w], 1, 0, 0, minDisparity);
+        CalcZNCC(rightImage, leftImage, width, height, windowSizes[w], maxDisparity, rightMaps[w], -1, 0, 0, minDisparity);
+        znccSeconds[w] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Window " << windowSizes[w] << ": ZNCC maps computed in " << znccSeconds[w] << " seconds" << std::endl;
+
+        if (!SaveZNCCCache(cacheFile, key, width, height, leftMaps[w], rightMaps[w]))
+        {
+            std::cout << "could not write " << cacheFile << std::endl;
+        }
+    }
+
+    // every post-processing combination of every window size
+    std::vector<sweep_point> points;
+    std::vector<size_t> pointWindows;
+    for (size_t w = 0; w < windowSizes.size(); w++)
+    {
+        for (int crossDiff : crossDiffs)
+        {
+            for (int neighbours : neighbourCounts)
+            {
+                sweep_point point;
+                point.windowSize = windowSizes[w];
+                point.crossDiff = crossDiff;
+                point.neighbours = neighbours;
+                point.znccSeconds = znccSeconds[w];
+                points.push_back(point);
+                pointWindows.push_back(w);
             }
+        }
+    }
 
-            disparityMap[y * width + x] = bestDisp;
+    // worker threads take one combination at a time from a shared queue
+    std::atomic<size_t> nextPoint(0);
+    auto worker = [&]() {
+        std::vector<int> crossCheckedMap(static_cast<size_t>(width) * height), filledMap(static_cast<size_t>(width) * height);
+        for (size_t i = nextPoint++; i < points.size(); i = nextPoint++)
+        {
+            sweep_point& point = points[i];
+            auto start = std::chrono::steady_clock::now();
+            CrossCheck(leftMaps[pointWindows[i]], rightMaps[pointWindows[i]], width, height, point.crossDiff, crossCheckedMap);
+            OcclusionFilling(crossCheckedMap, width, height, point.neighbours, filledMap);
+            point.postProcessingSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            point.accuracy = EvaluateDisparities(filledMap, width, height, groundTruth, groundTruthWidth, resizeFactor, badThreshold);
         }
+    };
+
+    unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threadCount; i++)
+    {
+        workers.emplace_back(worker);
     }
+    worker();
+    for (std::thread& thread : workers) thread.join();
+    return points;
 }
 
-void CrossCheck(const std::vector<int>& dispMapLeft, const std::vector<int>& dispMapRight, const int& width, const int& height, const int& crossDiff, std::vector<int>& crossDispMap)
+// Whole dense pipeline on RGBA images of width x height | ndisp is the disparity range of the resized images and
+// the normalized depthmap is left in workspace.depthmap
+// with subpixel the filled disparities are refined to workspace.refined, which is what is normalized then
+// disparities from minDisparity of the resized image up to ndisp are searched
+void RunDensePipeline(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    unsigned int width, unsigned int height, unsigned int resizeFactor, int windowSize, int ndisp, int nCount, int crossDiff,
+    stereo_workspace& workspace, bool subpixel = false, bool equiangular = false, int minDisparity = 0)
 {
-    // Loop over all pixels inside the image boundary
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width ; x++) {
-
-            // Get the disparity values for the current pixel in both directions
-            int dispLeft = dispMapLeft[y * width + x];
-            int dispRight = dispMapRight[y * width + x];
-
-            // Check if the disparity values agree | abs used to account for rounding errors
-            if (std::abs(dispLeft - dispRight) <= crossDiff) {
-                // If the disparities agree, use the left disparity value as the final disparity for the pixel
-                crossDispMap[y * width + x] = dispLeft;
-            }
-            else {
-                // Otherwise, mark the pixel as invalid
-                crossDispMap[y * width + x] = 0;
-            }
+    PrepareWorkspace(workspace, width, height, resizeFactor, subpixel);
+
+    // convert image to grayscale and resize
+    GrayScaleImageConversion(leftImage, width, height, workspace.leftGray);
+    GrayScaleImageConversion(rightImage, width, height, workspace.rightGray);
+    ResizeImage(workspace.leftGray, width, height, resizeFactor, workspace.leftResized);
+    ResizeImage(workspace.rightGray, width, height, resizeFactor, workspace.rightResized);
+
+    width = width / resizeFactor;
+    height = height / resizeFactor;
+
+    // apply zncc, cross-check, occlusion filling and normalization to 8 bit
+    CalcZNCC(workspace.leftResized, workspace.rightResized, width, height, windowSize, ndisp, workspace.leftDisparity, 1, 0, 0, minDisparity);
+    CalcZNCC(workspace.rightResized, workspace.leftResized, width, height, windowSize, ndisp, workspace.rightDisparity, -1, 0, 0, minDisparity);
+    CrossCheck(workspace.leftDisparity, workspace.rightDisparity, width, height, crossDiff, workspace.crossChecked);
+    OcclusionFilling(workspace.crossChecked, width, height, nCount, workspace.filled);
+    if (subpixel)
+    {
+        RefineSubpixel(workspace.leftResized, workspace.rightResized, width, height, windowSize, ndisp,
+            workspace.crossChecked, workspace.filled, equiangular, workspace.refined);
+        NormalizeToChar(workspace.refined, width, height, ndisp, workspace.depthmap);
+    }
+    else
+    {
+        NormalizeToChar(workspace.filled, width, height, ndisp, workspace.depthmap);
+    }
+}
+
+// Disparities of RGBA images of width x height within budgetSeconds | levels are resize factors from the coarsest to
+// the finest, e.g. 16, 8, 4 | the coarsest level searches the full range and always completes, every finer level
+// only searches around the upsampled cross-checked disparities of the previous one | a level is skipped with all the
+// finer ones when the time per evaluated disparity of the previous level predicts it would end after the budget
+// ndisp and minDisparity are disparities of the full resolution image, crossDiff of the finest level | no level completes
+// if levels is empty
+anytime_result CalcDisparityAnytime(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    unsigned int width, unsigned int height, const std::vector<int>& levels, int windowSize, int ndisp, int minDisparity,
+    int nCount, int crossDiff, double budgetSeconds)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&start]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    std::vector<unsigned char> leftGray(static_cast<size_t>(width) * height), rightGray(static_cast<size_t>(width) * height);
+    GrayScaleImageConversion(leftImage, width, height, leftGray);
+    GrayScaleImageConversion(rightImage, width, height, rightGray);
+
+    anytime_result result;
+    temporal_state temporal;
+    temporal.keyframeInterval = static_cast<int>(levels.size()) + 1;
+    std::vector<int> crossChecked;
+    double secondsPerEvaluation = 0, evaluationsPerPixel = 0;
+    for (size_t level = 0; level < levels.size(); level++)
+    {
+        int resizeFactor = levels[level];
+        int levelWidth = width / resizeFactor;
+        int levelHeight = height / resizeFactor;
+        int levelDisp = ndisp * (static_cast<float>(levelWidth) / width);
+        int levelMinDisp = minDisparity * (static_cast<float>(levelWidth) / width);
+        int levelCrossDiff = std::max(1, crossDiff * levels.back() / resizeFactor);
+
+        // prior of this level from the previous one | the search radius covers the previous level's rounding
+        // and an error of one of its pixels
+        if (level > 0)
+        {
+            int ratio = levels[level - 1] / resizeFactor;
+            UpsampleDisparities(crossChecked, width / levels[level - 1], height / levels[level - 1], levels[level - 1],
+                levelWidth, levelHeight, resizeFactor, temporal.prior);
+            temporal.searchRadius = 2 * std::max(1, ratio);
+
+            // disparities per pixel are those of the radius, or as many as the previous prior search needed with its fallbacks
+            // plus a margin, as finer levels fall back to the full range more often
+            double perPixel = std::min(levelDisp, 2 * temporal.searchRadius + 1);
+            if (level > 1) perPixel = std::max(perPixel, evaluationsPerPixel);
+            double predictedEvaluations = 2.0 * levelWidth * levelHeight * perPixel * anytimeMargin;
+            if (elapsed() + predictedEvaluations * secondsPerEvaluation > budgetSeconds) break;
+        }
+
+        double levelStart = elapsed();
+        std::vector<unsigned char> leftResized(static_cast<size_t>(width) * height / (resizeFactor * resizeFactor));
+        std::vector<unsigned char> rightResized(leftResized.size());
+        ResizeImage(leftGray, width, height, resizeFactor, leftResized);
+        ResizeImage(rightGray, width, height, resizeFactor, rightResized);
+
+        std::vector<int> leftDisparity(static_cast<size_t>(levelWidth) * levelHeight), rightDisparity(leftDisparity.size());
+        temporal.evaluations = 0;
+        if (level == 0)
+        {
+            CalcZNCC(leftResized, rightResized, levelWidth, levelHeight, windowSize, levelDisp, leftDisparity, 1, 0, 0, levelMinDisp);
+            CalcZNCC(rightResized, leftResized, levelWidth, levelHeight, windowSize, levelDisp, rightDisparity, -1, 0, 0, levelMinDisp);
+            temporal.evaluations = 2LL * levelWidth * levelHeight * (levelDisp - levelMinDisp);
+        }
+        else
+        {
+            CalcZNCCTemporal(leftResized, rightResized, levelWidth, levelHeight, windowSize, levelDisp, temporal, leftDisparity, 1, levelMinDisp);
+            CalcZNCCTemporal(rightResized, leftResized, levelWidth, levelHeight, windowSize, levelDisp, temporal, rightDisparity, -1, levelMinDisp);
         }
+
+        crossChecked.resize(leftDisparity.size());
+        CrossCheck(leftDisparity, rightDisparity, levelWidth, levelHeight, levelCrossDiff, crossChecked);
+        result.disparities.resize(leftDisparity.size());
+        OcclusionFilling(crossChecked, levelWidth, levelHeight, nCount, result.disparities);
+
+        result.quality.resize(result.disparities.size());
+        for (size_t i = 0; i < result.disparities.size(); i++)
+        {
+            unsigned char filled = crossChecked[i] == 0 ? QUALITY_FILLED : 0;
+            result.quality[i] = result.disparities[i] == 0 ? 0 : static_cast<unsigned char>((level + 1) | filled);
+        }
+        result.levelsCompleted = static_cast<int>(level) + 1;
+        secondsPerEvaluation = (elapsed() - levelStart) / std::max(1LL, temporal.evaluations);
+        evaluationsPerPixel = temporal.evaluations / (2.0 * levelWidth * levelHeight);
+    }
+
+    // without levels there is nothing to return | skipped levels still leave the result at the resolution of the finest one
+    if (result.levelsCompleted == 0) return result;
+    int completedFactor = levels[result.levelsCompleted - 1];
+    if (completedFactor != levels.back())
+    {
+        UpsampleAnytimeResult(result, width / completedFactor, height / completedFactor, completedFactor,
+            width / levels.back(), height / levels.back(), levels.back());
     }
+    return result;
 }
 
-void OcclusionFilling(const std::vector<int>& dispMap, const int& width, const int& height, const int& nCount, std::vector<int>& dispMapFilled)
+// Occlusion filled disparities of the resized images inside the regions only, one vector of width * height values per region
+// matching and cross-checking run on the regions grown by the occlusion filling neighbourhood, which is all the filling reads,
+// so the values are the same as those of the full frame pipeline | overlapping regions share the matched pixels
+std::vector<std::vector<int>> CalcDisparityROIs(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    int width, int height, int windowSize, int maxDisparity, int nCount, int crossDiff, const std::vector<roi>& regions,
+    int minDisparity = 0)
 {
-    // Copy the input disparity map to the output disparity map
-    std::copy(dispMap.begin(), dispMap.end(), dispMapFilled.begin());
+    int halfWindowSize = (windowSize - 1) / 2;
+    std::vector<int> crossCheckedMap(static_cast<size_t>(width) * height);
+    std::vector<char> matched(crossCheckedMap.size(), 0);
+
+    // apply zncc in both directions and cross-check the pixels the filling of the regions reads
+    for (const roi& region : regions)
+    {
+        roi grown = GrowRegion(region, nCount / 2, width, height);
+        for (int y = grown.y; y < grown.y + grown.height; y++)
+        {
+            for (int x = grown.x; x < grown.x + grown.width; x++)
+            {
+                if (matched[y * width + x] || IsBorderPixel(x, y, width, height, halfWindowSize)) continue;
 
-    // Loop over all pixels inside the image boundary
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
+                int dispLeft = PixelDisparity(leftImage, rightImage, width, height, x, y, halfWindowSize, maxDisparity, 1, NULL, minDisparity);
+                int dispRight = PixelDisparity(rightImage, leftImage, width, height, x, y, halfWindowSize, maxDisparity, -1, NULL, minDisparity);
+                crossCheckedMap[y * width + x] = std::abs(dispLeft - dispRight) <= crossDiff ? dispLeft : 0;
+                matched[y * width + x] = 1;
+            }
+        }
+    }
 
-            // handle borders | keep bestDisp at 0, so borders will stay black
-            if (y >= height - (nCount / 2) || x >= width - (nCount / 2)  ||
-                y <= nCount / 2 || x <= nCount / 2)
+    // occlusion filling of the regions themselves
+    std::vector<std::vector<int>> disparities;
+    for (const roi& region : regions)
+    {
+        roi clipped = GrowRegion(region, 0, width, height);
+        std::vector<int> regionDisparities(static_cast<size_t>(std::max(0, region.width)) * std::max(0, region.height), 0);
+        for (int y = clipped.y; y < clipped.y + clipped.height; y++)
+        {
+            for (int x = clipped.x; x < clipped.x + clipped.width; x++)
             {
-                continue;
+                int disparity = crossCheckedMap[y * width + x];
+                if (!IsBorderPixel(x, y, width, height, nCount / 2))
+                {
+                    disparity = FilledDisparity(crossCheckedMap, width, x, y, nCount);
+                }
+                regionDisparities[(y - region.y) * region.width + (x - region.x)] = disparity;
             }
+        }
+        disparities.push_back(regionDisparities);
+    }
+    return disparities;
+}
+
+// State of incremental re-matching of a video | tiles of the resized images that changed since their disparities
+// were computed are matched again, the disparities of all others are kept in the cache
+struct incremental_state : incremental_base {
+    std::vector<unsigned char> referenceLeft, referenceRight;  // resized gray images every tile was last matched on
+    std::vector<int> cache;     // occlusion filled disparities of the previous frame
+};
+
+// Sum of the absolute differences of every tile of two resized gray images, row by row
+std::vector<unsigned int> TileChanges(const std::vector<unsigned char>& currentImage, const std::vector<unsigned char>& previousImage,
+    int width, int height, int tileSize)
+{
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<unsigned int> tileDiffs(static_cast<size_t>(tilesX) * tilesY, 0);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            tileDiffs[(y / tileSize) * tilesX + x / tileSize] += std::abs(currentImage[y * width + x] - previousImage[y * width + x]);
+        }
+    }
+    return tileDiffs;
+}
 
-            // Check if the current pixel is marked as invalid
-            if (dispMap[y * width + x] == 0) {
+// Occlusion filled disparities of a frame of a video, matched again only where tiles changed since the previous
+// frames | keyframes and the first frame are matched in full
+void CalcDisparityIncremental(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    int width, int height, int windowSize, int maxDisparity, int nCount, int crossDiff, incremental_state& state,
+    std::vector<int>& dispMapFilled, int minDisparity = 0)
+{
+    bool keyframe = state.cache.size() != static_cast<size_t>(width) * height || state.frame % state.keyframeInterval == 0;
+    state.frame++;
 
-                // Initialize the list of valid disparity values in the n-neighborhood of the current pixel
-                std::vector<int> neighbors;
+    std::vector<roi> regions;
+    if (keyframe)
+    {
+        regions.push_back({ 0, 0, width, height });
+        state.referenceLeft = leftImage;
+        state.referenceRight = rightImage;
+        state.cache.assign(static_cast<size_t>(width) * height, 0);
+    }
+    else
+    {
+        // a tile only counts as changed against the images it was last matched on, so slow drifts add up until
+        // they are matched again
+        std::vector<roi> tiles = ChangedTiles(TileChanges(leftImage, state.referenceLeft, width, height, state.tileSize),
+            TileChanges(rightImage, state.referenceRight, width, height, state.tileSize), width, height, state.tileSize, state.threshold);
+        int halfWindowSize = (windowSize - 1) / 2;
+        regions = AffectedRegions(tiles, width, height, halfWindowSize + maxDisparity + nCount / 2, halfWindowSize + nCount / 2);
+        for (const roi& tile : tiles)
+        {
+            for (int y = tile.y; y < tile.y + tile.height; y++)
+            {
+                std::copy(leftImage.begin() + y * width + tile.x, leftImage.begin() + y * width + tile.x + tile.width,
+                    state.referenceLeft.begin() + y * width + tile.x);
+                std::copy(rightImage.begin() + y * width + tile.x, rightImage.begin() + y * width + tile.x + tile.width,
+                    state.referenceRight.begin() + y * width + tile.x);
+            }
+        }
+    }
 
-                // Loop over the n-neighbors of the current pixel
-                for (int dy = -nCount / 2; dy <= nCount / 2; dy++) {
-                    for (int dx = -nCount / 2; dx <= nCount/ 2; dx++) {
-                        // Skip the center pixel
-                        if (dx == 0 && dy == 0) continue;
+    // the matched regions replace their part of the cache
+    std::vector<std::vector<int>> disparities = CalcDisparityROIs(leftImage, rightImage, width, height, windowSize, maxDisparity, nCount, crossDiff, regions,
+        minDisparity);
+    state.recomputedPixels = 0;
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+        const roi& region = regions[i];
+        for (int y = 0; y < region.height; y++)
+        {
+            std::copy(disparities[i].begin() + y * region.width, disparities[i].begin() + (y + 1) * region.width,
+                state.cache.begin() + (region.y + y) * width + region.x);
+        }
+        state.recomputedPixels += static_cast<long long>(region.width) * region.height;
+    }
+    dispMapFilled = state.cache;
+}
 
-                        // Get the disparity value for the current neighbor
-                        int neighbor_disp = dispMap[(y + dy) * width + (x + dx)];
+// Corners of the image by the Harris response, strongest first, at most maxCorners
+// points closer than border to the edge of the image are skipped, so their matching windows are inside the image
+std::vector<keypoint> DetectCorners(const std::vector<unsigned char>& image, int width, int height, int maxCorners, int border)
+{
+    // gradients by central differences
+    std::vector<float> gradX(static_cast<size_t>(width) * height, 0), gradY(gradX.size(), 0);
+    for (int y = 1; y < height - 1; y++)
+    {
+        for (int x = 1; x < width - 1; x++)
+        {
+            gradX[y * width + x] = (image[y * width + x + 1] - image[y * width + x - 1]) / 2.0f;
+            gradY[y * width + x] = (image[(y + 1) * width + x] - image[(y - 1) * width + x]) / 2.0f;
+        }
+    }
 
-                        // If the neighbor is valid, add its disparity value to the list
-                        if (neighbor_disp > 0) {
-                            neighbors.push_back(neighbor_disp);
-                        }
-                    }
+    // Harris response det(M) - k * trace(M)^2 of the structure tensor summed over a 3x3 neighbourhood
+    const float k = 0.04f;
+    std::vector<float> response(gradX.size(), 0);
+    for (int y = 2; y < height - 2; y++)
+    {
+        for (int x = 2; x < width - 2; x++)
+        {
+            float xx = 0, yy = 0, xy = 0;
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    float gx = gradX[(y + dy) * width + x + dx];
+                    float gy = gradY[(y + dy) * width + x + dx];
+                    xx += gx * gx;
+                    yy += gy * gy;
+                    xy += gx * gy;
                 }
+            }
+            response[y * width + x] = xx * yy - xy * xy - k * (xx + yy) * (xx + yy);
+        }
+    }
 
-                // If at least one valid disparity value was found in the n-neighborhood,
-                // set the current pixel's disparity value to the median of the valid values
-                if (!neighbors.empty()) {
-                    dispMapFilled[y * width + x] = neighbors[neighbors.size() / 2];
+    // local maxima of the 3x3 neighbourhood with a positive response
+    std::vector<std::pair<float, keypoint>> candidates;
+    int start = std::max(border + 1, 2);
+    for (int y = start; y < height - start; y++)
+    {
+        for (int x = start; x < width - start; x++)
+        {
+            float value = response[y * width + x];
+            bool isMaximum = value > 0;
+            for (int dy = -1; dy <= 1 && isMaximum; dy++)
+            {
+                for (int dx = -1; dx <= 1 && isMaximum; dx++)
+                {
+                    if ((dx || dy) && response[(y + dy) * width + x + dx] >= value) isMaximum = false;
                 }
             }
+            if (isMaximum) candidates.push_back({ value, { x, y } });
         }
     }
+
+    std::sort(candidates.begin(), candidates.end(),
+        [](const std::pair<float, keypoint>& a, const std::pair<float, keypoint>& b) { return a.first > b.first; });
+    std::vector<keypoint> corners;
+    for (size_t i = 0; i < candidates.size() && corners.size() < static_cast<size_t>(maxCorners); i++)
+    {
+        corners.push_back(candidates[i].second);
+    }
+    return corners;
 }
 
-void NormalizeToChar(const std::vector<int>& dispMap, const int& width, const int& height, const int& ndisp, std::vector<unsigned char>& normVec)
+// Points handed to a worker at a time
+const int pointsPerTask = 64;
+
+// ZNCC disparity and peak score of the keypoints of the left image, in the order of the points
+// worker threads take pointsPerTask points at a time from a shared queue, so uneven points don't leave threads idle
+std::vector<point_disparity> CalcZNCCPoints(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    int width, int height, int windowSize, int maxDisparity, const std::vector<keypoint>& points, int minDisparity = 0)
 {
-    // Loop over all pixels and normalize the disparity values
-    for (int i = 0; i < width * height; i++) {
-        normVec[i] = static_cast<unsigned char>(static_cast<float>(dispMap[i]) / ndisp * 255);
+    int halfWindowSize = (windowSize - 1) / 2;
+    std::vector<point_disparity> results(points.size(), { 0, -100.0f });
+    std::atomic<size_t> nextPoint(0);
+
+    auto worker = [&]() {
+        for (size_t first = nextPoint.fetch_add(pointsPerTask); first < points.size(); first = nextPoint.fetch_add(pointsPerTask))
+        {
+            size_t last = std::min(points.size(), first + pointsPerTask);
+            for (size_t i = first; i < last; i++)
+            {
+                // handle borders | keep disparity at 0
+                if (IsBorderPixel(points[i].x, points[i].y, width, height, halfWindowSize)) continue;
+
+                results[i].disparity = PixelDisparity(leftImage, rightImage, width, height, points[i].x, points[i].y,
+                    halfWindowSize, maxDisparity, 1, &results[i].score, minDisparity);
+            }
+        }
+    };
+
+    unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threadCount; i++)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : workers) thread.join();
+    return results;
+}
+
+// PNG decoded without color conversion | strips are converted to RGBA when they are processed
+struct decoded_png {
+    std::vector<unsigned char> raw;
+    lodepng::State state;
+    bool isRGBA = false;    // raw already holds 8 bit RGBA pixels
+    unsigned int width = 0, height = 0;
+};
+
+unsigned int DecodePNG(const char* fileName, decoded_png& png)
+{
+    std::vector<unsigned char> file;
+    unsigned int error = lodepng::load_file(file, fileName);
+    if (error) return error;
+
+    png.state.decoder.color_convert = 0;
+    error = lodepng::decode(png.raw, png.width, png.height, png.state, file);
+    if (error) return error;
+
+    // formats with less than 8 bits per pixel don't start every row on a byte, so they are converted up front
+    if ((static_cast<size_t>(png.width) * lodepng_get_bpp(&png.state.info_png.color)) % 8 != 0)
+    {
+        std::vector<unsigned char> rgba(static_cast<size_t>(png.width) * png.height * 4);
+        LodePNGColorMode rgbaMode = lodepng_color_mode_make(LCT_RGBA, 8);
+        error = lodepng_convert(rgba.data(), png.raw.data(), &rgbaMode, &png.state.info_png.color, png.width, png.height);
+        png.raw.swap(rgba);
+        png.isRGBA = true;
+    }
+    return error;
+}
+
+// Convert rows [firstRow, lastRow) of the decoded PNG into 8 bit RGBA pixels
+unsigned int ConvertRowsToRGBA(const decoded_png& png, unsigned int firstRow, unsigned int lastRow, std::vector<unsigned char>& out)
+{
+    out.resize(static_cast<size_t>(png.width) * (lastRow - firstRow) * 4);
+    if (png.isRGBA)
+    {
+        std::copy(png.raw.begin() + static_cast<size_t>(firstRow) * png.width * 4, png.raw.begin() + static_cast<size_t>(lastRow) * png.width * 4, out.begin());
+        return 0;
     }
+
+    size_t rowSize = static_cast<size_t>(png.width) * lodepng_get_bpp(&png.state.info_png.color) / 8;
+    LodePNGColorMode rgbaMode = lodepng_color_mode_make(LCT_RGBA, 8);
+    return lodepng_convert(out.data(), png.raw.data() + firstRow * rowSize, &rgbaMode, &png.state.info_png.color, png.width, lastRow - firstRow);
+}
+
+// Rows above and below a strip that are processed with it but not kept, so that the strip's own rows see the same
+// ZNCC windows and occlusion filling neighbourhoods as in the full image | in resized rows
+int StripHalo(int windowSize, int nCount)
+{
+    return (windowSize - 1) / 2 + nCount / 2 + 2;
+}
+
+// Bytes the strip pipeline holds per resized row | RGBA, grayscale and the copy ResizeImage takes of both images
+// at full resolution, and the resized images, four disparity maps and the normalized row at the resized resolution
+size_t StripBytesPerRow(unsigned int width, unsigned int resizeFactor)
+{
+    size_t fullResolution = static_cast<size_t>(width) * resizeFactor * (4 + 1 + 1) * 2;
+    size_t resized = static_cast<size_t>(width / resizeFactor) * (2 + 4 * sizeof(int) + 1);
+    return fullResolution + resized;
+}
+
+// Run the pipeline over horizontal strips of the decoded pair, so that the working set stays within memoryBudget bytes
+// only the decoded images and the resized depthmap are held in full | minDisparity up to ndisp is the disparity range of
+// the resized image | returns false if the budget does not fit a single row with its halo
+bool RunStrips(const decoded_png& leftPNG, const decoded_png& rightPNG, unsigned int resizeFactor, int windowSize, int ndisp,
+    int nCount, int crossDiff, size_t memoryBudget, std::vector<unsigned char>& depthmap, int minDisparity = 0)
+{
+    int width = leftPNG.width / resizeFactor;
+    int height = leftPNG.height / resizeFactor;
+    int halo = StripHalo(windowSize, nCount);
+
+    // own rows per strip from the budget, after the rows of the halo on both sides
+    long long budgetRows = static_cast<long long>(memoryBudget / StripBytesPerRow(leftPNG.width, resizeFactor)) - 2 * halo;
+    if (budgetRows < 1)
+    {
+        std::cout << "memory budget of " << memoryBudget << " bytes is too small for a strip, at least "
+            << (2 * halo + 1) * StripBytesPerRow(leftPNG.width, resizeFactor) << " bytes are needed" << std::endl;
+        return false;
+    }
+    int stripRows = static_cast<int>(std::min<long long>(budgetRows, height));
+    std::cout << "Processing " << (height + stripRows - 1) / stripRows << " strips of " << stripRows << " rows" << std::endl;
+
+    // strip buffers are reused, so they are allocated once at the size of the tallest strip
+    std::vector<unsigned char> leftImage, rightImage;
+    std::vector<unsigned char> leftImageGray, rightImageGray;
+    std::vector<unsigned char> leftImageResized, rightImageResized;
+    std::vector<int> leftImageDisparity, rightImageDisparity, crossCheckedMap, oclussionFilledMap;
+    std::vector<unsigned char> stripNormalized;
+    depthmap.assign(static_cast<size_t>(width) * height, 0);
+
+    for (int first = 0; first < height; first += stripRows)
+    {
+        int last = std::min(height, first + stripRows);
+        int haloFirst = std::max(0, first - halo);
+        int haloLast = std::min(height, last + halo);
+        int rows = haloLast - haloFirst;
+        size_t stripSize = static_cast<size_t>(width) * rows;
+
+        // convert the strip's rows to grayscale at full resolution
+        unsigned int error = ConvertRowsToRGBA(leftPNG, haloFirst * resizeFactor, haloLast * resizeFactor, leftImage);
+        if (!error) error = ConvertRowsToRGBA(rightPNG, haloFirst * resizeFactor, haloLast * resizeFactor, rightImage);
+        if (error) std::cout << "color conversion error: " << error << ": " << lodepng_error_text(error) << std::endl;
+
+        leftImageGray.resize(leftImage.size() / 4);
+        rightImageGray.resize(rightImage.size() / 4);
+        GrayScaleImageConversion(leftImage, leftPNG.width, rows * resizeFactor, leftImageGray);
+        GrayScaleImageConversion(rightImage, rightPNG.width, rows * resizeFactor, rightImageGray);
+
+        // resize | strips start on a multiple of resizeFactor, so the blocks are the same as in the full image
+        ResizeImage(leftImageGray, leftPNG.width, rows * resizeFactor, resizeFactor, leftImageResized);
+        ResizeImage(rightImageGray, rightPNG.width, rows * resizeFactor, resizeFactor, rightImageResized);
+
+        // apply zncc with the borders of the full image
+        leftImageDisparity.resize(stripSize);
+        rightImageDisparity.resize(stripSize);
+        CalcZNCC(leftImageResized, rightImageResized, width, rows, windowSize, ndisp, leftImageDisparity, 1, haloFirst, height, minDisparity);
+        CalcZNCC(rightImageResized, leftImageResized, width, rows, windowSize, ndisp, rightImageDisparity, -1, haloFirst, height, minDisparity);
+
+        // CrossChecking and occlusion filling
+        crossCheckedMap.resize(stripSize);
+        CrossCheck(leftImageDisparity, rightImageDisparity, width, rows, crossDiff, crossCheckedMap);
+        oclussionFilledMap.resize(stripSize);
+        OcclusionFilling(crossCheckedMap, width, rows, nCount, oclussionFilledMap, haloFirst, height);
+
+        // normalize and keep the strip's own rows
+        stripNormalized.resize(stripSize);
+        NormalizeToChar(oclussionFilledMap, width, rows, ndisp, stripNormalized);
+        std::copy(stripNormalized.begin() + static_cast<size_t>(first - haloFirst) * width,
+            stripNormalized.begin() + static_cast<size_t>(last - haloFirst) * width,
+            depthmap.begin() + static_cast<size_t>(first) * width);
+    }
+    return true;
 }
 
 int main()
@@ -253,6 +894,186 @@ int main()
 
     const char* depthmapOut = "../img/depthmap.png";
 
+    // fit the ZNCC scores around every cross-checked disparity for a float disparity, which gives the same depth
+    // resolution as matching at a smaller resize_factor | the float disparities of the resized image are written
+    // to refinedOut
+    bool subpixel = false;
+    bool equiangular = false;
+    const char* refinedOut = "../img/disparities.pfm";
+
+    // Middlebury calib.txt of the scene | if it exists, only its [vmin, vmax] disparities are searched instead of
+    // 0 to ndisp, which often is a small part of the range
+    const char* calibrationFile = "../img/calib.txt";
+    int minDisparity = 0;
+    calibration calib;
+    if (ReadCalibration(calibrationFile, calib))
+    {
+        ApplyCalibration(calib, resize_factor, ndisp, minDisparity);
+        std::cout << "Searching disparities " << minDisparity << " to " << ndisp << " from " << calibrationFile << std::endl;
+    }
+
+    // process the pair in horizontal strips whose working set stays within memoryBudget bytes, for images that don't
+    // fit in memory with the full size intermediate images | the decoded images and the depthmap are outside the budget
+    bool stripMode = false;
+    size_t memoryBudget = static_cast<size_t>(256) * 1024 * 1024;
+
+    // compute the depthmap only inside these rectangles of the resized image, each written to depthmap_roi_<index>.png
+    // empty for the full frame
+    std::vector<roi> regions;
+
+    // compute disparity and ZNCC score only for keypoints of the resized left image, written to keypointsOut
+    // as "x y disparity score" lines | without given keypoints up to maxKeypoints corners are detected
+    bool sparseMode = false;
+    std::vector<keypoint> keypoints;
+    int maxKeypoints = 2000;
+    const char* keypointsOut = "../img/keypoints.txt";
+
+    // process a video as a sequence of stereo frames, each frame searching only around the previous frame's disparities
+    // depthmaps are written to depthmap_<frame>.png
+    bool temporalMode = false;
+    std::vector<std::pair<std::string, std::string>> sequence = {
+        { "../img/im0.png", "../img/im1.png" },
+    };
+
+    // run the dense pipeline this many times on the pair, reusing one workspace | the heap allocations of the runs
+    // after the first are printed and are 0 once the workspace is sized
+    int runs = 1;
+#ifdef ZNCC_CHECK_ALLOCATIONS
+    // the check needs at least one run on the sized workspace
+    if (runs < 2) runs = 2;
+#endif
+
+    // process the sequence matching each frame again only in the tiles that changed since the previous one plus
+    // their halo, the rest keeps the cached disparities | takes precedence over temporalMode
+    bool incrementalMode = false;
+
+    // evaluate every combination of these window sizes, cross-check differences and occlusion neighbourhoods instead of
+    // win_size, crossDiff and neighbours | the ZNCC maps of each window size are cached in sweepCacheDirectory, so a
+    // sweep over other post-processing settings only matches again for new window sizes | the runtime of every point
+    // and, if groundTruthFile exists, its share of pixels off by more than badThreshold is written to sweepOut
+    bool sweepMode = false;
+    std::vector<int> sweepWindows = { 9, 11, 15 };
+    std::vector<int> sweepCrossDiffs = { 8, 16, 32 };
+    std::vector<int> sweepNeighbours = { 8, 16, 32 };
+    const char* sweepCacheDirectory = "../img/";
+    const char* groundTruthFile = "../img/disp0.pfm";
+    float badThreshold = 2.0f;
+    const char* sweepOut = "../profiling/cpu_sweep.csv";
+
+    // return the best depthmap completed within latencyBudget seconds | the pair is matched at anytimeLevels from the
+    // coarsest to resize_factor, every level only around the disparities of the previous one, and the finest completed
+    // level is written | the quality flags of its pixels (level, QUALITY_FILLED) are written to qualityOut
+    bool anytimeMode = false;
+    double latencyBudget = 0.03;
+    int finestLevel = static_cast<int>(resize_factor);
+    std::vector<int> anytimeLevels = { 4 * finestLevel, 2 * finestLevel, finestLevel };
+    const char* qualityOut = "../img/quality.png";
+
+    if (temporalMode || incrementalMode)
+    {
+        temporal_state state;
+        incremental_state incremental;
+        for (size_t frame = 0; frame < sequence.size(); frame++)
+        {
+            std::vector<unsigned char> leftImage, rightImage;
+            unsigned int width, height;
+            unsigned int error = lodepng::decode(leftImage, width, height, sequence[frame].first, LCT_RGBA, 8);
+            if (!error) error = lodepng::decode(rightImage, width, height, sequence[frame].second, LCT_RGBA, 8);
+            if (error)
+            {
+                std::cout << "decoder error frame " << frame << ": " << error << ": " << lodepng_error_text(error) << std::endl;
+                return 1;
+            }
+
+            // convert to grayscale and resize
+            std::vector<unsigned char> leftImageGray(width * height), rightImageGray(width * height);
+            GrayScaleImageConversion(leftImage, width, height, leftImageGray);
+            GrayScaleImageConversion(rightImage, width, height, rightImageGray);
+            std::vector<unsigned char> leftImageResized, rightImageResized;
+            ResizeImage(leftImageGray, width, height, resize_factor, leftImageResized);
+            ResizeImage(rightImageGray, width, height, resize_factor, rightImageResized);
+
+            int frameDisp = ndisp * (static_cast<float>(width / resize_factor) / width);
+            int frameMinDisp = minDisparity * (static_cast<float>(width / resize_factor) / width);
+            width = width / resize_factor;
+            height = height / resize_factor;
+
+            if (incrementalMode)
+            {
+                std::vector<int> oclussionFilledMap;
+                CalcDisparityIncremental(leftImageResized, rightImageResized, width, height, win_size, frameDisp, neighbours, crossDiff, incremental, oclussionFilledMap,
+                    frameMinDisp);
+                std::vector<unsigned char> depthmapNormalized(width * height);
+                NormalizeToChar(oclussionFilledMap, width, height, frameDisp, depthmapNormalized);
+
+                std::cout << "Frame " << frame << ": " << 100.0 * incremental.recomputedPixels / std::max(1u, width * height)
+                    << "% of the pixels matched again" << std::endl;
+
+                error = lodepng::encode("../img/depthmap_" + std::to_string(frame) + ".png", depthmapNormalized, width, height, LCT_GREY, 8);
+                if (error) std::cout << "encoder error: " << error << ": " << lodepng_error_text(error) << std::endl;
+                continue;
+            }
+
+            // apply zncc around the prior, then cross-check and keep the result as the next prior
+            BeginTemporalFrame(state, width, height);
+            std::vector<int> leftImageDisparity(width * height), rightImageDisparity(width * height);
+            CalcZNCCTemporal(leftImageResized, rightImageResized, width, height, win_size, frameDisp, state, leftImageDisparity, 1, frameMinDisp);
+            CalcZNCCTemporal(rightImageResized, leftImageResized, width, height, win_size, frameDisp, state, rightImageDisparity, -1, frameMinDisp);
+
+            std::vector<int> crossCheckedMap(width * height);
+            CrossCheck(leftImageDisparity, rightImageDisparity, width, height, crossDiff, crossCheckedMap);
+            EndTemporalFrame(state, crossCheckedMap);
+
+            std::vector<int> oclussionFilledMap(width * height);
+            OcclusionFilling(crossCheckedMap, width, height, neighbours, oclussionFilledMap);
+            std::vector<unsigned char> depthmapNormalized(width * height);
+            NormalizeToChar(oclussionFilledMap, width, height, frameDisp, depthmapNormalized);
+
+            std::cout << "Frame " << frame << ": " << 100.0 * (1.0 - static_cast<double>(state.evaluations) / std::max(1LL, state.fullEvaluations))
+                << "% of the disparity evaluations saved" << std::endl;
+
+            error = lodepng::encode("../img/depthmap_" + std::to_string(frame) + ".png", depthmapNormalized, width, height, LCT_GREY, 8);
+            if (error) std::cout << "encoder error: " << error << ": " << lodepng_error_text(error) << std::endl;
+        }
+        return 0;
+    }
+
+    if (stripMode)
+    {
+        decoded_png leftPNG, rightPNG;
+        unsigned int error = DecodePNG(leftImgName, leftPNG);
+        if (error) std::cout << "decoder error first image: " << error << ": " << lodepng_error_text(error) << std::endl;
+
+        error = DecodePNG(rightImgName, rightPNG);
+        if (error) std::cout << "decoder error second image: " << error << ": " << lodepng_error_text(error) << std::endl;
+
+        // start timing execution time
+        LARGE_INTEGER start, end, frequency;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+
+        unsigned int width = leftPNG.width / resize_factor;
+        unsigned int height = leftPNG.height / resize_factor;
+        ndisp = ndisp * (static_cast<float>(width) / leftPNG.width);
+        int resizedMinDisp = minDisparity * (static_cast<float>(width) / leftPNG.width);
+
+        std::vector<unsigned char> depthmapNormalized;
+        if (!RunStrips(leftPNG, rightPNG, resize_factor, win_size, ndisp, neighbours, crossDiff, memoryBudget, depthmapNormalized,
+            resizedMinDisp))
+        {
+            return 1;
+        }
+
+        // end execution timing and print
+        QueryPerformanceCounter(&end);
+        double elapsed_time = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+        std::cout << "Elapsed time: " << elapsed_time << " seconds\n";
+
+        error = lodepng::encode(depthmapOut, depthmapNormalized, width, height, LCT_GREY, 8);
+        if (error) std::cout << "encoder error: " << error << ": " << lodepng_error_text(error) << std::endl;
+        return 0;
+    }
+
     // create containers for raw images
     std::vector<unsigned char> leftImage;
     std::vector<unsigned char> rightImage;
@@ -273,6 +1094,69 @@ int main()
 
     QueryPerformanceCounter(&start);
 
+    if (anytimeMode)
+    {
+        anytime_result anytime = CalcDisparityAnytime(leftImage, rightImage, width, height, anytimeLevels, win_size, ndisp, minDisparity,
+            neighbours, crossDiff, latencyBudget);
+
+        // end execution timing and print
+        QueryPerformanceCounter(&end);
+        elapsed_time = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+        std::cout << "Completed " << anytime.levelsCompleted << " of " << anytimeLevels.size() << " levels" << std::endl;
+        std::cout << "Elapsed time: " << elapsed_time << " seconds\n";
+        if (anytime.levelsCompleted == 0) return 1;
+
+        int resizedWidth = width / resize_factor;
+        int resizedHeight = height / resize_factor;
+        int resizedDisp = ndisp * (static_cast<float>(resizedWidth) / width);
+        std::vector<unsigned char> depthmap(anytime.disparities.size());
+        NormalizeToChar(anytime.disparities, resizedWidth, resizedHeight, resizedDisp, depthmap);
+        error = lodepng::encode(depthmapOut, depthmap, resizedWidth, resizedHeight, LCT_GREY, 8);
+        if (error) std::cout << "encoder error: " << error << ": " << lodepng_error_text(error) << std::endl;
+        error = lodepng::encode(qualityOut, anytime.quality, resizedWidth, resizedHeight, LCT_GREY, 8);
+        if (error) std::cout << "encoder error: " << error << ": " << lodepng_error_text(error) << std::endl;
+        return 0;
+    }
+
+    if (!sparseMode && regions.empty() && !sweepMode)
+    {
+        int resizedDisp = ndisp * (static_cast<float>(width / resize_factor) / width);
+        int resizedMinDisp = minDisparity * (static_cast<float>(width / resize_factor) / width);
+        stereo_workspace workspace;
+        for (int run = 0; run < runs; run++)
+        {
+            long long allocationsBefore = heapAllocations;
+            RunDensePipeline(leftImage, rightImage, width, height, resize_factor, win_size, resizedDisp, neighbours, crossDiff, workspace,
+                subpixel, equiangular, resizedMinDisp);
+            long long allocations = heapAllocations - allocationsBefore;
+            if (run > 0) std::cout << "Run " << run << ": " << allocations << " heap allocations" << std::endl;
+#ifdef ZNCC_CHECK_ALLOCATIONS
+            if (run > 0 && allocations > 0)
+            {
+                std::cerr << "Run " << run << " allocated on the heap although the workspace is sized" << std::endl;
+                return 1;
+            }
+#endif
+        }
+
+        // end execution timing and print
+        QueryPerformanceCounter(&end);
+
+        elapsed_time = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+        std::cout << "Elapsed time: " << elapsed_time << " seconds\n";
+
+        std::cout << "Elapsed time: " << elapsed_time / 60 << " minutes\n";
+
+        // encode resized and grayscaled images (im*_out)
+        error = lodepng::encode(depthmapOut, workspace.depthmap, width / resize_factor, height / resize_factor, LCT_GREY, 8);
+        if (error) std::cout << "encoder error first image: " << error << ": " << lodepng_error_text(error) << std::endl;
+        if (subpixel && !WritePFM(refinedOut, workspace.refined, width / resize_factor, height / resize_factor))
+        {
+            std::cout << "could not write " << refinedOut << std::endl;
+        }
+        return 0;
+    }
+
     // convert image to grayscale, ignoring the alpha channel
     std::vector<unsigned char> leftImageGray(width * height);
     std::vector<unsigned char> rightImageGray(width * height);
@@ -290,34 +1174,81 @@ int main()
     width = width / resize_factor;
     height = height / resize_factor;
     ndisp = ndisp * (static_cast<float>(width) / oldWidth);
+    int resizedMinDisp = minDisparity * (static_cast<float>(width) / oldWidth);
+
+    if (sweepMode)
+    {
+        std::vector<float> groundTruth;
+        int groundTruthWidth = 0, groundTruthHeight = 0;
+        if (!ReadPFM(groundTruthFile, groundTruth, groundTruthWidth, groundTruthHeight))
+        {
+            std::cout << "no ground truth in " << groundTruthFile << ", timing only" << std::endl;
+            groundTruth.clear();
+        }
+        std::vector<sweep_point> points = RunSweep(leftImageResized, rightImageResized, width, height, ndisp, resizedMinDisp,
+            resize_factor, sweepWindows, sweepCrossDiffs, sweepNeighbours, sweepCacheDirectory, groundTruth, groundTruthWidth,
+            badThreshold);
 
-    // apply zncc
-    std::vector<int> leftImageDisparity(width * height);
-    std::vector<int> rightImageDisparity(width * height);
-    CalcZNCC(leftImageResized, rightImageResized, width, height, win_size, ndisp, leftImageDisparity);
-    CalcZNCC(rightImageResized, leftImageResized, width, height, win_size, ndisp, rightImageDisparity, -1);
+        // end execution timing and print
+        QueryPerformanceCounter(&end);
+        elapsed_time = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+        std::cout << "Swept " << points.size() << " points" << std::endl;
+        std::cout << "Elapsed time: " << elapsed_time << " seconds\n";
 
-    // CrossChecking
-    std::vector<int> crossCheckedMap(width * height);
-    CrossCheck(leftImageDisparity, rightImageDisparity, width, height, crossDiff, crossCheckedMap);
+        std::ofstream file(sweepOut);
+        file << "window,cross_diff,neighbours,zncc_s,post_processing_s,bad_rate,coverage,mean_error\n";
+        for (const sweep_point& point : points)
+        {
+            std::cout << "win " << point.windowSize << " crossDiff " << point.crossDiff << " neighbours " << point.neighbours
+                << ": " << point.postProcessingSeconds << " s post-processing, bad " << point.accuracy.badRate * 100 << "%" << std::endl;
+            file << point.windowSize << "," << point.crossDiff << "," << point.neighbours << "," << point.znccSeconds << ","
+                << point.postProcessingSeconds << "," << point.accuracy.badRate << "," << point.accuracy.coverage << ","
+                << point.accuracy.meanError << "\n";
+        }
+        return 0;
+    }
 
-    // occlusion filling
-    std::vector<int> oclussionFilledMap(width * height);
-    OcclusionFilling(crossCheckedMap, width, height, neighbours, oclussionFilledMap);
+    if (sparseMode)
+    {
+        if (keypoints.empty())
+        {
+            keypoints = DetectCorners(leftImageResized, width, height, maxKeypoints, (win_size - 1) / 2);
+        }
+        std::vector<point_disparity> pointDisparities = CalcZNCCPoints(leftImageResized, rightImageResized, width, height,
+            win_size, ndisp, keypoints, resizedMinDisp);
 
-    // normalization to 8 bit
-    std::vector<unsigned char> depthmapNormalized(width * height);
-    NormalizeToChar(oclussionFilledMap, width, height, ndisp, depthmapNormalized);
+        // end execution timing and print
+        QueryPerformanceCounter(&end);
+        elapsed_time = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+        std::cout << "Matched " << keypoints.size() << " keypoints" << std::endl;
+        std::cout << "Elapsed time: " << elapsed_time << " seconds\n";
 
-    // end execution timing and print
-    QueryPerformanceCounter(&end);
+        std::ofstream file(keypointsOut);
+        for (size_t i = 0; i < keypoints.size(); i++)
+        {
+            file << keypoints[i].x << " " << keypoints[i].y << " " << pointDisparities[i].disparity << " " << pointDisparities[i].score << "\n";
+        }
+        return 0;
+    }
 
-    elapsed_time = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
-    std::cout << "Elapsed time: " << elapsed_time << " seconds\n";
+    if (!regions.empty())
+    {
+        std::vector<std::vector<int>> regionDisparities = CalcDisparityROIs(leftImageResized, rightImageResized, width, height,
+            win_size, ndisp, neighbours, crossDiff, regions, resizedMinDisp);
 
-    std::cout << "Elapsed time: " << elapsed_time / 60 << " minutes\n";
+        // end execution timing and print
+        QueryPerformanceCounter(&end);
+        elapsed_time = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+        std::cout << "Elapsed time: " << elapsed_time << " seconds\n";
 
-    // encode resized and grayscaled images (im*_out)
-    error = lodepng::encode(depthmapOut, depthmapNormalized, width, height, LCT_GREY, 8);
-    if (error) std::cout << "encoder error first image: " << error << ": " << lodepng_error_text(error) << std::endl;
+        for (size_t i = 0; i < regions.size(); i++)
+        {
+            std::vector<unsigned char> regionNormalized(regionDisparities[i].size());
+            NormalizeToChar(regionDisparities[i], regions[i].width, regions[i].height, ndisp, regionNormalized);
+            std::string regionOut = "../img/depthmap_roi_" + std::to_string(i) + ".png";
+            error = lodepng::encode(regionOut, regionNormalized, regions[i].width, regions[i].height, LCT_GREY, 8);
+            if (error) std::cout << "encoder error: " << error << ": " << lodepng_error_text(error) << std::endl;
+        }
+        return 0;
+    }
 }
\ No newline at end of file
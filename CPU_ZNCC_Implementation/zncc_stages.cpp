@@ -0,0 +1,277 @@
+#include "zncc_stages.h"
+
+#include <math.h>
+#include <algorithm>
+#include <cstdlib>
+
+namespace cpu {
+
+void GrayScaleImageConversion(const std::vector<unsigned char>& image, unsigned int width, unsigned int height, std::vector<unsigned char>& imageGray)
+{
+    // iterate over every four values, as input is 4 channeled RGBA
+    char channel = 4;
+    for (size_t i = 0; i < image.size(); i += channel)
+    {
+        // Add up R, G and B values and divide to get grayscale value.
+        // We don't care about the A value, so it is not used.
+        imageGray[i / channel] = (image[i + 0] + image[i + 1] + image[i + 2]) / 3;
+    }
+}
+
+void ResizeImage(const std::vector<unsigned char>& image, unsigned int width, unsigned int height, unsigned int resizeFactor, std::vector<unsigned char>& imageResized)
+{
+    // Divide image into resizeFactor x resizeFactor blocks and then use the average value of said blocks as the value of the new pixel
+    imageResized.resize((width * height) / (resizeFactor * resizeFactor));
+
+    int newWidth = width / resizeFactor;
+    int newHeight = height / resizeFactor;
+
+    for (int i = 0; i < newHeight; ++i)
+    {
+        for (int j = 0; j < newWidth; ++j)
+        {
+            int sum = 0;
+            for (int k = i * resizeFactor; k < (i + 1) * resizeFactor; k++) {
+                for (int l = j * resizeFactor; l < (j + 1) * resizeFactor; l++) {
+                    sum += image[k * width + l];
+                }
+            }
+            imageResized[i * (newWidth) + j] = sum / (resizeFactor * resizeFactor);
+        }
+    }
+}
+
+
+bool IsBorderPixel(int x, int y, int width, int height, int border)
+{
+    return y >= height - border || x >= width - border ||
+        y <= border || x <= border;
+}
+
+float WindowZNCC(const std::vector<unsigned char>& leftImage,
+    const std::vector<unsigned char>& rightImage,
+    int width, int height, int x, int y,
+    int halfWindowSize, int d, char isLeftImage)
+{
+    int imgSize = width * height;
+    float numerator = 0.0, denominator1 = 0.0, denominator2 = 0.0;
+    float leftMean = 0.0, rightMean = 0.0;
+
+    // calculate mean for each window - changes for different disparities, as the rightmean is calculated based on the disparity
+    int avgCount = 0;
+    for (int winY = -halfWindowSize; winY < halfWindowSize; winY++)
+    {
+        for (int winX = -halfWindowSize; winX < halfWindowSize; winX++)
+        {
+            // don't allow pixel to go to previous row
+            if (d > x + winX)
+            {
+                continue;
+            }
+
+            int leftPixelIndex = (y + winY) * width + (x + winX);
+            int rightPixelIndex = (y + winY) * width + (x + winX - isLeftImage * d);
+            if (rightPixelIndex >= imgSize ||
+                rightPixelIndex <= 0)
+            {
+                continue;
+            }
+
+            leftMean += leftImage[leftPixelIndex];
+            rightMean += rightImage[rightPixelIndex];
+            avgCount++;
+        }
+
+    }
+    leftMean = leftMean / avgCount;
+    rightMean = rightMean / avgCount;
+
+    for (int winY = -halfWindowSize; winY < halfWindowSize; winY++)
+    {
+        for (int winX = -halfWindowSize; winX < halfWindowSize; winX++)
+        {
+            // don't allow pixel to go to previous row
+            if (d > x + winX)
+            {
+                continue;
+            }
+
+            int leftPixelIndex = (y + winY) * width + (x + winX);
+            int rightPixelIndex = (y + winY) * width + (x + winX - isLeftImage * d);
+            if (rightPixelIndex >= imgSize ||
+                rightPixelIndex <= 0)
+            {
+                continue;
+            }
+
+            // calculate zncc value for each window
+            numerator += (leftImage[leftPixelIndex] - leftMean) * (rightImage[rightPixelIndex] - rightMean);
+            denominator1 += pow(leftImage[leftPixelIndex] - leftMean, 2);
+            denominator2 += pow(rightImage[rightPixelIndex] - rightMean, 2);
+
+        }
+
+    }
+
+    float denominator = sqrt(denominator1) * sqrt(denominator2);
+    if (denominator == 0) {
+        return -100.0;
+    }
+    return numerator / denominator;
+}
+
+int PixelDisparity(const std::vector<unsigned char>& leftImage,
+    const std::vector<unsigned char>& rightImage,
+    int width, int height, int x, int y,
+    int halfWindowSize, int maxDisparity,
+    char isLeftImage, float* bestScore, int minDisparity)
+{
+    int bestDisp = 0;
+    float bestZNCC = -100.0;
+
+    for (int d = minDisparity; d < maxDisparity; d++)
+    {
+        float zncc = WindowZNCC(leftImage, rightImage, width, height, x, y, halfWindowSize, d, isLeftImage);
+        if (zncc > bestZNCC)
+        {
+            bestZNCC = zncc;
+            bestDisp = d;
+        }
+    }
+
+    if (bestScore) *bestScore = bestZNCC;
+    return bestDisp;
+}
+
+void CalcZNCC(const std::vector<unsigned char>& leftImage,
+    const std::vector<unsigned char>& rightImage,
+    int width, int height,
+    int windowSize, int maxDisparity,
+    std::vector<int>& disparityMap,
+    char isLeftImage,
+    int firstRow, int imageHeight,
+    int minDisparity
+    ) 
+{
+    int fullHeight = imageHeight > 0 ? imageHeight : height;
+
+    int halfWindowSize = (windowSize - 1) / 2;
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int bestDisp = 0;
+
+            // handle borders | keep bestDisp at 0, so borders will be black
+            if (!IsBorderPixel(x, firstRow + y, width, fullHeight, halfWindowSize))
+            {
+                bestDisp = PixelDisparity(leftImage, rightImage, width, height, x, y, halfWindowSize, maxDisparity, isLeftImage, NULL, minDisparity);
+            }
+
+            disparityMap[y * width + x] = bestDisp;
+        }
+    }
+}
+
+void CrossCheck(const std::vector<int>& dispMapLeft, const std::vector<int>& dispMapRight, const int& width, const int& height, const int& crossDiff, std::vector<int>& crossDispMap)
+{
+    // Loop over all pixels inside the image boundary
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width ; x++) {
+
+            // Get the disparity values for the current pixel in both directions
+            int dispLeft = dispMapLeft[y * width + x];
+            int dispRight = dispMapRight[y * width + x];
+
+            // Check if the disparity values agree | abs used to account for rounding errors
+            if (std::abs(dispLeft - dispRight) <= crossDiff) {
+                // If the disparities agree, use the left disparity value as the final disparity for the pixel
+                crossDispMap[y * width + x] = dispLeft;
+            }
+            else {
+                // Otherwise, mark the pixel as invalid
+                crossDispMap[y * width + x] = 0;
+            }
+        }
+    }
+}
+
+int FilledDisparity(const std::vector<int>& dispMap, int width, int x, int y, int nCount)
+{
+    int disparity = dispMap[y * width + x];
+
+    // Check if the current pixel is marked as invalid
+    if (disparity == 0) {
+
+        // Initialize the list of valid disparity values in the n-neighborhood of the current pixel
+        // the list of the calling thread is reused, so it only allocates until it reached its largest size
+        thread_local std::vector<int> neighbors;
+        neighbors.clear();
+
+        // Loop over the n-neighbors of the current pixel
+        for (int dy = -nCount / 2; dy <= nCount / 2; dy++) {
+            for (int dx = -nCount / 2; dx <= nCount/ 2; dx++) {
+                // Skip the center pixel
+                if (dx == 0 && dy == 0) continue;
+
+                // Get the disparity value for the current neighbor
+                int neighbor_disp = dispMap[(y + dy) * width + (x + dx)];
+
+                // If the neighbor is valid, add its disparity value to the list
+                if (neighbor_disp > 0) {
+                    neighbors.push_back(neighbor_disp);
+                }
+            }
+        }
+
+        // If at least one valid disparity value was found in the n-neighborhood,
+        // set the current pixel's disparity value to the median of the valid values
+        // the upper one for an even count, which is what the OpenCL kernel takes as well
+        if (!neighbors.empty()) {
+            std::nth_element(neighbors.begin(), neighbors.begin() + neighbors.size() / 2, neighbors.end());
+            disparity = neighbors[neighbors.size() / 2];
+        }
+    }
+    return disparity;
+}
+
+void OcclusionFilling(const std::vector<int>& dispMap, const int& width, const int& height, const int& nCount, std::vector<int>& dispMapFilled,
+    int firstRow, int imageHeight)
+{
+    int fullHeight = imageHeight > 0 ? imageHeight : height;
+
+    // Copy the input disparity map to the output disparity map
+    std::copy(dispMap.begin(), dispMap.end(), dispMapFilled.begin());
+
+    // Loop over all pixels inside the image boundary
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+
+            // handle borders | keep bestDisp at 0, so borders will stay black
+            if (IsBorderPixel(x, firstRow + y, width, fullHeight, nCount / 2))
+            {
+                continue;
+            }
+
+            dispMapFilled[y * width + x] = FilledDisparity(dispMap, width, x, y, nCount);
+        }
+    }
+}
+
+void NormalizeToChar(const std::vector<int>& dispMap, const int& width, const int& height, const int& ndisp, std::vector<unsigned char>& normVec)
+{
+    // Loop over all pixels and normalize the disparity values
+    for (int i = 0; i < width * height; i++) {
+        normVec[i] = static_cast<unsigned char>(static_cast<float>(dispMap[i]) / ndisp * 255);
+    }
+}
+
+void NormalizeToChar(const std::vector<float>& dispMap, const int& width, const int& height, const int& ndisp, std::vector<unsigned char>& normVec)
+{
+    for (int i = 0; i < width * height; i++) {
+        normVec[i] = static_cast<unsigned char>(dispMap[i] / ndisp * 255);
+    }
+}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+// Stages of the single threaded CPU pipeline | the modes of zncc.cpp are built from them, and the dispatcher of the
+// optimized OpenCL implementation runs them as its "cpu" backend
+
+#include <cstddef>
+#include <vector>
+
+namespace cpu {
+
+void GrayScaleImageConversion(const std::vector<unsigned char>& image, unsigned int width, unsigned int height, std::vector<unsigned char>& imageGray);
+
+void ResizeImage(const std::vector<unsigned char>& image, unsigned int width, unsigned int height, unsigned int resizeFactor, std::vector<unsigned char>& imageResized);
+
+// Pixels closer than border to the edge of the image keep disparity 0
+bool IsBorderPixel(int x, int y, int width, int height, int border);
+
+// ZNCC value of the windows of the pixel at (x, y) for a single disparity d | -100 if a window has no variance
+float WindowZNCC(const std::vector<unsigned char>& leftImage,
+    const std::vector<unsigned char>& rightImage,
+    int width, int height, int x, int y,
+    int halfWindowSize, int d, char isLeftImage);
+
+// Best disparity of the pixel at (x, y) | the pixel must not be a border pixel, so its windows are inside the image
+// bestScore receives the ZNCC value of the best disparity if given, -100 if no window had any variance
+// only disparities from minDisparity up to maxDisparity are searched
+int PixelDisparity(const std::vector<unsigned char>& leftImage,
+    const std::vector<unsigned char>& rightImage,
+    int width, int height, int x, int y,
+    int halfWindowSize, int maxDisparity,
+    char isLeftImage, float* bestScore = NULL, int minDisparity = 0);
+
+// Apply ZNCC algorithm for a given window size and max disparity
+// the images can be a strip of height rows starting at row firstRow of an image of imageHeight rows,
+// so that the borders are those of the full image | imageHeight 0 means the images are the full image
+void CalcZNCC(const std::vector<unsigned char>& leftImage,
+    const std::vector<unsigned char>& rightImage,
+    int width, int height,
+    int windowSize, int maxDisparity,
+    std::vector<int>& disparityMap,
+    char isLeftImage = 1,
+    int firstRow = 0, int imageHeight = 0,
+    int minDisparity = 0);
+
+void CrossCheck(const std::vector<int>& dispMapLeft, const std::vector<int>& dispMapRight, const int& width, const int& height, const int& crossDiff, std::vector<int>& crossDispMap);
+
+// Disparity of the pixel at (x, y) after occlusion filling | the pixel must not be a border pixel
+int FilledDisparity(const std::vector<int>& dispMap, int width, int x, int y, int nCount);
+
+// like CalcZNCC, dispMap can be a strip starting at row firstRow of an image of imageHeight rows
+void OcclusionFilling(const std::vector<int>& dispMap, const int& width, const int& height, const int& nCount, std::vector<int>& dispMapFilled,
+    int firstRow = 0, int imageHeight = 0);
+
+void NormalizeToChar(const std::vector<int>& dispMap, const int& width, const int& height, const int& ndisp, std::vector<unsigned char>& normVec);
+
+// NormalizeToChar for the float disparities of RefineSubpixel
+void NormalizeToChar(const std::vector<float>& dispMap, const int& width, const int& height, const int& ndisp, std::vector<unsigned char>& normVec);
+
+}
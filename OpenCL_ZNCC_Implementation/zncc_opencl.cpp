@@ -44,7 +44,7 @@ cl::Image2D EnqueueGrayScaleConversion(std::vector<unsigned char>& image, unsign
 
     // print profiling
     double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Grayscale conversion execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    std::cout << "Grayscale conversion execution time in microseconds " << runTime / 1e3 << std::endl;
 
     return outputImageGray;
 }
@@ -67,7 +67,7 @@ cl::Buffer EnqueueResizeImage(cl::Image2D image, unsigned int width, unsigned in
 
     // print profiling
     double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Resize execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    std::cout << "Resize execution time in microseconds " << runTime / 1e3 << std::endl;
 
     return outputImageBuffResized;
 }
@@ -96,7 +96,7 @@ cl::Buffer EnqueueZNCC(const cl::Buffer leftImage,
 
     // print profiling
     double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "ZNCC execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    std::cout << "ZNCC execution time in microseconds " << runTime / 1e3 << std::endl;
 
     return disparityMap;
 }
@@ -122,7 +122,7 @@ cl::Buffer EnqueueCrossCheck(const cl::Buffer dispMapLeft,
 
     // print profiling
     double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Cross-checking execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    std::cout << "Cross-checking execution time in microseconds " << runTime / 1e3 << std::endl;
 
     return crossCheckedImage;
 }
@@ -144,7 +144,7 @@ cl::Buffer EnqueueOcclusionFilling(const cl::Buffer crossCheckedImage,
 
     // print profiling
     double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Occlusion filling execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    std::cout << "Occlusion filling execution time in microseconds " << runTime / 1e3 << std::endl;
 
     return crossCheckedImage;
 }
@@ -167,7 +167,7 @@ cl::Buffer EnqueueNormalizeToChar(const cl::Buffer filledImage,
 
     // print profiling
     double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Image normalization execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    std::cout << "Image normalization execution time in microseconds " << runTime / 1e3 << std::endl;
 
     return normImage;
 }
@@ -333,7 +333,7 @@ int main()
 
         // print profiling
         double transferTime = (double)(readEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - readEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-        std::cout << "Final read bus transfer time in microseconds " << transferTime / (float)10e3 << std::endl;
+        std::cout << "Final read bus transfer time in microseconds " << transferTime / 1e3 << std::endl;
 
         // end execution timing and print
         QueryPerformanceCounter(&end);
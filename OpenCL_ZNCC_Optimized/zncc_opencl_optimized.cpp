@@ -8,179 +8,1056 @@
 
 #include <lodepng.h>
 
+#include "../common/zncc_common.h"
+#include "../common/stereo_backend.h"
+#include "../OpenMP_ZNCC_Implementation/zncc_openmp_stages.h"
+#include "zncc_opencl_stages.h"
+
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
-#include <Windows.h>
-
-// cl_info struct type to hold reused opencl objects
-struct cl_info {
-    cl::Context context;   
-    cl::Program program;
-    cl::Device device;
-    cl::CommandQueue queue;
-    cl::Event profEvent;
-} cl_info_obj;
-
-cl::Image2D EnqueueGrayScaleConversion(std::vector<unsigned char>& image, unsigned int width, unsigned int height)
+#include <map>
+#include <string>
+#include <stdexcept>
+#include <cctype>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+
+using namespace opencl;
+
+// PNG decoded without color conversion | the conversion to RGBA is done straight into the memory the device reads
+struct decoded_png {
+    std::vector<unsigned char> raw;
+    lodepng::State state;
+    unsigned int width = 0, height = 0;
+};
+
+unsigned int DecodePNG(const char* fileName, decoded_png& png)
 {
-    // setup two formats for the Image2D objects
-    cl::ImageFormat rgbaFormat{ CL_RGBA, CL_UNSIGNED_INT8 };
-    cl::ImageFormat grayscaleFormat{ CL_DEPTH, CL_UNSIGNED_INT8 };
-    // create input image object, which is read_only and has a format of RGBA + 8 bit depth
-    cl::Image2D inputImage(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_USE_HOST_PTR, rgbaFormat, width, height, 0, image.data());
-    // create output image object, which is read and write so that it can be reused by next kernel; use format of grayscale + 8 bit depth
-    cl::Image2D outputImageGray(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, grayscaleFormat, width, height);
-    // create a kernel object from the grayscale kernel
-    cl::Kernel kernelGrayscale(cl_info_obj.program, "convert_grayscale");
-
-    // set arguments
-    kernelGrayscale.setArg(0, inputImage);
-    kernelGrayscale.setArg(1, outputImageGray);
-
-    // queue the grayscale kernel
-    cl_info_obj.queue.enqueueNDRangeKernel(kernelGrayscale, cl::NullRange, cl::NDRange(width, height), cl::NullRange, 0, &cl_info_obj.profEvent);
-    cl_info_obj.profEvent.wait();
+    std::vector<unsigned char> file;
+    unsigned int error = lodepng::load_file(file, fileName);
+    if (error) return error;
 
-    // print profiling
-    double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Grayscale conversion execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    png.state.decoder.color_convert = 0;
+    return lodepng::decode(png.raw, png.width, png.height, png.state, file);
+}
 
-    return outputImageGray;
+// Convert the decoded PNG into 8 bit RGBA pixels at out, which must hold width * height * 4 bytes
+unsigned int ConvertToRGBA(const decoded_png& png, unsigned char* out)
+{
+    LodePNGColorMode rgba = lodepng_color_mode_make(LCT_RGBA, 8);
+    return lodepng_convert(out, png.raw.data(), &rgba, &png.state.info_png.color, png.width, png.height);
 }
 
-cl::Buffer EnqueueResizeImage(cl::Image2D image, unsigned int width, unsigned int height, unsigned int resizeFactor)
+// Device-readable RGBA images of the decoded PNGs, back to back, without an extra host copy
+// all PNGs must have the same size, as they are processed as one batch
+host_buffer UploadRGBA(const std::vector<const decoded_png*>& pngs)
 {
-    // create output buffer object for image so that it can be accessed easier in the next part of the pipeline
-    // read_write access given, so that buffer can be reused as input
-    cl::Buffer outputImageBuffResized(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(unsigned char) * (width * height));
-    cl::Kernel kernelResize(cl_info_obj.program, "resize_image");
+    size_t imageSize = static_cast<size_t>(pngs.front()->width) * pngs.front()->height * 4;
+    host_buffer images = AllocateHostBuffer(imageSize * pngs.size(), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY);
+    for (size_t i = 0; i < pngs.size(); i++)
+    {
+        unsigned int error = ConvertToRGBA(*pngs[i], images.data + i * imageSize);
+        if (error) std::cout << "color conversion error: " << error << ": " << lodepng_error_text(error) << std::endl;
+    }
+    UnmapHostBuffer(images);
+    return images;
+}
+
+// Enqueue the pipeline up to occlusion filling with the calling thread's current program and return the filled disparities
+// at the resized resolution, width and height are those of the RGBA images | with regions, matching and cross-checking run on the regions grown by the occlusion filling
+// neighbourhood, which is all the filling of the regions reads, so their disparities are the same as in the full frame
+// with a temporal state, a single pair is matched around the previous frame's disparities, except on keyframes
+// with an incremental state, a single pair is matched only where its tiles changed and the state's cache is returned
+// refined receives the sub-pixel disparities of the full frame if given | not used with regions or incremental
+cl::Buffer EnqueueDisparityMap(const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params, int pairs = 1,
+    const std::vector<roi>& regions = std::vector<roi>(), temporal_state* temporal = NULL, incremental_state* incremental = NULL,
+    cl::Buffer* refined = NULL)
+{
+    bool verbose = cl_info_obj.printProfiling;
+    int ndisp = ResizedDisparityRange(params, width);
+    int minDisp = ResizedMinDisparity(params, width);
+
+    // Kernel logic
+    //// Grayscale conversion and rescaling
+    if (verbose && pairs > 1) std::cout << "Processing a batch of " << pairs << " pairs..." << std::endl;
+    if (verbose) std::cout << "Converting left image to grayscale and resizing to 1/16 size..." << std::endl;
+    auto outputImageResizedLeft = EnqueueGrayScaleResize(leftImage, width, height, params.resizeFactor, pairs);
+    if (verbose) std::cout << "Converting right image to grayscale and resizing to 1/16 size..." << std::endl;
+    auto outputImageResizedRight = EnqueueGrayScaleResize(rightImage, width, height, params.resizeFactor, pairs);
+
+    // update values depending on resolution
+    width = width / params.resizeFactor;
+    height = height / params.resizeFactor;
+
+    // regions whose disparities changed since the previous frame | a tile only counts as changed against the images
+    // it was last matched on, so slow drifts add up until they are matched again
+    std::vector<roi> fillRegions = regions;
+    bool keyframe = false;
+    if (incremental)
+    {
+        keyframe = !incremental->hasCache || incremental->frame % incremental->keyframeInterval == 0;
+        std::vector<roi> changedTiles = { { 0, 0, (int)width, (int)height } };
+        if (!keyframe)
+        {
+            if (verbose) std::cout << "Comparing tiles with the previous frame..." << std::endl;
+            auto leftDiffs = EnqueueTileChanges(outputImageResizedLeft, incremental->referenceLeft, width, height, incremental->tileSize);
+            auto rightDiffs = EnqueueTileChanges(outputImageResizedRight, incremental->referenceRight, width, height, incremental->tileSize);
+            changedTiles = ChangedTiles(leftDiffs, rightDiffs, width, height, incremental->tileSize, incremental->threshold);
+            int halfWindowSize = (params.winSize - 1) / 2;
+            fillRegions = AffectedRegions(changedTiles, width, height,
+                halfWindowSize + ndisp + params.neighbours / 2, halfWindowSize + params.neighbours / 2);
+        }
+        incremental->frame++;
+
+        if (keyframe)
+        {
+            incremental->referenceLeft = outputImageResizedLeft;
+            incremental->referenceRight = outputImageResizedRight;
+            incremental->recomputedPixels = (long long)width * height;
+        }
+        else
+        {
+            for (const roi& tile : changedTiles)
+            {
+                EnqueueCopyRegion(outputImageResizedLeft, incremental->referenceLeft, tile, width, sizeof(unsigned char), "Update reference tiles");
+                EnqueueCopyRegion(outputImageResizedRight, incremental->referenceRight, tile, width, sizeof(unsigned char), "Update reference tiles");
+            }
+            incremental->recomputedPixels = 0;
+            for (const roi& region : fillRegions)
+            {
+                incremental->recomputedPixels += (long long)region.width * region.height;
+            }
+            // nothing changed, the cached disparities are the ones of this frame
+            if (fillRegions.empty()) return incremental->cache;
+        }
+    }
 
-    // set arguments
-    kernelResize.setArg(0, resizeFactor);
-    kernelResize.setArg(1, image);
-    kernelResize.setArg(2, outputImageBuffResized);
+    // regions the matching has to cover
+    std::vector<roi> matchRegions;
+    for (const roi& region : fillRegions)
+    {
+        matchRegions.push_back(GrowRegion(region, params.neighbours / 2, width, height));
+    }
 
-    // queue the resizing kernel
-    cl_info_obj.queue.enqueueNDRangeKernel(kernelResize, cl::NullRange, cl::NDRange(width, height), cl::NullRange, 0, &cl_info_obj.profEvent);
-    cl_info_obj.profEvent.wait();
+    // enqueue window statistics
+    if (verbose) std::cout << "Computing window means and norms..." << std::endl;
+    auto outputStatsLeft = EnqueueBoxStats(outputImageResizedLeft, width, height, params.winSize, pairs);
+    auto outputStatsRight = EnqueueBoxStats(outputImageResizedRight, width, height, params.winSize, pairs);
+
+    // enqueue ZNCC
+    cl::Buffer outputZNCCLeft, outputZNCCRight;
+    if (temporal)
+    {
+        temporal->evaluations = 0;
+        temporal->fullEvaluations = 2 * FullEvaluations(width, height, params.winSize, ndisp - minDisp);
+    }
+    if (temporal && temporal->hasPrior && temporal->frame % temporal->keyframeInterval != 0)
+    {
+        if (verbose) std::cout << "Applying ZNCC around the previous frame's disparities..." << std::endl;
+        outputZNCCLeft = EnqueueZNCCTemporal(outputImageResizedLeft, outputImageResizedRight, outputStatsLeft, outputStatsRight, width, height, params.winSize, ndisp, 1, *temporal, minDisp);
+        outputZNCCRight = EnqueueZNCCTemporal(outputImageResizedRight, outputImageResizedLeft, outputStatsRight, outputStatsLeft, width, height, params.winSize, ndisp, -1, *temporal, minDisp);
+    }
+    else
+    {
+        if (verbose) std::cout << "Applying ZNCC to left image..." << std::endl;
+        outputZNCCLeft = EnqueueZNCC(outputImageResizedLeft, outputImageResizedRight, outputStatsLeft, outputStatsRight, width, height, params.winSize, ndisp, 1, pairs, matchRegions, minDisp);
+        if (verbose) std::cout << "Applying ZNCC to right image..." << std::endl;
+        outputZNCCRight = EnqueueZNCC(outputImageResizedRight, outputImageResizedLeft, outputStatsRight, outputStatsLeft, width, height, params.winSize, ndisp, -1, pairs, matchRegions, minDisp);
+        if (temporal) temporal->evaluations = temporal->fullEvaluations;
+    }
+
+    // enqueue cross-check
+    if (verbose) std::cout << "Applying cross-check..." << std::endl;
+    auto outputCrossCheck = EnqueueCrossCheck(outputZNCCLeft, outputZNCCRight, width, height, params.crossDiff, pairs, matchRegions);
+
+    // the cross-checked disparities are the prior of the next frame
+    if (temporal)
+    {
+        temporal->prior = outputCrossCheck;
+        temporal->hasPrior = true;
+        temporal->frame++;
+    }
+
+    // enqueue occlusion filling
+    if (verbose) std::cout << "Applying occlusion filling..." << std::endl;
+    auto outputOcclusionFilling = EnqueueOcclusionFilling(outputCrossCheck, width, height, params.neighbours, pairs, fillRegions);
+
+    // enqueue sub-pixel refinement
+    if (refined)
+    {
+        if (verbose) std::cout << "Refining disparities to sub-pixel precision..." << std::endl;
+        *refined = EnqueueSubpixelRefinement(outputImageResizedLeft, outputImageResizedRight, outputStatsLeft, outputStatsRight,
+            outputCrossCheck, outputOcclusionFilling, width, height, params.winSize, ndisp, params.equiangular, pairs);
+    }
+    if (!incremental) return outputOcclusionFilling;
+
+    // the filled regions replace their part of the cache, a full frame the whole cache
+    if (keyframe)
+    {
+        incremental->cache = outputOcclusionFilling;
+        incremental->hasCache = true;
+    }
+    else
+    {
+        for (const roi& region : fillRegions)
+        {
+            EnqueueCopyRegion(outputOcclusionFilling, incremental->cache, region, width, sizeof(int), "Update cached disparities");
+        }
+    }
+    return incremental->cache;
+}
+
+// Enqueue the whole ZNCC pipeline on the calling thread's device and return the normalized depthmap buffer
+// width and height are the resolution of the RGBA input images, the depthmap is resizeFactor times smaller
+// a batch of pairs of the same size is given as images back to back in leftImage and rightImage, every kernel
+// then runs once for the whole batch and the depthmaps are returned back to back in the same order
+// temporal is the state of a video stream for frames of a single pair | NULL to match every pair over the full range
+// incremental is the state of a video stream that is only matched again where it changed | NULL to match every pixel
+cl::Buffer EnqueuePipeline(const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params, int pairs = 1, temporal_state* temporal = NULL,
+    incremental_state* incremental = NULL)
+{
+    // kernels of this run come from the program specialized for its parameters once they recur
+    int ndisp = ResizedDisparityRange(params, width);
+    cl::Program genericProgram = cl_info_obj.program;
+    cl_info_obj.program = VariantProgram(params.winSize, ndisp, params.neighbours);
+
+    // the incremental cache holds int disparities, so its frames are not refined
+    bool subpixel = params.subpixel && !incremental;
+    cl::Buffer refined;
+    auto outputOcclusionFilling = EnqueueDisparityMap(leftImage, rightImage, width, height, params, pairs, std::vector<roi>(), temporal, incremental,
+        subpixel ? &refined : NULL);
+
+    //// enqueue normalization
+    if (cl_info_obj.printProfiling) std::cout << "Applying image normalization..." << std::endl;
+    auto outputNorm = EnqueueNormalizeToChar(subpixel ? refined : outputOcclusionFilling, width / params.resizeFactor, height / params.resizeFactor,
+        ndisp, pairs, subpixel);
+
+    cl_info_obj.program = genericProgram;
+    return outputNorm;
+}
+
+// Run the whole ZNCC pipeline and return the normalized depthmap mapped for reading
+// the caller unmaps the result once it is done with it
+host_buffer RunPipeline(const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params, int pairs = 1, temporal_state* temporal = NULL,
+    incremental_state* incremental = NULL)
+{
+    host_stage stage("Pipeline");
+    host_buffer normImage;
+    normImage.buffer = EnqueuePipeline(leftImage, rightImage, width, height, params, pairs, temporal, incremental);
+
+    // map the normalized depthmap output | no copy on devices that share memory with the host
+    cl::Event readEvent;
+    normImage.size = sizeof(unsigned char) * (width / params.resizeFactor) * (height / params.resizeFactor) * pairs;
+    MapHostBuffer(normImage, CL_MAP_READ, &readEvent);
 
     // print profiling
-    double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Resize execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    double transferTime = (double)(readEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - readEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+    if (cl_info_obj.printProfiling) std::cout << "Final map bus transfer time in microseconds " << transferTime / 1e3 << std::endl;
+
+    ResolveTraceCommands();
+    return normImage;
+}
+
+// Occlusion filled disparities inside the regions of interest only, one vector of width * height values per region
+// regions are rectangles of the resized image and pixels of a region outside of the image are 0
+// grayscale conversion and window statistics are linear in the image size and run on the whole frame, the matching
+// that dominates the run time only on the regions and their halo
+std::vector<std::vector<int>> RunRegions(const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params, const std::vector<roi>& regions)
+{
+    host_stage stage("Regions");
+    int resizedWidth = width / params.resizeFactor;
+    int resizedHeight = height / params.resizeFactor;
+    std::vector<std::vector<int>> disparities;
+    if (LaunchRegions(regions, resizedWidth, resizedHeight).empty())
+    {
+        for (const roi& region : regions)
+        {
+            disparities.push_back(std::vector<int>(static_cast<size_t>(std::max(0, region.width)) * std::max(0, region.height), 0));
+        }
+        return disparities;
+    }
+
+    int ndisp = ResizedDisparityRange(params, width);
+    cl::Program genericProgram = cl_info_obj.program;
+    cl_info_obj.program = VariantProgram(params.winSize, ndisp, params.neighbours);
+    cl::Buffer filled = EnqueueDisparityMap(leftImage, rightImage, width, height, params, 1, regions);
+    cl_info_obj.program = genericProgram;
 
-    return outputImageBuffResized;
+    // read back the part of every region that is inside the image
+    for (const roi& region : regions)
+    {
+        std::vector<int> regionDisparities(static_cast<size_t>(std::max(0, region.width)) * std::max(0, region.height), 0);
+        roi clipped = GrowRegion(region, 0, resizedWidth, resizedHeight);
+        if (clipped.width > 0 && clipped.height > 0)
+        {
+            cl::size_t<3> bufferOrigin, hostOrigin, rectRegion;
+            bufferOrigin[0] = clipped.x * sizeof(int); bufferOrigin[1] = clipped.y; bufferOrigin[2] = 0;
+            hostOrigin[0] = (clipped.x - region.x) * sizeof(int); hostOrigin[1] = clipped.y - region.y; hostOrigin[2] = 0;
+            rectRegion[0] = clipped.width * sizeof(int); rectRegion[1] = clipped.height; rectRegion[2] = 1;
+
+            cl::Event readEvent;
+            auto hostQueued = std::chrono::steady_clock::now();
+            cl_info_obj.queue.enqueueReadBufferRect(filled, CL_TRUE, bufferOrigin, hostOrigin, rectRegion,
+                resizedWidth * sizeof(int), 0, region.width * sizeof(int), 0, regionDisparities.data(), NULL, &readEvent);
+            TraceCommand(readEvent, "Read region", hostQueued);
+        }
+        disparities.push_back(regionDisparities);
+    }
+
+    ResolveTraceCommands();
+    return disparities;
 }
 
-cl::Buffer EnqueueZNCC(const cl::Buffer leftImage,
-    const cl::Buffer rightImage,
-    int width, int height,
-    int windowSize, int maxDisparity,
-    char isLeftImage = 1)
+// ZNCC disparity and peak score of keypoints of the resized left image, in the order of the points
+// grayscale conversion and window statistics run on the whole frame, matching only for the points
+std::vector<point_disparity> RunKeypoints(const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params, const std::vector<keypoint>& points)
 {
-    // create buffer with read/write access so that it can be reused
-    cl::Buffer disparityMap(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(unsigned int) * (width * height));
-    cl::Kernel kernelZNCC(cl_info_obj.program, "calc_zncc");
+    host_stage stage("Keypoints");
+    int ndisp = ResizedDisparityRange(params, width);
+    int minDisp = ResizedMinDisparity(params, width);
+    cl::Program genericProgram = cl_info_obj.program;
+    cl_info_obj.program = VariantProgram(params.winSize, ndisp, params.neighbours);
+
+    auto resizedLeft = EnqueueGrayScaleResize(leftImage, width, height, params.resizeFactor);
+    auto resizedRight = EnqueueGrayScaleResize(rightImage, width, height, params.resizeFactor);
+    width = width / params.resizeFactor;
+    height = height / params.resizeFactor;
+    auto statsLeft = EnqueueBoxStats(resizedLeft, width, height, params.winSize);
+    auto statsRight = EnqueueBoxStats(resizedRight, width, height, params.winSize);
+    std::vector<point_disparity> results = EnqueueZNCCPoints(resizedLeft, resizedRight, statsLeft, statsRight, points,
+        width, height, params.winSize, ndisp, minDisp);
+
+    cl_info_obj.program = genericProgram;
+    ResolveTraceCommands();
+    return results;
+}
 
-    // window is halved, so that pixel is in centre of window
-    int halfWindowSize = (windowSize - 1) / 2;
+// Disparities of a single pair within budgetSeconds | levels are resize factors from the coarsest to the finest,
+// e.g. 16, 8, 4, and params.resizeFactor is not used | the coarsest level searches the full range and always completes,
+// every finer level runs the temporal kernel around the upsampled cross-checked disparities of the previous one
+// kernels can't be stopped once enqueued, so a level is skipped with all the finer ones when the time per evaluated
+// disparity of the previous level predicts it would end after the budget | params.crossDiff is that of the finest level
+// no level completes if levels is empty
+anytime_result RunAnytime(const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params, const std::vector<int>& levels, double budgetSeconds)
+{
+    host_stage stage("Anytime");
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&start]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    anytime_result result;
+    temporal_state temporal;
+    temporal.keyframeInterval = static_cast<int>(levels.size()) + 1;
+    std::vector<int> crossChecked, filled;
+    double secondsPerEvaluation = 0, evaluationsPerPixel = 0;
+    for (size_t level = 0; level < levels.size(); level++)
+    {
+        zncc_params levelParams = params;
+        levelParams.resizeFactor = levels[level];
+        levelParams.crossDiff = std::max(1, params.crossDiff * levels.back() / levels[level]);
+        levelParams.subpixel = false;
+        int levelWidth = width / levels[level];
+        int levelHeight = height / levels[level];
+        int levelDisp = ResizedDisparityRange(levelParams, width);
+
+        // prior of this level from the previous one, upsampled on the host as the previous level is read back anyway
+        // the search radius covers the previous level's rounding and an error of one of its pixels
+        if (level > 0)
+        {
+            int ratio = levels[level - 1] / levels[level];
+            std::vector<int> prior;
+            UpsampleDisparities(crossChecked, width / levels[level - 1], height / levels[level - 1], levels[level - 1],
+                levelWidth, levelHeight, levels[level], prior);
+            temporal.searchRadius = 2 * std::max(1, ratio);
+
+            // disparities per pixel are those of the radius, or as many as the previous prior search needed with its fallbacks
+            // plus a margin, as finer levels fall back to the full range more often
+            double perPixel = std::min(levelDisp, 2 * temporal.searchRadius + 1);
+            if (level > 1) perPixel = std::max(perPixel, evaluationsPerPixel);
+            double predictedEvaluations = 2.0 * levelWidth * levelHeight * perPixel * anytimeMargin;
+            if (elapsed() + predictedEvaluations * secondsPerEvaluation > budgetSeconds) break;
+
+            temporal.prior = cl::Buffer(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+                sizeof(int) * prior.size(), prior.data());
+        }
 
-    // set arguments
-    kernelZNCC.setArg(0, halfWindowSize);
-    kernelZNCC.setArg(1, isLeftImage);
-    kernelZNCC.setArg(2, leftImage);
-    kernelZNCC.setArg(3, rightImage);
-    kernelZNCC.setArg(4, disparityMap);
-    kernelZNCC.setArg(5, maxDisparity);
+        double levelStart = elapsed();
+        cl::Buffer levelFilled = EnqueueDisparityMap(leftImage, rightImage, width, height, levelParams, 1, std::vector<roi>(), &temporal);
 
-    // queue the zncc kernel
-    cl_info_obj.queue.enqueueNDRangeKernel(kernelZNCC, cl::NullRange, cl::NDRange(width, height), cl::NullRange, 0, &cl_info_obj.profEvent);
-    cl_info_obj.profEvent.wait();
+        // read back the cross-checked and filled disparities | the temporal state holds the cross-checked ones
+        crossChecked.resize(static_cast<size_t>(levelWidth) * levelHeight);
+        filled.resize(crossChecked.size());
+        cl::Event readEvent;
+        auto hostQueued = std::chrono::steady_clock::now();
+        cl_info_obj.queue.enqueueReadBuffer(temporal.prior, CL_FALSE, 0, sizeof(int) * crossChecked.size(), crossChecked.data(), NULL, &readEvent);
+        TraceCommand(readEvent, "Read cross-checked disparities", hostQueued);
+        hostQueued = std::chrono::steady_clock::now();
+        cl_info_obj.queue.enqueueReadBuffer(levelFilled, CL_TRUE, 0, sizeof(int) * filled.size(), filled.data(), NULL, &readEvent);
+        TraceCommand(readEvent, "Read disparities", hostQueued);
+
+        result.disparities = filled;
+        result.quality.resize(filled.size());
+        for (size_t i = 0; i < filled.size(); i++)
+        {
+            unsigned char filledFlag = crossChecked[i] == 0 ? QUALITY_FILLED : 0;
+            result.quality[i] = filled[i] == 0 ? 0 : static_cast<unsigned char>((level + 1) | filledFlag);
+        }
+        result.levelsCompleted = static_cast<int>(level) + 1;
+        secondsPerEvaluation = (elapsed() - levelStart) / std::max(1LL, temporal.evaluations);
+        evaluationsPerPixel = temporal.evaluations / (2.0 * levelWidth * levelHeight);
+    }
 
-    // print profiling
-    double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "ZNCC execution time in microseconds " << runTime / (float)10e3 << std::endl;
+    // without levels there is nothing to return | skipped levels still leave the result at the resolution of the finest one
+    if (result.levelsCompleted == 0) return result;
+    int completedFactor = levels[result.levelsCompleted - 1];
+    if (completedFactor != levels.back())
+    {
+        UpsampleAnytimeResult(result, width / completedFactor, height / completedFactor, completedFactor,
+            width / levels.back(), height / levels.back(), levels.back());
+    }
 
-    return disparityMap;
+    ResolveTraceCommands();
+    return result;
 }
 
-cl::Buffer EnqueueCrossCheck(const cl::Buffer dispMapLeft,
-    const cl::Buffer dispMapRight,
-    const int width, const int height, 
-    const int crossDiff)
+// Rows above and below a band that are processed with it but not kept, so that the band's own rows
+// see the same ZNCC windows and occlusion filling neighbourhoods as in the full image | in resized rows
+int BandHalo(const zncc_params& params)
 {
-    // create buffer with read/write access so that it can be reused
-    cl::Buffer crossCheckedImage(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(unsigned int) * (width * height));
-    cl::Kernel kernelCrossCheck(cl_info_obj.program, "cross_check");
+    return (params.winSize - 1) / 2 + params.neighbours / 2 + 2;
+}
 
-    // set arguments
-    kernelCrossCheck.setArg(0, crossDiff);
-    kernelCrossCheck.setArg(1, dispMapLeft);
-    kernelCrossCheck.setArg(2, dispMapRight);
-    kernelCrossCheck.setArg(3, crossCheckedImage);
+// Run the pipeline on resized rows [firstRow, lastRow) plus the halo and copy the band's own rows into normImage
+void RunBand(unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height,
+    const zncc_params& params, int firstRow, int lastRow, std::vector<unsigned char>& normImage)
+{
+    int resizedWidth = width / params.resizeFactor;
+    int resizedHeight = height / params.resizeFactor;
+    int haloFirst = std::max(0, firstRow - BandHalo(params));
+    int haloLast = std::min(resizedHeight, lastRow + BandHalo(params));
+
+    // the RGBA rows of the band are contiguous, so the device reads them straight from the full images
+    host_stage stage("Band rows " + std::to_string(firstRow) + " to " + std::to_string(lastRow));
+    size_t offset = static_cast<size_t>(haloFirst) * params.resizeFactor * width * 4;
+    unsigned int bandHeight = (haloLast - haloFirst) * params.resizeFactor;
+    host_buffer band = RunPipeline(WrapRGBA(leftImage + offset, width, bandHeight), WrapRGBA(rightImage + offset, width, bandHeight),
+        width, bandHeight, params);
+
+    std::copy(band.data + static_cast<size_t>(firstRow - haloFirst) * resizedWidth,
+        band.data + static_cast<size_t>(lastRow - haloFirst) * resizedWidth,
+        normImage.begin() + static_cast<size_t>(firstRow) * resizedWidth);
+    UnmapHostBuffer(band);
+    ResolveTraceCommands();
+}
 
-    // queue the cross check kernel
-    cl_info_obj.queue.enqueueNDRangeKernel(kernelCrossCheck, cl::NullRange, cl::NDRange(width, height), cl::NullRange, 0, &cl_info_obj.profEvent);
-    cl_info_obj.profEvent.wait();
+// Rows every device processes to measure its throughput before the image is split between the devices
+const int probeRows = 32;
 
-    // print profiling
-    double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Cross-checking execution time in microseconds " << runTime / (float)10e3 << std::endl;
+// Split the image into horizontal bands, one per device, run them concurrently and stitch the depthmaps
+// band heights are proportional to the rows per second each device reaches on a probe band
+std::vector<unsigned char> RunMultiDevice(const std::vector<cl::Device>& devices, const std::string& src,
+    unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height, const zncc_params& params)
+{
+    int resizedWidth = width / params.resizeFactor;
+    int resizedHeight = height / params.resizeFactor;
+    std::vector<unsigned char> normImage(static_cast<size_t>(resizedWidth) * resizedHeight);
+
+    // every device gets its own context, program and queue
+    // tuned settings are for the full resolution, so bands use the runtime's work group sizes
+    std::vector<cl_info> deviceInfos;
+    for (const cl::Device& device : devices)
+    {
+        InitDevice(device, src, resizedWidth, resizedHeight, false);
+        PrepareVariant(params.winSize, ResizedDisparityRange(params, width), params.neighbours);
+        cl_info_obj.printProfiling = false;
+        deviceInfos.push_back(cl_info_obj);
+    }
+
+    // measure the throughput of every device on the same probe band in the middle of the image
+    std::vector<double> rowsPerSecond(devices.size());
+    std::vector<std::string> errors(devices.size());
+    int probeFirst = std::max(0, (resizedHeight - probeRows) / 2);
+    int probeLast = std::min(resizedHeight, probeFirst + probeRows);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        workers.emplace_back([&, i]() {
+            cl_info_obj = deviceInfos[i];
+            hostTraceTrack = "host " + devices[i].getInfo<CL_DEVICE_NAME>();
+            try
+            {
+                std::vector<unsigned char> deviceProbe(normImage.size());
+                auto probeStart = std::chrono::steady_clock::now();
+                RunBand(leftImage, rightImage, width, height, params, probeFirst, probeLast, deviceProbe);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - probeStart;
+                rowsPerSecond[i] = (probeLast - probeFirst) / std::max(elapsed.count(), 1e-9);
+            }
+            catch (cl::Error& err)
+            {
+                errors[i] = std::string(err.what()) + "(" + std::to_string(err.err()) + ")";
+            }
+        });
+    }
+    for (std::thread& worker : workers) worker.join();
+    workers.clear();
 
-    return crossCheckedImage;
+    // devices that failed the probe get no band
+    double totalRowsPerSecond = 0;
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        if (!errors[i].empty())
+        {
+            std::cout << "Warning: device " << devices[i].getInfo<CL_DEVICE_NAME>() << " failed (" << errors[i] << "), not using it" << std::endl;
+            rowsPerSecond[i] = 0;
+        }
+        totalRowsPerSecond += rowsPerSecond[i];
+    }
+    if (totalRowsPerSecond == 0)
+    {
+        throw cl::Error(CL_DEVICE_NOT_FOUND, "No selected device could run the pipeline");
+    }
+
+    // band boundaries from the cumulative throughput share | the last used device takes the rounding remainder
+    std::vector<int> bandFirst(devices.size()), bandLast(devices.size());
+    double cumulativeShare = 0;
+    int row = 0;
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        cumulativeShare += rowsPerSecond[i] / totalRowsPerSecond;
+        bandFirst[i] = row;
+        row = static_cast<int>(cumulativeShare * resizedHeight + 0.5);
+        bandLast[i] = std::min(row, resizedHeight);
+    }
+    for (size_t i = devices.size(); i-- > 0;)
+    {
+        if (rowsPerSecond[i] > 0)
+        {
+            bandLast[i] = resizedHeight;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        std::cout << "Device " << devices[i].getInfo<CL_DEVICE_NAME>() << ": " << rowsPerSecond[i] << " rows/s, band rows "
+            << bandFirst[i] << " to " << bandLast[i] << std::endl;
+        if (bandFirst[i] >= bandLast[i]) continue;
+
+        workers.emplace_back([&, i]() {
+            cl_info_obj = deviceInfos[i];
+            hostTraceTrack = "host " + devices[i].getInfo<CL_DEVICE_NAME>();
+            try
+            {
+                RunBand(leftImage, rightImage, width, height, params, bandFirst[i], bandLast[i], normImage);
+            }
+            catch (cl::Error& err)
+            {
+                errors[i] = std::string(err.what()) + "(" + std::to_string(err.err()) + ")";
+            }
+        });
+    }
+    for (std::thread& worker : workers) worker.join();
+
+    // a lost band would leave a hole in the depthmap, so any failure here fails the run
+    bool bandFailed = false;
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        if (!errors[i].empty() && rowsPerSecond[i] > 0)
+        {
+            std::cerr << "ERROR: band of device " << devices[i].getInfo<CL_DEVICE_NAME>() << " failed: " << errors[i] << std::endl;
+            bandFailed = true;
+        }
+    }
+    if (bandFailed)
+    {
+        throw cl::Error(CL_INVALID_VALUE, "Multi-device band failed");
+    }
+    return normImage;
+}
+
+// Horizontal strip of the streaming mode | own rows [first, last) are kept, the halo rows only feed them, in resized rows
+struct stream_strip {
+    int first, last;
+    int haloFirst, haloLast;
+};
+
+// Device memory of one strip in flight | the streaming mode cycles through two of them
+struct stream_slot {
+    cl::Buffer left, right;         // RGBA rows of the strip and its halo
+    cl::Event leftUpload, rightUpload;
+    cl::Buffer depthmap;            // normalized depthmap of the strip, kept alive until it has been read back
+    cl::Event readback;
+};
+
+// Split the resized image into strips of stripRows rows with the halo of BandHalo
+std::vector<stream_strip> StreamStrips(const zncc_params& params, int resizedHeight, int stripRows)
+{
+    std::vector<stream_strip> strips;
+    for (int row = 0; row < resizedHeight; row += stripRows)
+    {
+        stream_strip strip;
+        strip.first = row;
+        strip.last = std::min(resizedHeight, row + stripRows);
+        strip.haloFirst = std::max(0, strip.first - BandHalo(params));
+        strip.haloLast = std::min(resizedHeight, strip.last + BandHalo(params));
+        strips.push_back(strip);
+    }
+    return strips;
 }
 
-cl::Buffer EnqueueOcclusionFilling(const cl::Buffer crossCheckedImage, 
-    const int width, const int height, const int nCount)
+// Enqueue the upload of the strip's RGBA rows into the slot on the transfer queue | does not wait for it
+void UploadStrip(stream_slot& slot, const stream_strip& strip, const unsigned char* leftImage, const unsigned char* rightImage,
+    unsigned int width, const zncc_params& params)
 {
-    // no buffer created here, as the input image's invalid pixels are filled in directly
-    cl::Kernel kernelFilling(cl_info_obj.program, "occlusion_filling");
+    size_t offset = static_cast<size_t>(strip.haloFirst) * params.resizeFactor * width * 4;
+    size_t size = static_cast<size_t>(strip.haloLast - strip.haloFirst) * params.resizeFactor * width * 4;
+
+    auto hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.transferQueue.enqueueWriteBuffer(slot.left, CL_FALSE, 0, size, leftImage + offset, NULL, &slot.leftUpload);
+    TraceCommand(slot.leftUpload, "Upload left strip", hostQueued, true);
+
+    hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.transferQueue.enqueueWriteBuffer(slot.right, CL_FALSE, 0, size, rightImage + offset, NULL, &slot.rightUpload);
+    TraceCommand(slot.rightUpload, "Upload right strip", hostQueued, true);
+}
 
-    if (nCount * nCount > cl_info_obj.device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>())
+// Run the pipeline strip by strip on the calling thread's device | stripRows is the height of a strip in resized rows
+// upload of strip k+1 and readback of strip k-1 run on the transfer queue while the kernels of strip k run on the
+// compute queue, and device memory holds at most two strips with their intermediate buffers instead of the whole image
+std::vector<unsigned char> RunStreaming(const unsigned char* leftImage, const unsigned char* rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params, int stripRows)
+{
+    int resizedWidth = width / params.resizeFactor;
+    int resizedHeight = height / params.resizeFactor;
+    std::vector<unsigned char> normImage(static_cast<size_t>(resizedWidth) * resizedHeight);
+    std::vector<stream_strip> strips = StreamStrips(params, resizedHeight, std::max(1, stripRows));
+
+    // input buffers sized for the tallest strip, they are reused for every strip of their slot
+    int slotRows = 0;
+    for (const stream_strip& strip : strips)
+    {
+        slotRows = std::max(slotRows, strip.haloLast - strip.haloFirst);
+    }
+    size_t slotSize = static_cast<size_t>(slotRows) * params.resizeFactor * width * 4;
+    stream_slot slots[2];
+    for (stream_slot& slot : slots)
+    {
+        slot.left = cl::Buffer(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, slotSize);
+        slot.right = cl::Buffer(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, slotSize);
+    }
+    if (cl_info_obj.printProfiling)
     {
-        std::cout << "Warning: cross-check window size (nCount * nCount) bigger than allowed work group size." << std::endl;
-        std::cout << "Possible undefined behavior.Choose smaller nCount." << std::endl;
-        //nCount = cl_info_obj.device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()
+        std::cout << "Streaming " << strips.size() << " strips of " << stripRows << " rows, "
+            << 2 * 2 * slotSize / 1024 << " KiB of input buffers" << std::endl;
     }
 
-    // set arguments
-    kernelFilling.setArg(0, nCount);
-    kernelFilling.setArg(1, crossCheckedImage);
+    UploadStrip(slots[0], strips[0], leftImage, rightImage, width, params);
+    for (size_t k = 0; k < strips.size(); k++)
+    {
+        host_stage stage("Strip rows " + std::to_string(strips[k].first) + " to " + std::to_string(strips[k].last));
+        stream_slot& slot = slots[k % 2];
 
-    // queue the occlusion filling kernel
-    cl_info_obj.queue.enqueueNDRangeKernel(kernelFilling, cl::NullRange, cl::NDRange(width, height), cl::NullRange, 0, &cl_info_obj.profEvent);
-    cl_info_obj.profEvent.wait();
+        // the other slot's input buffers are free, as the kernels of strip k-1 have finished
+        if (k + 1 < strips.size())
+        {
+            UploadStrip(slots[(k + 1) % 2], strips[k + 1], leftImage, rightImage, width, params);
+        }
 
-    // print profiling
-    double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Occlusion filling execution time in microseconds " << runTime / (float)10e3 << std::endl;
+        slot.leftUpload.wait();
+        slot.rightUpload.wait();
+        unsigned int stripHeight = (strips[k].haloLast - strips[k].haloFirst) * params.resizeFactor;
+        cl::Buffer depthmap = EnqueuePipeline(slot.left, slot.right, width, stripHeight, params);
+
+        // strip k-2 was read back while strip k-1 ran, so its depthmap can be released
+        if (slot.readback()) slot.readback.wait();
+        slot.depthmap = depthmap;
+
+        // the kernels have finished, so the transfer queue can read the strip's own rows without an event dependency
+        auto hostQueued = std::chrono::steady_clock::now();
+        cl_info_obj.transferQueue.enqueueReadBuffer(slot.depthmap, CL_FALSE,
+            static_cast<size_t>(strips[k].first - strips[k].haloFirst) * resizedWidth,
+            static_cast<size_t>(strips[k].last - strips[k].first) * resizedWidth,
+            normImage.data() + static_cast<size_t>(strips[k].first) * resizedWidth, NULL, &slot.readback);
+        TraceCommand(slot.readback, "Read back strip", hostQueued, true);
+    }
+    cl_info_obj.transferQueue.finish();
+    ResolveTraceCommands();
+    return normImage;
+}
+
+// Blocking read of an int buffer of the calling thread's device into disparities, which has the buffer's size
+void ReadDisparities(const cl::Buffer& buffer, std::vector<int>& disparities, const char* label)
+{
+    cl::Event readEvent;
+    auto hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.queue.enqueueReadBuffer(buffer, CL_TRUE, 0, sizeof(int) * disparities.size(), disparities.data(), NULL, &readEvent);
+    TraceCommand(readEvent, label, hostQueued);
+}
 
-    return crossCheckedImage;
+// Make a device's objects the calling thread's for one stage, with the program specialized for the parameters once
+// they recur, and keep what the stage added to them, e.g. built variants
+template <typename Stage>
+void RunOnDevice(cl_info& info, int windowSize, int ndisp, int neighbours, Stage stage)
+{
+    cl_info_obj = info;
+    cl::Program genericProgram = cl_info_obj.program;
+    cl_info_obj.program = VariantProgram(windowSize, ndisp, neighbours);
+    stage();
+    cl_info_obj.program = genericProgram;
+    ResolveTraceCommands();
+    info = cl_info_obj;
 }
 
-cl::Buffer EnqueueNormalizeToChar(const cl::Buffer filledImage, 
-    const int width, const int height, const int ndisp)
+// Backend on an OpenCL device | deviceInfo is the device's cl_info after InitDevice
+stereo_backend OpenCLBackend(const cl_info& deviceInfo, int index)
 {
-    // buffer with write only permission as it will not be reused in the future anymore
-    cl::Buffer normImage(cl_info_obj.context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(unsigned char) * (width * height));
-    cl::Kernel kernelNorm(cl_info_obj.program, "normalize_to_char");
+    std::shared_ptr<cl_info> info = std::make_shared<cl_info>(deviceInfo);
+    stereo_backend backend;
+    backend.name = "opencl " + std::to_string(index) + " " + deviceInfo.device.getInfo<CL_DEVICE_NAME>();
+    backend.match = [info](unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height,
+        const zncc_params& params, stereo_maps& maps) {
+        maps.width = width / params.resizeFactor;
+        maps.height = height / params.resizeFactor;
+        maps.ndisp = ResizedDisparityRange(params, width);
+        RunOnDevice(*info, params.winSize, maps.ndisp, params.neighbours, [&]() {
+            int minDisp = ResizedMinDisparity(params, width);
+            auto leftResized = EnqueueGrayScaleResize(WrapRGBA(leftImage, width, height), width, height, params.resizeFactor);
+            auto rightResized = EnqueueGrayScaleResize(WrapRGBA(rightImage, width, height), width, height, params.resizeFactor);
+            auto leftStats = EnqueueBoxStats(leftResized, maps.width, maps.height, params.winSize);
+            auto rightStats = EnqueueBoxStats(rightResized, maps.width, maps.height, params.winSize);
+            auto leftMap = EnqueueZNCC(leftResized, rightResized, leftStats, rightStats, maps.width, maps.height, params.winSize,
+                maps.ndisp, 1, 1, std::vector<roi>(), minDisp);
+            auto rightMap = EnqueueZNCC(rightResized, leftResized, rightStats, leftStats, maps.width, maps.height, params.winSize,
+                maps.ndisp, -1, 1, std::vector<roi>(), minDisp);
+            maps.left.resize(static_cast<size_t>(maps.width) * maps.height);
+            maps.right.resize(maps.left.size());
+            ReadDisparities(leftMap, maps.left, "Read left disparities");
+            ReadDisparities(rightMap, maps.right, "Read right disparities");
+        });
+    };
+    backend.postProcess = [info](const zncc_params& params, stereo_maps& maps) {
+        RunOnDevice(*info, params.winSize, maps.ndisp, params.neighbours, [&]() {
+            size_t size = sizeof(int) * maps.left.size();
+            cl::Buffer leftMap(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, size, maps.left.data());
+            cl::Buffer rightMap(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, size, maps.right.data());
+            auto crossChecked = EnqueueCrossCheck(leftMap, rightMap, maps.width, maps.height, params.crossDiff);
+            auto filled = EnqueueOcclusionFilling(crossChecked, maps.width, maps.height, params.neighbours);
+            maps.filled.resize(maps.left.size());
+            ReadDisparities(filled, maps.filled, "Read disparities");
+        });
+    };
+    backend.pipeline = [info](unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height,
+        const zncc_params& params, stereo_maps& maps) {
+        maps.width = width / params.resizeFactor;
+        maps.height = height / params.resizeFactor;
+        maps.ndisp = ResizedDisparityRange(params, width);
+        RunOnDevice(*info, params.winSize, maps.ndisp, params.neighbours, [&]() {
+            auto filled = EnqueueDisparityMap(WrapRGBA(leftImage, width, height), WrapRGBA(rightImage, width, height), width, height, params);
+            maps.filled.resize(static_cast<size_t>(maps.width) * maps.height);
+            ReadDisparities(filled, maps.filled, "Read disparities");
+        });
+    };
+    return backend;
+}
 
-    // set arguments
-    kernelNorm.setArg(0, ndisp);
-    kernelNorm.setArg(1, filledImage);
-    kernelNorm.setArg(2, normImage);
+// Backend picked for every stage, as indices into the backend list
+struct dispatch_plan {
+    int stages[STAGE_COUNT] = { 0, 0 };
+};
 
-    // queue the resizing kernel
-    cl_info_obj.queue.enqueueNDRangeKernel(kernelNorm, cl::NullRange, width * height, cl::NullRange, 0, &cl_info_obj.profEvent);
-    cl_info_obj.profEvent.wait();
+// Plans of earlier calibrations, one entry per set of backends, image size and parameters
+const char* dispatchCachePath = "../tuning/dispatch.json";
 
-    // print profiling
-    double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-    std::cout << "Image normalization execution time in microseconds " << runTime / (float)10e3 << std::endl;
+// Runs of every stage on the probe band while calibrating | the fastest run is used, as the first one includes
+// one-off costs like creating the kernels
+const int calibrationRepetitions = 2;
+
+// Share of the probe band's ZNCC disparities a backend may disagree on with the first one and still be picked for
+// matching | the float scores of the device and the host can round differently where two disparities tie
+// post-processing works on integer disparities and has to agree on every pixel
+const double matchingTolerance = 1e-3;
 
+// Share of the disparities two maps disagree on | 1 if their sizes differ
+double MismatchShare(const std::vector<int>& map, const std::vector<int>& reference)
+{
+    if (map.size() != reference.size()) return 1;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < map.size(); i++)
+    {
+        mismatches += map[i] != reference[i];
+    }
+    return reference.empty() ? 0 : static_cast<double>(mismatches) / reference.size();
+}
+
+std::string DispatchKey(const std::vector<stereo_backend>& backends, unsigned int width, unsigned int height, const zncc_params& params)
+{
+    std::string key;
+    for (const stereo_backend& backend : backends)
+    {
+        key += backend.name + ";";
+    }
+    return key + std::to_string(width) + "x" + std::to_string(height) + ";rf " + std::to_string(params.resizeFactor) +
+        ";win " + std::to_string(params.winSize) + ";disp " + std::to_string(params.minDisparity) + "-" + std::to_string(params.ndisp) +
+        ";n " + std::to_string(params.neighbours);
+}
+
+// Plan of an earlier calibration for the key | false if there is none or one of its backends is gone
+bool LoadDispatchPlan(const std::string& key, const std::vector<stereo_backend>& backends, dispatch_plan& plan)
+{
+    json_value cache = ReadTuningCache(dispatchCachePath);
+    const json_value* entries = cache.Find("entries");
+    const json_value* entry = entries ? entries->Find(key) : nullptr;
+    if (!entry) return false;
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        const json_value* name = entry->Find(stereoStageNames[stage]);
+        auto backend = std::find_if(backends.begin(), backends.end(),
+            [name](const stereo_backend& candidate) { return name && candidate.name == name->string; });
+        if (backend == backends.end()) return false;
+        plan.stages[stage] = static_cast<int>(backend - backends.begin());
+    }
+    return true;
+}
+
+void SaveDispatchPlan(const std::string& key, const std::vector<stereo_backend>& backends, const dispatch_plan& plan)
+{
+    json_value cache = ReadTuningCache(dispatchCachePath);
+    json_value entries = cache.Find("entries") ? *cache.Find("entries") : json_value();
+    entries.type = json_value::object_type;
+
+    json_value entry;
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        entry.Set(stereoStageNames[stage], JsonString(backends[plan.stages[stage]].name));
+    }
+    entries.Set(key, entry);
+    cache.Set("entries", entries);
+
+    std::ofstream file(dispatchCachePath);
+    if (!file)
+    {
+        std::cout << "Warning: could not write dispatch cache " << dispatchCachePath << std::endl;
+        return;
+    }
+    WriteJson(file, cache);
+    file << std::endl;
+}
+
+// Time the stages of every backend on a probe band of probeRows resized rows in the middle of the pair and pick the
+// fastest backend per stage | every backend post-processes the maps the first backend matched
+// the results of every backend are checked against those of the first one, and a backend that doesn't produce the
+// same maps is not picked for the stage, so the depthmap doesn't depend on the plan
+dispatch_plan CalibrateBackends(const std::vector<stereo_backend>& backends, unsigned char* leftImage, unsigned char* rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params)
+{
+    int resizedHeight = height / params.resizeFactor;
+    int probeFirst = std::max(0, (resizedHeight - probeRows) / 2);
+    int probeLast = std::min(resizedHeight, probeFirst + probeRows);
+    size_t offset = static_cast<size_t>(probeFirst) * params.resizeFactor * width * 4;
+    unsigned int probeHeight = (probeLast - probeFirst) * params.resizeFactor;
+
+    dispatch_plan plan;
+    double bestSeconds[STAGE_COUNT];
+    std::fill(bestSeconds, bestSeconds + STAGE_COUNT, std::numeric_limits<double>::infinity());
+    stereo_maps probeMaps;
+    std::vector<int> probeFilled;
+    for (size_t i = 0; i < backends.size(); i++)
+    {
+        double seconds[STAGE_COUNT];
+        std::fill(seconds, seconds + STAGE_COUNT, std::numeric_limits<double>::infinity());
+        double mismatch[STAGE_COUNT] = { 0, 0 };
+        for (int repetition = 0; repetition < calibrationRepetitions; repetition++)
+        {
+            stereo_maps maps;
+            auto start = std::chrono::steady_clock::now();
+            backends[i].match(leftImage + offset, rightImage + offset, width, probeHeight, params, maps);
+            seconds[STAGE_MATCHING] = std::min(seconds[STAGE_MATCHING], std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            if (i == 0 && repetition == 0) probeMaps = maps;
+            mismatch[STAGE_MATCHING] = std::max(mismatch[STAGE_MATCHING],
+                std::max(MismatchShare(maps.left, probeMaps.left), MismatchShare(maps.right, probeMaps.right)));
+
+            maps = probeMaps;
+            start = std::chrono::steady_clock::now();
+            backends[i].postProcess(params, maps);
+            seconds[STAGE_POST_PROCESSING] = std::min(seconds[STAGE_POST_PROCESSING], std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            if (i == 0 && repetition == 0) probeFilled = maps.filled;
+            mismatch[STAGE_POST_PROCESSING] = std::max(mismatch[STAGE_POST_PROCESSING], MismatchShare(maps.filled, probeFilled));
+        }
+
+        std::cout << backends[i].name << ": matching " << seconds[STAGE_MATCHING] * 1e3 << " ms, post-processing "
+            << seconds[STAGE_POST_PROCESSING] * 1e3 << " ms on " << probeLast - probeFirst << " rows" << std::endl;
+        const double tolerance[STAGE_COUNT] = { matchingTolerance, 0 };
+        for (int stage = 0; stage < STAGE_COUNT; stage++)
+        {
+            if (mismatch[stage] > tolerance[stage])
+            {
+                std::cout << "Warning: " << backends[i].name << " disagrees with " << backends[0].name << " on "
+                    << mismatch[stage] * 100 << "% of the " << stereoStageNames[stage] << " disparities and is not used for it" << std::endl;
+                continue;
+            }
+            if (seconds[stage] < bestSeconds[stage])
+            {
+                bestSeconds[stage] = seconds[stage];
+                plan.stages[stage] = static_cast<int>(i);
+            }
+        }
+    }
+    return plan;
+}
+
+// Run the pair with the backends of the plan and return the normalized depthmap
+// a backend picked for both stages runs them without the host round trip if it can
+std::vector<unsigned char> RunDispatched(const std::vector<stereo_backend>& backends, const dispatch_plan& plan,
+    unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height, const zncc_params& params)
+{
+    host_stage stage("Dispatched pipeline");
+    const stereo_backend& matcher = backends[plan.stages[STAGE_MATCHING]];
+    stereo_maps maps;
+    if (plan.stages[STAGE_MATCHING] == plan.stages[STAGE_POST_PROCESSING] && matcher.pipeline)
+    {
+        matcher.pipeline(leftImage, rightImage, width, height, params, maps);
+    }
+    else
+    {
+        matcher.match(leftImage, rightImage, width, height, params, maps);
+        backends[plan.stages[STAGE_POST_PROCESSING]].postProcess(params, maps);
+    }
+
+    std::vector<unsigned char> normImage(maps.filled.size());
+    for (size_t i = 0; i < normImage.size(); i++)
+    {
+        normImage[i] = static_cast<unsigned char>(static_cast<float>(maps.filled[i]) / maps.ndisp * 255);
+    }
     return normImage;
 }
 
+// Co-scheduling of the ZNCC rows of a stream of pairs between the device and the host's cores | the device matches
+// the rows above the split, the host the rows below, and the split follows the rows per second both sides reached
+struct cosched_state {
+    double deviceShare = 0.9;       // share of the rows the device matches | the device is assumed faster until measured
+    double deviceRowsPerSecond = 0, hostRowsPerSecond = 0;  // smoothed over the pairs, 0 before the first one
+    double smoothing = 0.5;         // weight of the latest pair in the smoothed rates
+};
+
+// Rows each side matches at least, so that both are measured on every pair
+const int minCoScheduledRows = 4;
+
+// Whole pipeline of a single pair with its ZNCC rows split between the device and the host | the host's rows are
+// merged into the device's disparity maps before cross-check, which runs with occlusion filling and normalization on
+// the device | returns the normalized depthmap and updates the split of the state for the next pair
+std::vector<unsigned char> RunCoScheduled(const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, const zncc_params& params, cosched_state& state)
+{
+    host_stage stage("Co-scheduled pipeline");
+    int ndisp = ResizedDisparityRange(params, width);
+    int minDisp = ResizedMinDisparity(params, width);
+    cl::Program genericProgram = cl_info_obj.program;
+    cl_info_obj.program = VariantProgram(params.winSize, ndisp, params.neighbours);
+
+    auto leftResized = EnqueueGrayScaleResize(leftImage, width, height, params.resizeFactor);
+    auto rightResized = EnqueueGrayScaleResize(rightImage, width, height, params.resizeFactor);
+    width = width / params.resizeFactor;
+    height = height / params.resizeFactor;
+    int resizedWidth = width, resizedHeight = height;
+    size_t pixels = static_cast<size_t>(resizedWidth) * resizedHeight;
+
+    // the host matches its rows on its own copy of the resized images
+    std::vector<unsigned char> hostLeft(pixels), hostRight(pixels);
+    cl::Event readEvent;
+    auto hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.queue.enqueueReadBuffer(leftResized, CL_FALSE, 0, pixels, hostLeft.data(), NULL, &readEvent);
+    TraceCommand(readEvent, "Read resized image", hostQueued);
+    hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.queue.enqueueReadBuffer(rightResized, CL_TRUE, 0, pixels, hostRight.data(), NULL, &readEvent);
+    TraceCommand(readEvent, "Read resized image", hostQueued);
+
+    int splitRow = static_cast<int>(state.deviceShare * resizedHeight + 0.5);
+    splitRow = std::max(std::min(minCoScheduledRows, resizedHeight), std::min(splitRow, resizedHeight - minCoScheduledRows));
+
+    // the host's rows run with the OpenMP stages on their own thread while this one enqueues the device's kernels and
+    // waits for them
+    std::vector<int> hostLeftMap(pixels), hostRightMap(pixels);
+    double hostSeconds = 0;
+    std::thread hostWorker([&]() {
+        auto start = std::chrono::steady_clock::now();
+        openmp::CalcZNCC(hostLeft, hostRight, resizedWidth, resizedHeight, params.winSize, ndisp, hostLeftMap, 1, minDisp, splitRow);
+        openmp::CalcZNCC(hostRight, hostLeft, resizedWidth, resizedHeight, params.winSize, ndisp, hostRightMap, -1, minDisp, splitRow);
+        hostSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    });
+
+    cl::Buffer leftMap, rightMap;
+    double deviceSeconds = 0;
+    try
+    {
+        std::vector<roi> deviceRows = { { 0, 0, resizedWidth, splitRow } };
+        auto leftStats = EnqueueBoxStats(leftResized, width, height, params.winSize);
+        auto rightStats = EnqueueBoxStats(rightResized, width, height, params.winSize);
+
+        // only the ZNCC launches are timed | the window statistics cover the whole image whatever the split is, so they
+        // would be charged to the device's rows alone
+        auto start = std::chrono::steady_clock::now();
+        leftMap = EnqueueZNCC(leftResized, rightResized, leftStats, rightStats, width, height, params.winSize, ndisp, 1, 1, deviceRows, minDisp);
+        rightMap = EnqueueZNCC(rightResized, leftResized, rightStats, leftStats, width, height, params.winSize, ndisp, -1, 1, deviceRows, minDisp);
+        deviceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    catch (...)
+    {
+        hostWorker.join();
+        throw;
+    }
+    hostWorker.join();
+
+    // the host's rows into the device's maps, so that cross-check and occlusion filling see one disparity map
+    size_t bandOffset = static_cast<size_t>(splitRow) * resizedWidth;
+    size_t bandBytes = sizeof(int) * (pixels - bandOffset);
+    if (bandBytes > 0)
+    {
+        std::pair<std::vector<int>*, cl::Buffer*> maps[] = { { &hostLeftMap, &leftMap }, { &hostRightMap, &rightMap } };
+        for (auto& map : maps)
+        {
+            cl::Buffer band(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, bandBytes, map.first->data() + bandOffset);
+            cl::Event copyEvent;
+            hostQueued = std::chrono::steady_clock::now();
+            cl_info_obj.queue.enqueueCopyBuffer(band, *map.second, 0, sizeof(int) * bandOffset, bandBytes, NULL, &copyEvent);
+            TraceCommand(copyEvent, "Merge host rows", hostQueued);
+        }
+    }
+
+    auto crossChecked = EnqueueCrossCheck(leftMap, rightMap, width, height, params.crossDiff);
+    auto filled = EnqueueOcclusionFilling(crossChecked, width, height, params.neighbours);
+    auto normImage = EnqueueNormalizeToChar(filled, width, height, ndisp);
+    std::vector<unsigned char> depthmap(pixels);
+    hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.queue.enqueueReadBuffer(normImage, CL_TRUE, 0, pixels, depthmap.data(), NULL, &readEvent);
+    TraceCommand(readEvent, "Read depthmap", hostQueued);
+    cl_info_obj.program = genericProgram;
+    ResolveTraceCommands();
+
+    // rows per second of both sides, smoothed over the pairs, decide the split of the next pair
+    double deviceRate = splitRow / std::max(deviceSeconds, 1e-9);
+    double hostRate = (resizedHeight - splitRow) / std::max(hostSeconds, 1e-9);
+    bool first = state.deviceRowsPerSecond == 0;
+    state.deviceRowsPerSecond = first ? deviceRate : state.smoothing * deviceRate + (1 - state.smoothing) * state.deviceRowsPerSecond;
+    state.hostRowsPerSecond = first ? hostRate : state.smoothing * hostRate + (1 - state.smoothing) * state.hostRowsPerSecond;
+    state.deviceShare = state.deviceRowsPerSecond / std::max(1e-9, state.deviceRowsPerSecond + state.hostRowsPerSecond);
+    return depthmap;
+}
+
 int main()
 {
     // from calib.txt - downsized
@@ -190,86 +1067,148 @@ int main()
     // so the maximum disparity value is directly related to the image resolution.
     // To account for this reduction in resolution, we need to adjust the maximum disparity value by the same factor that we used to downsample the image
 
-    int ndisp = 260;
-    int resizeFactor = 4;
-    int winSize = 11;
-    int neighbours = 8;
-    int crossDiff = 32;
+    zncc_params params;
+    params.ndisp = 260;
+    params.resizeFactor = 4;
+    params.winSize = 11;
+    params.neighbours = 8;
+    params.crossDiff = 32;
+    // fit the ZNCC scores around every cross-checked disparity for a float disparity, which gives the same depth
+    // resolution as matching at a smaller resizeFactor | e.g. resizeFactor 8 with sub-pixel instead of 4 without
+    params.subpixel = false;
+    params.equiangular = false;
+
+    // Middlebury calib.txt of the scene | if it exists, only its [vmin, vmax] disparities are searched instead of
+    // 0 to ndisp, which often is a small part of the range
+    const char* calibrationFile = "../img/calib.txt";
+
+    // benchmark the work group sizes and ZNCC kernel variants for this device and image size before running
+    // the results are stored in ../tuning/ and loaded automatically by later runs
+    bool autotune = false;
+
+    // devices to run on | comma separated list of gpu, cpu, accelerator, all, an index from the printed
+    // device list or part of a device or platform name (e.g. "pocl"); without multiDevice the first match is used
+    std::string deviceSelector = "gpu,cpu";
+    // split the image into bands over all selected devices
+    bool multiDevice = false;
+
+    // run every stage on the backend that is fastest for this machine, image size and parameters | the stages of the
+    // CPU and OpenMP implementations and all devices matching deviceSelector are timed on a probe band on the first run,
+    // the choice is cached in ../tuning/dispatch.json and stages can be mixed, e.g. matching on a GPU and
+    // post-processing with OpenMP
+    bool dispatchMode = false;
+
+    // split the ZNCC rows of every pair between the device and the OpenMP stages, the split following the rows per
+    // second each side reached on the previous pairs | for integrated GPUs or a CPU device next to native threads
+    bool coScheduling = false;
+
+    // stream the image through the device in horizontal strips of stripRows resized rows, so device memory is bounded
+    // by the strip size | for inputs larger than the device's global memory, pairs then run one after the other
+    bool streaming = false;
+    int stripRows = 64;
+
+    // compute the depthmap only inside these rectangles of the resized image, of the first pair, each written to
+    // cl_depthmap_roi_<index>.png | empty for the full frame
+    std::vector<roi> regions;
+
+    // compute disparity and ZNCC score only for these pixels of the resized left image of the first pair,
+    // written to keypointsOut as "x y disparity score" lines | empty for the dense depthmap
+    std::vector<keypoint> keypoints;
+    const char* keypointsOut = "../img/cl_keypoints.txt";
+
+    // treat the image pairs as frames of a video, each frame searching only around the previous frame's disparities
+    // instead of batching them | depthmaps are written like for a batch
+    bool temporalMode = false;
+
+    // treat the image pairs as frames of a video and match each frame again only in the tiles that changed since
+    // the previous one plus their halo, the rest keeps the cached disparities | takes precedence over temporalMode
+    bool incrementalMode = false;
+
+    // return the best depthmap of the first pair completed within latencyBudget seconds | the pair is matched at
+    // anytimeLevels from the coarsest to params.resizeFactor, every level only around the disparities of the previous
+    // one, and the finest completed level is written | the quality flags of its pixels (level, QUALITY_FILLED)
+    // are written to qualityOut
+    bool anytimeMode = false;
+    double latencyBudget = 0.03;
+    std::vector<int> anytimeLevels = { 4 * params.resizeFactor, 2 * params.resizeFactor, params.resizeFactor };
+    const char* qualityOut = "../img/cl_quality.png";
 
     // setup inputs and outputs
-    const char* leftImgName = "../img/im0.png";
-    const char* rightImgName = "../img/im1.png";
+    // every pair must have the same size | with more than one pair all of them go through each kernel in one launch
+    // and the depthmaps are written to cl_depthmap_optimized_<index>.png
+    std::vector<std::pair<std::string, std::string>> imagePairs = {
+        { "../img/im0.png", "../img/im1.png" },
+    };
 
     const char* depthmapOut = "../img/cl_depthmap_optimized.png";
 
-    // create containers for raw images
-    std::vector<unsigned char> leftImage;
-    std::vector<unsigned char> rightImage;
-    unsigned int width, height;
+    // timeline of the run, open traceOut in chrome://tracing or ui.perfetto.dev | summaryOut has the per stage totals
+    const char* traceOut = "../profiling/cl_trace_optimized.json";
+    const char* summaryOut = "../profiling/cl_summary_optimized.json";
+
+    // decode images | the conversion to RGBA is done once the device memory they go to exists
+    int pairs = static_cast<int>(imagePairs.size());
+    std::vector<decoded_png> leftPNGs(pairs), rightPNGs(pairs);
+    unsigned int error = 0;
+    {
+        host_stage stage("Decode images");
+        for (int i = 0; i < pairs; i++)
+        {
+            unsigned int decodeError = DecodePNG(imagePairs[i].first.c_str(), leftPNGs[i]);
+            if (decodeError) std::cout << "decoder error first image of pair " << i << ": " << decodeError << ": " << lodepng_error_text(decodeError) << std::endl;
+
+            decodeError = DecodePNG(imagePairs[i].second.c_str(), rightPNGs[i]);
+            if (decodeError) std::cout << "decoder error second image of pair " << i << ": " << decodeError << ": " << lodepng_error_text(decodeError) << std::endl;
+        }
+    }
+
+    unsigned int width = leftPNGs.front().width, height = leftPNGs.front().height;
+    for (int i = 0; i < pairs; i++)
+    {
+        if (leftPNGs[i].width != width || leftPNGs[i].height != height || rightPNGs[i].width != width || rightPNGs[i].height != height)
+        {
+            std::cerr << "ERROR: image pair " << i << " is not " << width << "x" << height << ", all pairs must have the same size" << std::endl;
+            return 1;
+        }
+    }
 
-    // decode images
-    unsigned int error = lodepng::decode(leftImage, width, height, leftImgName, LCT_RGBA, 8);
-    if (error) std::cout << "decoder error first image: " << error << ": " << lodepng_error_text(error) << std::endl;
+    // output name of each pair's depthmap
+    std::vector<std::string> depthmapNames;
+    for (int i = 0; i < pairs; i++)
+    {
+        depthmapNames.push_back(pairs == 1 ? std::string(depthmapOut) : "../img/cl_depthmap_optimized_" + std::to_string(i) + ".png");
+    }
 
-    error = lodepng::decode(rightImage, width, height, rightImgName, LCT_RGBA, 8);
-    if (error) std::cout << "decoder error second image: " << error << ": " << lodepng_error_text(error) << std::endl;
+    calibration calib;
+    if (ReadCalibration(calibrationFile, calib))
+    {
+        ApplyCalibration(calib, params.resizeFactor, params.ndisp, params.minDisparity);
+        std::cout << "Searching disparities " << params.minDisparity << " to " << params.ndisp << " from " << calibrationFile << std::endl;
+    }
 
     try
     {
-        // create the program
-        std::vector<cl::Platform> platforms;
-        cl::Platform::get(&platforms);
-        auto platform = platforms.front();
-
-        std::vector<cl::Device> devices;
-        platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
-        auto device = devices.front();
-
-        std::cout << "------------HARDWARE INFORMATION------------" << std::endl;
-        auto platName = platform.getInfo<CL_PLATFORM_NAME>();
-        auto devVersion = device.getInfo<CL_DEVICE_VERSION>();
-        auto devDriver = device.getInfo<CL_DRIVER_VERSION>();
-        auto devCVersion = device.getInfo<CL_DEVICE_OPENCL_C_VERSION>();
-
-        std::cout << "Platform count: " << platforms.size() << std::endl;
-        std::cout << "Platform 1 name: " << platName << std::endl;
-        std::cout << "Device count on platform 1: " << devices.size() << std::endl;
-        std::cout << "Hardware version: " << devVersion << std::endl;
-        std::cout << "Driver version: " << devDriver << std::endl;
-        std::cout << "OpenCL C version: " << devCVersion << std::endl;
-
-        std::cout << "------------DEVICE INFORMATION------------" << std::endl;
-        auto devInfo = device.getInfo<CL_DEVICE_NAME>();
-        auto devMemType = device.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>();
-        auto devMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
-        auto devPCunits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-        auto devClockFreq = device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
-        auto devConstBuffSize = device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
-        auto devWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
-        auto devWorkItemSizes = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
-        auto devWorkItemDim = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS>();
-        auto devMaxReadImageArgs = device.getInfo<CL_DEVICE_MAX_READ_IMAGE_ARGS>();
-
-        std::cout << "Device information: " << devInfo << std::endl;
-        std::cout << "Local memory types: " << devMemType << std::endl;
-        std::cout << "Local memory size: " << devMemSize << std::endl;
-        std::cout << "Parallel Compute units: " << devPCunits << std::endl;
-        std::cout << "Max clock frequency: " << devClockFreq << std::endl;
-        std::cout << "Max constant buffer size: " << devConstBuffSize << std::endl;
-        std::cout << "Work group size: " << devWorkGroupSize << std::endl;
-        for (size_t i = 0; i < devWorkItemSizes.size(); i++)
+        std::vector<cl::Device> devices = SelectDevices(deviceSelector);
+        if (devices.empty())
+        {
+            std::cerr << "ERROR: no OpenCL device matches \"" << deviceSelector << "\"" << std::endl;
+            return 1;
+        }
+        if (!multiDevice && !dispatchMode)
+        {
+            devices.resize(1);
+        }
+
+        for (const cl::Device& device : devices)
         {
-            std::cout << "Work item " << i << " size: " << devWorkItemSizes[i] << std::endl;
+            PrintDeviceInfo(device);
         }
-        std::cout << "Max Work Item Dimensions: " << devWorkItemDim << std::endl;
-        std::cout << "Max read image arguments: " << devMaxReadImageArgs << std::endl;
 
         std::cout << "------------IMPLEMENTATION------------" << std::endl;
 
         // start timing execution time
-        LARGE_INTEGER start, end, frequency;
-        QueryPerformanceFrequency(&frequency);
-        QueryPerformanceCounter(&start);
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::micro> elapsed_time;
 
         // Create source
         // Note: All kernels are stored in one kernel file as
@@ -277,87 +1216,337 @@ int main()
         std::ifstream kernelFile("../kernels/zncc_kernels_optimized.cl");
         std::string src(std::istreambuf_iterator<char>(kernelFile), (std::istreambuf_iterator<char>()));
 
-        cl::Program::Sources sources(1, std::make_pair(src.c_str(), src.length() + 1));
-
-        // create context and build program
-        cl::Context context(devices);
-        cl::Program program(context, sources);
-
-        int neighbour_size = neighbours * neighbours < devWorkGroupSize ? neighbours * neighbours : devWorkGroupSize;
-
-        std::string str = "-cl-std=CL1.2 -D NEIGHBOUR_SIZE=" + std::to_string(neighbour_size);
-        program.build(str.c_str());
-
-        // create command queue with profiling enabled
-        cl_command_queue_properties properties[]{ CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
-        cl::CommandQueue queue(context, device, properties);
-        cl::Event profEvent;
-
-        // fill in custom struct
-        cl_info_obj.context = context;
-        cl_info_obj.program = program;
-        cl_info_obj.device = device;
-        cl_info_obj.queue = queue;
-        cl_info_obj.profEvent = profEvent;
-
-        // Kernel logic
-        //// Grayscale conversion
-        std::cout << "Converting left image to grayscale..." << std::endl;
-        auto outputImageGrayLeft = EnqueueGrayScaleConversion(leftImage, width, height);
-        std::cout << "Converting right image to grayscale..." << std::endl;
-        auto outputImageGrayRight = EnqueueGrayScaleConversion(rightImage, width, height);
-
-        //// Rescaling
-        // update values depending on resolution
-        int oldWidth = width;
-        width = width / resizeFactor;
-        height = height / resizeFactor;
-        ndisp = ndisp * (static_cast<float>(width) / oldWidth);
-
-        // enqueue resizing
-        std::cout << "Resizing left image to 1/16 size..." << std::endl;
-        auto outputImageResizedLeft = EnqueueResizeImage(outputImageGrayLeft, width, height, resizeFactor);
-        std::cout << "Resizing right image to 1/16 size..." << std::endl;
-        auto outputImageResizedRight = EnqueueResizeImage(outputImageGrayRight, width, height, resizeFactor);
-        
-        // enqueue ZNCC
-        std::cout << "Applying ZNCC to left image..." << std::endl;
-        auto outputZNCCLeft = EnqueueZNCC(outputImageResizedLeft, outputImageResizedRight, width, height, winSize, ndisp);
-        std::cout << "Applying ZNCC to right image..." << std::endl;
-        auto outputZNCCRight = EnqueueZNCC(outputImageResizedRight, outputImageResizedLeft, width, height, winSize, ndisp, -1);
-        
-        // enqueue cross-check
-        std::cout << "Applying cross-check..." << std::endl;
-        auto outputCrossCheck = EnqueueCrossCheck(outputZNCCLeft, outputZNCCRight, width, height, crossDiff);
-
-        // enqueue occlusion filling
-        std::cout << "Applying occlusion filling..." << std::endl;
-        auto outputOcclusionFilling = EnqueueOcclusionFilling(outputCrossCheck, width, height, neighbours);
-
-        //// enqueue normalization
-        std::cout << "Applying image normalization..." << std::endl;
-        auto outputNorm = EnqueueNormalizeToChar(outputOcclusionFilling, width, height, ndisp);
-
-        // read the normalized depthmap output and put it into a vector
-        cl::Event readEvent;
-        std::vector<unsigned char> normImage(width * height);
-        cl_info_obj.queue.enqueueReadBuffer(outputNorm, CL_TRUE, 0, sizeof(unsigned char) * normImage.size(), normImage.data(), 0, &readEvent);
-
-        // print profiling
-        double transferTime = (double)(readEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - readEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-        std::cout << "Final read bus transfer time in microseconds " << transferTime / (float)10e3 << std::endl;
+        unsigned int resizedWidth = width / params.resizeFactor;
+        unsigned int resizedHeight = height / params.resizeFactor;
 
-        // end execution timing and print
-        QueryPerformanceCounter(&end);
-        double elapsed_time;
-        elapsed_time = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
-        std::cout << "Total elapsed time: " << elapsed_time * 1000000 << " microseconds\n";
-
-        error = lodepng::encode(depthmapOut, normImage, width, height, LCT_GREY, 8);
+        if (dispatchMode)
+        {
+            // every device is a backend with its own context, the RGBA images stay in host memory
+            std::vector<stereo_backend> backends = { CPUBackend(), OpenMPBackend() };
+            {
+                host_stage stage("Init devices");
+                for (size_t i = 0; i < devices.size(); i++)
+                {
+                    InitDevice(devices[i], src, resizedWidth, resizedHeight);
+                    cl_info_obj.printProfiling = false;
+                    backends.push_back(OpenCLBackend(cl_info_obj, static_cast<int>(i)));
+                }
+            }
+
+            std::vector<unsigned char> leftImage(static_cast<size_t>(width) * height * 4);
+            std::vector<unsigned char> rightImage(leftImage.size());
+            std::vector<std::vector<unsigned char>> normImages;
+            dispatch_plan plan;
+            for (int i = 0; i < pairs; i++)
+            {
+                {
+                    host_stage stage("Convert images");
+                    ConvertToRGBA(leftPNGs[i], leftImage.data());
+                    ConvertToRGBA(rightPNGs[i], rightImage.data());
+                }
+                if (i == 0)
+                {
+                    std::string key = DispatchKey(backends, width, height, params);
+                    if (LoadDispatchPlan(key, backends, plan))
+                    {
+                        std::cout << "Loaded backend choice from " << dispatchCachePath << std::endl;
+                    }
+                    else
+                    {
+                        host_stage stage("Calibrate backends");
+                        plan = CalibrateBackends(backends, leftImage.data(), rightImage.data(), width, height, params);
+                        SaveDispatchPlan(key, backends, plan);
+                    }
+                    std::cout << "Matching on " << backends[plan.stages[STAGE_MATCHING]].name << ", post-processing on "
+                        << backends[plan.stages[STAGE_POST_PROCESSING]].name << std::endl;
+                }
+                normImages.push_back(RunDispatched(backends, plan, leftImage.data(), rightImage.data(), width, height, params));
+            }
+
+            // end execution timing and print
+            elapsed_time = std::chrono::steady_clock::now() - start;
+            std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+
+            host_stage stage("Encode depthmap");
+            for (int i = 0; i < pairs && !error; i++)
+            {
+                error = lodepng::encode(depthmapNames[i], normImages[i], resizedWidth, resizedHeight, LCT_GREY, 8);
+            }
+        }
+        else if (devices.size() > 1)
+        {
+            // every device has its own context, so the RGBA images stay in host memory and bands are wrapped per device
+            // pairs are not batched here, each one is split over the devices in turn
+            std::vector<unsigned char> leftImage(static_cast<size_t>(width) * height * 4);
+            std::vector<unsigned char> rightImage(leftImage.size());
+            std::vector<std::vector<unsigned char>> normImages;
+
+            std::cout << "Splitting image over " << devices.size() << " devices..." << std::endl;
+            for (int i = 0; i < pairs; i++)
+            {
+                {
+                    host_stage stage("Convert images");
+                    ConvertToRGBA(leftPNGs[i], leftImage.data());
+                    ConvertToRGBA(rightPNGs[i], rightImage.data());
+                }
+                normImages.push_back(RunMultiDevice(devices, src, leftImage.data(), rightImage.data(), width, height, params));
+            }
+
+            // end execution timing and print
+            elapsed_time = std::chrono::steady_clock::now() - start;
+            std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+
+            host_stage stage("Encode depthmap");
+            for (int i = 0; i < pairs && !error; i++)
+            {
+                error = lodepng::encode(depthmapNames[i], normImages[i], resizedWidth, resizedHeight, LCT_GREY, 8);
+            }
+        }
+        else if (temporalMode || incrementalMode)
+        {
+            {
+                host_stage stage("Init device");
+                InitDevice(devices.front(), src, resizedWidth, resizedHeight);
+            }
+            {
+                host_stage stage("Build specialized program");
+                PrepareVariant(params.winSize, ResizedDisparityRange(params, width), params.neighbours);
+            }
+
+            temporal_state state;
+            incremental_state incremental;
+            for (int i = 0; i < pairs && !error; i++)
+            {
+                host_buffer leftImage, rightImage;
+                {
+                    host_stage stage("Upload images");
+                    leftImage = UploadRGBA({ &leftPNGs[i] });
+                    rightImage = UploadRGBA({ &rightPNGs[i] });
+                }
+
+                host_buffer normImage;
+                if (incrementalMode)
+                {
+                    normImage = RunPipeline(leftImage.buffer, rightImage.buffer, width, height, params, 1, NULL, &incremental);
+                    std::cout << "Frame " << i << ": " << 100.0 * incremental.recomputedPixels / std::max(1u, resizedWidth * resizedHeight)
+                        << "% of the pixels matched again" << std::endl;
+                }
+                else
+                {
+                    normImage = RunPipeline(leftImage.buffer, rightImage.buffer, width, height, params, 1, &state);
+                    std::cout << "Frame " << i << ": " << 100.0 * (1.0 - static_cast<double>(state.evaluations) / std::max(1LL, state.fullEvaluations))
+                        << "% of the disparity evaluations saved" << std::endl;
+                }
+
+                host_stage stage("Encode depthmap");
+                error = lodepng::encode(depthmapNames[i], normImage.data, resizedWidth, resizedHeight, LCT_GREY, 8);
+                UnmapHostBuffer(normImage);
+                ResolveTraceCommands();
+            }
+
+            // end execution timing and print
+            elapsed_time = std::chrono::steady_clock::now() - start;
+            std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+        }
+        else if (coScheduling)
+        {
+            {
+                host_stage stage("Init device");
+                InitDevice(devices.front(), src, resizedWidth, resizedHeight, !autotune);
+            }
+            {
+                host_stage stage("Build specialized program");
+                PrepareVariant(params.winSize, ResizedDisparityRange(params, width), params.neighbours);
+            }
+
+            cosched_state state;
+            for (int i = 0; i < pairs && !error; i++)
+            {
+                host_buffer leftImage, rightImage;
+                {
+                    host_stage stage("Upload images");
+                    leftImage = UploadRGBA({ &leftPNGs[i] });
+                    rightImage = UploadRGBA({ &rightPNGs[i] });
+                }
+
+                double deviceShare = state.deviceShare;
+                std::vector<unsigned char> normImage = RunCoScheduled(leftImage.buffer, rightImage.buffer, width, height, params, state);
+                std::cout << "Pair " << i << ": " << 100.0 * deviceShare << "% of the rows on the device, "
+                    << 100.0 * state.deviceShare << "% for the next pair" << std::endl;
+
+                host_stage stage("Encode depthmap");
+                error = lodepng::encode(depthmapNames[i], normImage, resizedWidth, resizedHeight, LCT_GREY, 8);
+            }
+
+            // end execution timing and print
+            elapsed_time = std::chrono::steady_clock::now() - start;
+            std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+        }
+        else if (streaming)
+        {
+            // the images stay in host memory and only the strips in flight are on the device
+            {
+                host_stage stage("Init device");
+                InitDevice(devices.front(), src, resizedWidth, resizedHeight, !autotune);
+            }
+            {
+                host_stage stage("Build specialized program");
+                PrepareVariant(params.winSize, ResizedDisparityRange(params, width), params.neighbours);
+            }
+
+            std::vector<unsigned char> leftImage(static_cast<size_t>(width) * height * 4);
+            std::vector<unsigned char> rightImage(leftImage.size());
+            std::vector<std::vector<unsigned char>> normImages;
+            for (int i = 0; i < pairs; i++)
+            {
+                {
+                    host_stage stage("Convert images");
+                    ConvertToRGBA(leftPNGs[i], leftImage.data());
+                    ConvertToRGBA(rightPNGs[i], rightImage.data());
+                }
+                normImages.push_back(RunStreaming(leftImage.data(), rightImage.data(), width, height, params, stripRows));
+            }
+
+            // end execution timing and print
+            elapsed_time = std::chrono::steady_clock::now() - start;
+            std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+
+            host_stage stage("Encode depthmap");
+            for (int i = 0; i < pairs && !error; i++)
+            {
+                error = lodepng::encode(depthmapNames[i], normImages[i], resizedWidth, resizedHeight, LCT_GREY, 8);
+            }
+        }
+        else
+        {
+            {
+                host_stage stage("Init device");
+                InitDevice(devices.front(), src, resizedWidth, resizedHeight, !autotune);
+            }
+            int resizedDisp = ResizedDisparityRange(params, width);
+            std::cout << "ZNCC vector width: " << cl_info_obj.znccVecWidth << std::endl;
+            std::cout << "Host unified memory: " << (devices.front().getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() ? "yes" : "no") << std::endl;
+
+            // the decoded images are converted straight into the memory the device reads, pairs back to back
+            host_buffer leftImage, rightImage;
+            {
+                host_stage stage("Upload images");
+                std::vector<const decoded_png*> leftList, rightList;
+                for (int i = 0; i < pairs; i++)
+                {
+                    leftList.push_back(&leftPNGs[i]);
+                    rightList.push_back(&rightPNGs[i]);
+                }
+                leftImage = UploadRGBA(leftList);
+                rightImage = UploadRGBA(rightList);
+            }
+
+            if (autotune)
+            {
+                // the generic kernels are tuned, specialized variants use the same local sizes
+                AutotuneKernels(cl_info_obj.context, src, leftImage.buffer, rightImage.buffer, width, height, params.resizeFactor,
+                    params.winSize, resizedDisp, params.neighbours, params.crossDiff);
+                SaveTuning(devices.front(), resizedWidth, resizedHeight);
+
+                // time only the tuned pipeline
+                std::cout << "------------IMPLEMENTATION------------" << std::endl;
+                start = std::chrono::steady_clock::now();
+            }
+
+            // the configured parameters are used for the whole run, so their specialized program is built up front
+            {
+                host_stage stage("Build specialized program");
+                PrepareVariant(params.winSize, resizedDisp, params.neighbours);
+            }
+
+            if (!keypoints.empty())
+            {
+                std::vector<point_disparity> pointDisparities = RunKeypoints(leftImage.buffer, rightImage.buffer, width, height, params, keypoints);
+
+                // end execution timing and print
+                elapsed_time = std::chrono::steady_clock::now() - start;
+                std::cout << "Matched " << keypoints.size() << " keypoints" << std::endl;
+                std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+
+                std::ofstream file(keypointsOut);
+                for (size_t i = 0; i < keypoints.size(); i++)
+                {
+                    file << keypoints[i].x << " " << keypoints[i].y << " " << pointDisparities[i].disparity << " " << pointDisparities[i].score << "\n";
+                }
+            }
+            else if (!regions.empty())
+            {
+                std::vector<std::vector<int>> regionDisparities = RunRegions(leftImage.buffer, rightImage.buffer, width, height, params, regions);
+
+                // end execution timing and print
+                elapsed_time = std::chrono::steady_clock::now() - start;
+                std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+
+                host_stage stage("Encode regions");
+                for (size_t i = 0; i < regions.size() && !error; i++)
+                {
+                    std::vector<unsigned char> regionNormalized(regionDisparities[i].size());
+                    for (size_t j = 0; j < regionNormalized.size(); j++)
+                    {
+                        regionNormalized[j] = static_cast<unsigned char>(static_cast<float>(regionDisparities[i][j]) / resizedDisp * 255);
+                    }
+                    error = lodepng::encode("../img/cl_depthmap_roi_" + std::to_string(i) + ".png", regionNormalized,
+                        regions[i].width, regions[i].height, LCT_GREY, 8);
+                }
+            }
+            else if (anytimeMode)
+            {
+                anytime_result anytime = RunAnytime(leftImage.buffer, rightImage.buffer, width, height, params, anytimeLevels, latencyBudget);
+
+                // end execution timing and print
+                elapsed_time = std::chrono::steady_clock::now() - start;
+                std::cout << "Completed " << anytime.levelsCompleted << " of " << anytimeLevels.size() << " levels" << std::endl;
+                std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+                if (anytime.levelsCompleted == 0) return 1;
+
+                host_stage stage("Encode depthmap");
+                std::vector<unsigned char> normalized(anytime.disparities.size());
+                for (size_t i = 0; i < normalized.size(); i++)
+                {
+                    normalized[i] = static_cast<unsigned char>(static_cast<float>(anytime.disparities[i]) / resizedDisp * 255);
+                }
+                error = lodepng::encode(depthmapNames.front(), normalized, resizedWidth, resizedHeight, LCT_GREY, 8);
+                if (!error) error = lodepng::encode(qualityOut, anytime.quality, resizedWidth, resizedHeight, LCT_GREY, 8);
+            }
+            else
+            {
+                if (pairs > 1) std::cout << "Batching " << pairs << " image pairs" << std::endl;
+                host_buffer normImage = RunPipeline(leftImage.buffer, rightImage.buffer, width, height, params, pairs);
+
+                // end execution timing and print
+                elapsed_time = std::chrono::steady_clock::now() - start;
+                std::cout << "Total elapsed time: " << elapsed_time.count() << " microseconds\n";
+
+                // encode straight from the mapped result
+                host_stage stage("Encode depthmap");
+                size_t mapSize = static_cast<size_t>(resizedWidth) * resizedHeight;
+                for (int i = 0; i < pairs && !error; i++)
+                {
+                    error = lodepng::encode(depthmapNames[i], normImage.data + i * mapSize,
+                        resizedWidth, resizedHeight, LCT_GREY, 8);
+                }
+                UnmapHostBuffer(normImage);
+                ResolveTraceCommands();
+            }
+        }
         if (error) std::cout << "encoder error: " << error << ": " << lodepng_error_text(error) << std::endl;
 
+        if (WriteTrace(traceOut) && WriteTraceSummary(summaryOut, elapsed_time.count()))
+        {
+            std::cout << "Timeline written to " << traceOut << " and " << summaryOut << std::endl;
+        }
+        else
+        {
+            std::cout << "Warning: could not write the timeline to ../profiling/" << std::endl;
+        }
+
     }
-    catch (cl::Error err) {
+    catch (const cl::Error& err) {
         std::cerr
             << "ERROR: "
             << err.what()
@@ -367,4 +1556,4 @@ int main()
             << std::endl;
     }
 
-}
\ No newline at end of file
+}
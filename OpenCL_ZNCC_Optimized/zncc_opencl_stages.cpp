@@ -0,0 +1,1459 @@
+#include "zncc_opencl_stages.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cctype>
+#include <algorithm>
+#include <mutex>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+
+namespace opencl {
+
+// Timeline of the run for chrome://tracing or Perfetto | host stages are timed with steady_clock,
+// OpenCL commands with their queued, submit, start and end profiling timestamps
+struct trace_event {
+    std::string name;
+    std::string track;  // timeline row, e.g. "host" or "<device> execution"
+    double start;       // microseconds since the trace origin
+    double duration;    // microseconds
+    std::vector<std::pair<std::string, double>> args;
+};
+
+// trace events of all threads | the origin is the start of the program
+struct trace_recorder {
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::vector<trace_event> events;
+};
+
+trace_recorder traceRecorder;
+
+thread_local std::string hostTraceTrack = "host";
+
+thread_local cl_info cl_info_obj;
+
+double TraceMicroseconds(std::chrono::steady_clock::time_point time)
+{
+    return std::chrono::duration<double, std::micro>(time - traceRecorder.origin).count();
+}
+
+void AddTraceEvent(const trace_event& event)
+{
+    std::lock_guard<std::mutex> lock(traceRecorder.mutex);
+    traceRecorder.events.push_back(event);
+}
+
+host_stage::~host_stage()
+{
+    trace_event event;
+    event.name = name;
+    event.track = hostTraceTrack;
+    event.start = TraceMicroseconds(start);
+    event.duration = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    AddTraceEvent(event);
+}
+
+void TraceCommand(const cl::Event& event, const std::string& name, std::chrono::steady_clock::time_point hostQueued, bool transfer)
+{
+    if (!cl_info_obj.recordTrace) return;
+
+    pending_command command;
+    command.event = event;
+    command.name = name;
+    command.hostQueued = hostQueued;
+    command.transfer = transfer;
+    cl_info_obj.pendingCommands.push_back(command);
+}
+
+void ResolveTraceCommands()
+{
+    std::vector<pending_command>& commands = cl_info_obj.pendingCommands;
+    if (commands.empty()) return;
+    cl_info_obj.queue.finish();
+    cl_info_obj.transferQueue.finish();
+
+    // profiling timestamps in nanoseconds relative to the earliest queued command, to keep them exact as doubles
+    std::vector<cl_ulong> queued(commands.size()), submit(commands.size()), start(commands.size()), end(commands.size());
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        queued[i] = commands[i].event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+        submit[i] = commands[i].event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+        start[i] = commands[i].event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        end[i] = commands[i].event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    }
+    cl_ulong base = *std::min_element(queued.begin(), queued.end());
+
+    double offset = -std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        offset = std::max(offset, TraceMicroseconds(commands[i].hostQueued) - (queued[i] - base) / 1e3);
+    }
+
+    std::string deviceName = cl_info_obj.device.getInfo<CL_DEVICE_NAME>();
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        // time from enqueue to start, split into waiting in the host queue and waiting on the device
+        trace_event wait;
+        wait.name = commands[i].name;
+        wait.track = deviceName + (commands[i].transfer ? " transfer queue" : " queue");
+        wait.start = (queued[i] - base) / 1e3 + offset;
+        wait.duration = (start[i] - queued[i]) / 1e3;
+        wait.args = { { "queued_to_submit_us", (submit[i] - queued[i]) / 1e3 }, { "submit_to_start_us", (start[i] - submit[i]) / 1e3 } };
+        AddTraceEvent(wait);
+
+        trace_event execution;
+        execution.name = commands[i].name;
+        execution.track = deviceName + (commands[i].transfer ? " transfer" : " execution");
+        execution.start = (start[i] - base) / 1e3 + offset;
+        execution.duration = (end[i] - start[i]) / 1e3;
+        execution.args = { { "queued_to_start_us", wait.duration } };
+        AddTraceEvent(execution);
+    }
+    commands.clear();
+}
+
+// Build options of the optimized kernel file | defines are appended for specialized variants
+std::string BuildOptions(int znccVecWidth, const std::string& defines = "")
+{
+    std::string str = "-cl-std=CL1.2";
+    if (znccVecWidth > 1)
+    {
+        str += " -D ZNCC_VEC_WIDTH=" + std::to_string(znccVecWidth);
+    }
+    return str + defines;
+}
+
+// Build the optimized kernel file with the defines of this run
+cl::Program BuildProgram(const cl::Context& context, const std::string& src, int znccVecWidth, const std::string& defines = "")
+{
+    cl::Program::Sources sources(1, std::make_pair(src.c_str(), src.length() + 1));
+    cl::Program program(context, sources);
+
+    program.build(BuildOptions(znccVecWidth, defines).c_str());
+
+    return program;
+}
+
+cl::NDRange ToNDRange(const std::vector<size_t>& sizes)
+{
+    switch (sizes.size())
+    {
+    case 1: return cl::NDRange(sizes[0]);
+    case 2: return cl::NDRange(sizes[0], sizes[1]);
+    case 3: return cl::NDRange(sizes[0], sizes[1], sizes[2]);
+    default: return cl::NullRange;
+    }
+}
+
+// Tuned local size of the kernel | empty if it has not been tuned
+std::vector<size_t> TunedLocalSize(const std::string& kernelName)
+{
+    auto it = cl_info_obj.localSizes.find(kernelName);
+    return it != cl_info_obj.localSizes.end() ? it->second : std::vector<size_t>();
+}
+
+// Enqueue the kernel and wait for it to finish | label is used when printing the profiling information
+// if a local size is given, the global size is padded to a multiple of it, so kernels have to check their bounds
+// local sizes with fewer dimensions than the global size (e.g. tuned 2D sizes of batched runs) get 1 for the others
+// offset is the global work offset, which is added to the global ids | empty for none
+void EnqueueKernel(const cl::Kernel& kernel, std::vector<size_t> globalSize, std::vector<size_t> localSize, const char* label,
+    const std::vector<size_t>& offset = std::vector<size_t>())
+{
+    if (!localSize.empty()) localSize.resize(globalSize.size(), 1);
+    for (size_t i = 0; i < localSize.size() && i < globalSize.size(); i++)
+    {
+        globalSize[i] = (globalSize[i] + localSize[i] - 1) / localSize[i] * localSize[i];
+    }
+
+    auto hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.queue.enqueueNDRangeKernel(kernel, ToNDRange(offset), ToNDRange(globalSize), ToNDRange(localSize), 0, &cl_info_obj.profEvent);
+    cl_info_obj.profEvent.wait();
+    TraceCommand(cl_info_obj.profEvent, label, hostQueued);
+
+    // print profiling | timestamps are in nanoseconds
+    double runTime = (double)(cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cl_info_obj.profEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+    cl_info_obj.lastRunTime = runTime;
+    if (cl_info_obj.printProfiling)
+    {
+        std::cout << label << " execution time in microseconds " << runTime / 1e3 << std::endl;
+    }
+}
+
+// Vector width for calc_zncc_vec based on the preferred float vector width of the device
+// devices that prefer scalars (most GPUs report 1) keep the scalar calc_zncc kernel
+int ZNCCVectorWidth(const cl::Device& device)
+{
+    cl_uint preferredWidth = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+    if (preferredWidth >= 16) return 16;
+    if (preferredWidth >= 8) return 8;
+    if (preferredWidth >= 4) return 4;
+    return 1;
+}
+
+void MapHostBuffer(host_buffer& hostBuffer, cl_map_flags flags, cl::Event* event)
+{
+    cl::Event mapEvent;
+    auto hostQueued = std::chrono::steady_clock::now();
+    hostBuffer.data = static_cast<unsigned char*>(cl_info_obj.queue.enqueueMapBuffer(hostBuffer.buffer, CL_TRUE, flags, 0, hostBuffer.size, 0, &mapEvent));
+    TraceCommand(mapEvent, "Map buffer", hostQueued);
+    if (event) *event = mapEvent;
+}
+
+void UnmapHostBuffer(host_buffer& hostBuffer)
+{
+    if (hostBuffer.data)
+    {
+        cl::Event unmapEvent;
+        auto hostQueued = std::chrono::steady_clock::now();
+        cl_info_obj.queue.enqueueUnmapMemObject(hostBuffer.buffer, hostBuffer.data, 0, &unmapEvent);
+        TraceCommand(unmapEvent, "Unmap buffer", hostQueued);
+        hostBuffer.data = nullptr;
+    }
+}
+
+host_buffer AllocateHostBuffer(size_t size, cl_mem_flags deviceAccess)
+{
+    host_buffer hostBuffer;
+    hostBuffer.size = size;
+    hostBuffer.buffer = cl::Buffer(cl_info_obj.context, deviceAccess | CL_MEM_ALLOC_HOST_PTR, size);
+    MapHostBuffer(hostBuffer, CL_MAP_WRITE_INVALIDATE_REGION);
+    return hostBuffer;
+}
+
+cl::Buffer WrapRGBA(unsigned char* image, unsigned int width, unsigned int height)
+{
+    return cl::Buffer(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_USE_HOST_PTR, static_cast<size_t>(width) * height * 4, image);
+}
+
+cl::Buffer EnqueueGrayScaleResize(const cl::Buffer& inputImage, unsigned int width, unsigned int height, unsigned int resizeFactor, int pairs)
+{
+    // output is only the resized grayscale image, as the full resolution one is not needed by the rest of the pipeline
+    // read_write access given, so that buffer can be reused as input
+    unsigned int newWidth = width / resizeFactor;
+    unsigned int newHeight = height / resizeFactor;
+    cl::Buffer outputImageBuffResized(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(unsigned char) * (newWidth * newHeight) * pairs);
+    cl::Kernel kernelGrayscaleResize(cl_info_obj.program, "grayscale_resize");
+
+    // set arguments
+    kernelGrayscaleResize.setArg(0, resizeFactor);
+    kernelGrayscaleResize.setArg(1, inputImage);
+    kernelGrayscaleResize.setArg(2, width);
+    kernelGrayscaleResize.setArg(3, height);
+    kernelGrayscaleResize.setArg(4, outputImageBuffResized);
+    kernelGrayscaleResize.setArg(5, newWidth);
+    kernelGrayscaleResize.setArg(6, newHeight);
+
+    // queue the kernel with the size of the output
+    EnqueueKernel(kernelGrayscaleResize, { newWidth, newHeight, (size_t)pairs }, TunedLocalSize("grayscale_resize"), "Grayscale conversion and resize");
+
+    return outputImageBuffResized;
+}
+
+cl::Buffer EnqueueBoxRowSums(const cl::Buffer& image, int width, int height, int windowSize, int pairs)
+{
+    int halfWindowSize = (windowSize - 1) / 2;
+    height *= pairs;
+    cl::Buffer rowSums(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, sizeof(cl_int2) * (width * height));
+    cl::Kernel kernelRowSums(cl_info_obj.program, "box_row_sums");
+
+    // set arguments
+    kernelRowSums.setArg(0, halfWindowSize);
+    kernelRowSums.setArg(1, image);
+    kernelRowSums.setArg(2, rowSums);
+    kernelRowSums.setArg(3, width);
+    kernelRowSums.setArg(4, height);
+
+    EnqueueKernel(kernelRowSums, { (size_t)height }, TunedLocalSize("box_row_sums"), "Box row sums");
+
+    return rowSums;
+}
+
+cl::Buffer EnqueueBoxColumnStats(const cl::Buffer& rowSums, int width, int height, int windowSize, int pairs)
+{
+    int halfWindowSize = (windowSize - 1) / 2;
+    cl::Buffer stats(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, sizeof(cl_float2) * (width * height) * pairs);
+    cl::Kernel kernelStats(cl_info_obj.program, "box_stats");
+
+    // set arguments
+    kernelStats.setArg(0, halfWindowSize);
+    kernelStats.setArg(1, rowSums);
+    kernelStats.setArg(2, stats);
+    kernelStats.setArg(3, width);
+    kernelStats.setArg(4, height);
+
+    EnqueueKernel(kernelStats, { (size_t)width, (size_t)pairs }, TunedLocalSize("box_stats"), "Box statistics");
+
+    return stats;
+}
+
+cl::Buffer EnqueueBoxStats(const cl::Buffer& image, int width, int height, int windowSize, int pairs)
+{
+    return EnqueueBoxColumnStats(EnqueueBoxRowSums(image, width, height, windowSize, pairs), width, height, windowSize, pairs);
+}
+
+std::vector<roi> LaunchRegions(const std::vector<roi>& regions, int width, int height)
+{
+    if (regions.empty()) return { { 0, 0, width, height } };
+
+    std::vector<roi> launches;
+    for (const roi& region : regions)
+    {
+        roi clipped = GrowRegion(region, 0, width, height);
+        if (clipped.width > 0 && clipped.height > 0) launches.push_back(clipped);
+    }
+    return launches;
+}
+
+// Images with fewer pixels than this per compute unit cannot keep the device busy with one work-item per pixel,
+// so their disparities are spread over the work-items of a group instead
+const size_t minPixelsPerComputeUnit = 2048;
+
+// Largest power of two that is not bigger than value
+size_t FloorPowerOfTwo(size_t value)
+{
+    size_t power = 1;
+    while (power * 2 <= value)
+    {
+        power *= 2;
+    }
+    return power;
+}
+
+// Returns true if one work-item per pixel cannot keep every compute unit of the device busy
+bool IsDeviceUnderfilled(int width, int height)
+{
+    size_t computeUnits = cl_info_obj.device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    return static_cast<size_t>(width) * height < computeUnits * minPixelsPerComputeUnit;
+}
+
+// Largest work-group size calc_zncc_disparity_parallel can use or 0 if the 2D calc_zncc kernel should be used
+size_t DisparityParallelGroupSize(const cl::Kernel& kernel, int maxDisparity)
+{
+    // the group is one-dimensional along the disparity axis, so it is limited by the third work item size as well
+    size_t groupSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(cl_info_obj.device);
+    std::vector<size_t> workItemSizes = cl_info_obj.device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    if (workItemSizes.size() > 2 && workItemSizes[2] < groupSize)
+    {
+        groupSize = workItemSizes[2];
+    }
+    if (static_cast<size_t>(maxDisparity) < groupSize)
+    {
+        groupSize = maxDisparity;
+    }
+
+    // the tree reduction halves the group on every step
+    groupSize = FloorPowerOfTwo(groupSize);
+    return groupSize > 1 ? groupSize : 0;
+}
+
+cl::Buffer EnqueueZNCC(const cl::Buffer leftImage,
+    const cl::Buffer rightImage,
+    const cl::Buffer leftStats,
+    const cl::Buffer rightStats,
+    int width, int height,
+    int windowSize, int maxDisparity,
+    char isLeftImage, int pairs,
+    const std::vector<roi>& regions, int minDisparity)
+{
+    std::vector<roi> launches = LaunchRegions(regions, width, height);
+    size_t pixels = 0;
+    for (const roi& launch : launches)
+    {
+        pixels += static_cast<size_t>(launch.width) * launch.height;
+    }
+
+    // create buffer with read/write access so that it can be reused
+    cl::Buffer disparityMap(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(unsigned int) * (width * height) * pairs);
+
+    // the autotuner's choice is used if there is one
+    std::string kernelName = cl_info_obj.znccKernel;
+    if (kernelName.empty())
+    {
+        // small images get the disparity-parallel kernel, so that the device is saturated
+        // otherwise devices with wide SIMD lanes evaluate several disparities per work-item
+        if (IsDeviceUnderfilled(static_cast<int>(pixels), pairs) &&
+            DisparityParallelGroupSize(cl::Kernel(cl_info_obj.program, "calc_zncc_disparity_parallel"), maxDisparity - minDisparity))
+        {
+            kernelName = "calc_zncc_disparity_parallel";
+        }
+        else
+        {
+            kernelName = cl_info_obj.znccVecWidth > 1 ? "calc_zncc_vec" : "calc_zncc";
+        }
+    }
+    cl::Kernel kernelZNCC(cl_info_obj.program, kernelName.c_str());
+
+    // window is halved, so that pixel is in centre of window
+    int halfWindowSize = (windowSize - 1) / 2;
+
+    // set arguments
+    kernelZNCC.setArg(0, halfWindowSize);
+    kernelZNCC.setArg(1, isLeftImage);
+    kernelZNCC.setArg(2, leftImage);
+    kernelZNCC.setArg(3, rightImage);
+    kernelZNCC.setArg(4, leftStats);
+    kernelZNCC.setArg(5, rightStats);
+    kernelZNCC.setArg(6, disparityMap);
+    kernelZNCC.setArg(7, maxDisparity);
+    kernelZNCC.setArg(8, minDisparity);
+    kernelZNCC.setArg(9, width);
+    kernelZNCC.setArg(10, height);
+
+    // queue the zncc kernel
+    if (kernelName == "calc_zncc_disparity_parallel")
+    {
+        std::vector<size_t> localSize = TunedLocalSize(kernelName);
+        if (localSize.size() != 3)
+        {
+            localSize = { 1, 1, DisparityParallelGroupSize(kernelZNCC, maxDisparity - minDisparity) };
+        }
+
+        // local memory for the (score, disparity) reduction
+        kernelZNCC.setArg(11, localSize[2] * sizeof(float), NULL);
+        kernelZNCC.setArg(12, localSize[2] * sizeof(int), NULL);
+
+        if (cl_info_obj.printProfiling)
+        {
+            std::cout << "Using disparity-parallel ZNCC with work group size " << localSize[2] << std::endl;
+        }
+        // the disparities take the third dimension, so the pairs are stacked along the second one
+        for (const roi& launch : launches)
+        {
+            EnqueueKernel(kernelZNCC, { (size_t)launch.width, (size_t)launch.height * pairs, localSize[2] }, localSize, "ZNCC",
+                { (size_t)launch.x, (size_t)launch.y, 0 });
+        }
+    }
+    else
+    {
+        for (const roi& launch : launches)
+        {
+            EnqueueKernel(kernelZNCC, { (size_t)launch.width, (size_t)launch.height, (size_t)pairs }, TunedLocalSize(kernelName), "ZNCC",
+                { (size_t)launch.x, (size_t)launch.y, 0 });
+        }
+    }
+
+    return disparityMap;
+}
+
+cl_ulong FullEvaluations(int width, int height, int windowSize, int maxDisparity)
+{
+    int halfWindowSize = (windowSize - 1) / 2;
+    cl_ulong interiorWidth = std::max(0, width - 2 * halfWindowSize - 1);
+    cl_ulong interiorHeight = std::max(0, height - 2 * halfWindowSize - 1);
+    return interiorWidth * interiorHeight * maxDisparity;
+}
+
+cl::Buffer EnqueueZNCCTemporal(const cl::Buffer leftImage,
+    const cl::Buffer rightImage,
+    const cl::Buffer leftStats,
+    const cl::Buffer rightStats,
+    int width, int height,
+    int windowSize, int maxDisparity,
+    char isLeftImage, temporal_state& state, int minDisparity)
+{
+    cl::Buffer disparityMap(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(unsigned int) * (width * height));
+    cl_uint evaluations = 0;
+    cl::Buffer evaluationCount(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), &evaluations);
+    cl::Kernel kernelZNCC(cl_info_obj.program, "calc_zncc_temporal");
+
+    // set arguments
+    kernelZNCC.setArg(0, (windowSize - 1) / 2);
+    kernelZNCC.setArg(1, isLeftImage);
+    kernelZNCC.setArg(2, leftImage);
+    kernelZNCC.setArg(3, rightImage);
+    kernelZNCC.setArg(4, leftStats);
+    kernelZNCC.setArg(5, rightStats);
+    kernelZNCC.setArg(6, disparityMap);
+    kernelZNCC.setArg(7, maxDisparity);
+    kernelZNCC.setArg(8, minDisparity);
+    kernelZNCC.setArg(9, width);
+    kernelZNCC.setArg(10, height);
+    kernelZNCC.setArg(11, state.prior);
+    kernelZNCC.setArg(12, state.searchRadius);
+    kernelZNCC.setArg(13, state.minScore);
+    kernelZNCC.setArg(14, evaluationCount);
+
+    // queue the zncc kernel
+    EnqueueKernel(kernelZNCC, { (size_t)width, (size_t)height }, TunedLocalSize("calc_zncc_temporal"), "ZNCC (temporal)");
+
+    cl_info_obj.queue.enqueueReadBuffer(evaluationCount, CL_TRUE, 0, sizeof(cl_uint), &evaluations);
+    state.evaluations += evaluations;
+    return disparityMap;
+}
+
+std::vector<cl_uint> EnqueueTileChanges(const cl::Buffer& currentImage, const cl::Buffer& previousImage, int width, int height, int tileSize)
+{
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<cl_uint> tileDiffs(static_cast<size_t>(tilesX) * tilesY);
+    cl::Buffer diffBuffer(cl_info_obj.context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(cl_uint) * tileDiffs.size());
+    cl::Kernel kernelChanges(cl_info_obj.program, "tile_changes");
+
+    kernelChanges.setArg(0, tileSize);
+    kernelChanges.setArg(1, currentImage);
+    kernelChanges.setArg(2, previousImage);
+    kernelChanges.setArg(3, diffBuffer);
+    kernelChanges.setArg(4, width);
+    kernelChanges.setArg(5, height);
+    EnqueueKernel(kernelChanges, { (size_t)tilesX, (size_t)tilesY }, TunedLocalSize("tile_changes"), "Tile changes");
+
+    cl::Event readEvent;
+    auto hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.queue.enqueueReadBuffer(diffBuffer, CL_TRUE, 0, sizeof(cl_uint) * tileDiffs.size(), tileDiffs.data(), NULL, &readEvent);
+    TraceCommand(readEvent, "Read tile changes", hostQueued);
+    return tileDiffs;
+}
+
+void EnqueueCopyRegion(const cl::Buffer& source, const cl::Buffer& destination, const roi& region, int width, size_t elementSize, const char* label)
+{
+    cl::size_t<3> origin, rectRegion;
+    origin[0] = region.x * elementSize; origin[1] = region.y; origin[2] = 0;
+    rectRegion[0] = region.width * elementSize; rectRegion[1] = region.height; rectRegion[2] = 1;
+
+    cl::Event copyEvent;
+    auto hostQueued = std::chrono::steady_clock::now();
+    cl_info_obj.queue.enqueueCopyBufferRect(source, destination, origin, origin, rectRegion,
+        width * elementSize, 0, width * elementSize, 0, NULL, &copyEvent);
+    TraceCommand(copyEvent, label, hostQueued);
+}
+
+std::vector<point_disparity> EnqueueZNCCPoints(const cl::Buffer leftImage,
+    const cl::Buffer rightImage,
+    const cl::Buffer leftStats,
+    const cl::Buffer rightStats,
+    const std::vector<keypoint>& points,
+    int width, int height,
+    int windowSize, int maxDisparity, int minDisparity)
+{
+    std::vector<point_disparity> results(points.size(), { 0, -100.0f });
+    if (points.empty()) return results;
+
+    // keypoint has the layout of an int2
+    cl_int pointCount = static_cast<cl_int>(points.size());
+    cl::Buffer pointBuffer(cl_info_obj.context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+        sizeof(keypoint) * points.size(), const_cast<keypoint*>(points.data()));
+    cl::Buffer disparities(cl_info_obj.context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(int) * points.size());
+    cl::Buffer scores(cl_info_obj.context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(float) * points.size());
+    cl::Kernel kernelPoints(cl_info_obj.program, "calc_zncc_points");
+
+    // set arguments
+    kernelPoints.setArg(0, (windowSize - 1) / 2);
+    kernelPoints.setArg(1, (char)1);
+    kernelPoints.setArg(2, leftImage);
+    kernelPoints.setArg(3, rightImage);
+    kernelPoints.setArg(4, leftStats);
+    kernelPoints.setArg(5, rightStats);
+    kernelPoints.setArg(6, pointBuffer);
+    kernelPoints.setArg(7, disparities);
+    kernelPoints.setArg(8, scores);
+    kernelPoints.setArg(9, pointCount);
+    kernelPoints.setArg(10, maxDisparity);
+    kernelPoints.setArg(11, minDisparity);
+    kernelPoints.setArg(12, width);
+    kernelPoints.setArg(13, height);
+
+    // queue the kernel with one work-item per point
+    EnqueueKernel(kernelPoints, { points.size() }, TunedLocalSize("calc_zncc_points"), "Keypoint ZNCC");
+
+    std::vector<int> pointDisparities(points.size());
+    std::vector<float> pointScores(points.size());
+    cl_info_obj.queue.enqueueReadBuffer(disparities, CL_TRUE, 0, sizeof(int) * points.size(), pointDisparities.data());
+    cl_info_obj.queue.enqueueReadBuffer(scores, CL_TRUE, 0, sizeof(float) * points.size(), pointScores.data());
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        results[i] = { pointDisparities[i], pointScores[i] };
+    }
+    return results;
+}
+
+cl::Buffer EnqueueCrossCheck(const cl::Buffer dispMapLeft,
+    const cl::Buffer dispMapRight,
+    const int width, const int height, 
+    const int crossDiff, const int pairs,
+    const std::vector<roi>& regions)
+{
+    // create buffer with read/write access so that it can be reused
+    cl::Buffer crossCheckedImage(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(unsigned int) * (width * height) * pairs);
+    cl::Kernel kernelCrossCheck(cl_info_obj.program, "cross_check");
+
+    // set arguments
+    kernelCrossCheck.setArg(0, crossDiff);
+    kernelCrossCheck.setArg(1, dispMapLeft);
+    kernelCrossCheck.setArg(2, dispMapRight);
+    kernelCrossCheck.setArg(3, crossCheckedImage);
+    kernelCrossCheck.setArg(4, width);
+    kernelCrossCheck.setArg(5, height);
+
+    // queue the cross check kernel
+    for (const roi& launch : LaunchRegions(regions, width, height))
+    {
+        EnqueueKernel(kernelCrossCheck, { (size_t)launch.width, (size_t)launch.height, (size_t)pairs }, TunedLocalSize("cross_check"), "Cross-checking",
+            { (size_t)launch.x, (size_t)launch.y, 0 });
+    }
+
+    return crossCheckedImage;
+}
+
+// Local size occlusion_filling is enqueued with if it has not been tuned | the kernel needs an explicit one
+std::vector<size_t> OcclusionFillingLocalSize(const cl::Kernel& kernel)
+{
+    size_t maxGroupSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(cl_info_obj.device);
+    std::vector<size_t> workItemSizes = cl_info_obj.device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    std::vector<size_t> localSize = { std::min<size_t>(16, workItemSizes[0]), std::min<size_t>(16, workItemSizes[1]) };
+    while (localSize[0] * localSize[1] > maxGroupSize)
+    {
+        localSize[localSize[1] >= localSize[0] ? 1 : 0] /= 2;
+    }
+    return localSize;
+}
+
+cl::Buffer EnqueueOcclusionFilling(const cl::Buffer crossCheckedImage, 
+    const int width, const int height, const int nCount, const int pairs,
+    const std::vector<roi>& regions)
+{
+    // the filled image is written to a new buffer, so that every pixel reads the unfilled neighbours
+    // the host reads it back when only regions are computed
+    cl::Buffer filledImage(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(int) * (width * height) * pairs);
+    cl::Kernel kernelFilling(cl_info_obj.program, "occlusion_filling");
+
+    std::vector<size_t> localSize = TunedLocalSize("occlusion_filling");
+    if (localSize.size() != 2)
+    {
+        localSize = OcclusionFillingLocalSize(kernelFilling);
+    }
+
+    // the work-group's tile and a halo of nCount / 2 pixels on every side
+    size_t halo = 2 * static_cast<size_t>(nCount / 2);
+    size_t tileSize = sizeof(int) * (localSize[0] + halo) * (localSize[1] + halo);
+    if (tileSize > cl_info_obj.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+    {
+        std::cout << "Warning: occlusion filling tile of " << tileSize << " bytes does not fit in local memory. Choose smaller nCount." << std::endl;
+    }
+
+    // set arguments
+    kernelFilling.setArg(0, nCount);
+    kernelFilling.setArg(1, crossCheckedImage);
+    kernelFilling.setArg(2, filledImage);
+    kernelFilling.setArg(3, width);
+    kernelFilling.setArg(4, height);
+    kernelFilling.setArg(5, tileSize, NULL);
+
+    // queue the occlusion filling kernel
+    for (const roi& launch : LaunchRegions(regions, width, height))
+    {
+        EnqueueKernel(kernelFilling, { (size_t)launch.width, (size_t)launch.height, (size_t)pairs }, localSize, "Occlusion filling",
+            { (size_t)launch.x, (size_t)launch.y, 0 });
+    }
+
+    return filledImage;
+}
+
+cl::Buffer EnqueueSubpixelRefinement(const cl::Buffer leftImage,
+    const cl::Buffer rightImage,
+    const cl::Buffer leftStats,
+    const cl::Buffer rightStats,
+    const cl::Buffer crossCheckedImage,
+    const cl::Buffer filledImage,
+    const int width, const int height,
+    const int windowSize, const int maxDisparity,
+    const bool equiangular, const int pairs)
+{
+    cl::Buffer refinedImage(cl_info_obj.context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, sizeof(float) * (width * height) * pairs);
+    cl::Kernel kernelRefine(cl_info_obj.program, "subpixel_refine");
+
+    // set arguments
+    kernelRefine.setArg(0, (windowSize - 1) / 2);
+    kernelRefine.setArg(1, (char)equiangular);
+    kernelRefine.setArg(2, leftImage);
+    kernelRefine.setArg(3, rightImage);
+    kernelRefine.setArg(4, leftStats);
+    kernelRefine.setArg(5, rightStats);
+    kernelRefine.setArg(6, crossCheckedImage);
+    kernelRefine.setArg(7, filledImage);
+    kernelRefine.setArg(8, refinedImage);
+    kernelRefine.setArg(9, maxDisparity);
+    kernelRefine.setArg(10, width);
+    kernelRefine.setArg(11, height);
+
+    // queue the refinement kernel
+    EnqueueKernel(kernelRefine, { (size_t)width, (size_t)height, (size_t)pairs }, TunedLocalSize("subpixel_refine"), "Sub-pixel refinement");
+
+    return refinedImage;
+}
+
+cl::Buffer EnqueueNormalizeToChar(const cl::Buffer filledImage, 
+    const int width, int height, const int ndisp, const int pairs, const bool refined)
+{
+    height *= pairs;
+    // buffer with write only permission as it will not be reused in the future anymore
+    // allocated in host memory, so the result can be mapped instead of read into another vector
+    cl::Buffer normImage(cl_info_obj.context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, sizeof(unsigned char) * (width * height));
+    const char* kernelName = refined ? "normalize_float_to_char" : "normalize_to_char";
+    cl::Kernel kernelNorm(cl_info_obj.program, kernelName);
+
+    // set arguments
+    kernelNorm.setArg(0, ndisp);
+    kernelNorm.setArg(1, filledImage);
+    kernelNorm.setArg(2, normImage);
+    kernelNorm.setArg(3, width * height);
+
+    // queue the normalization kernel
+    EnqueueKernel(kernelNorm, { (size_t)(width * height) }, TunedLocalSize(kernelName), "Image normalization");
+
+    return normImage;
+}
+
+json_value JsonNumber(double number)
+{
+    json_value value;
+    value.type = json_value::number_type;
+    value.number = number;
+    return value;
+}
+
+json_value JsonString(const std::string& string)
+{
+    json_value value;
+    value.type = json_value::string_type;
+    value.string = string;
+    return value;
+}
+
+void SkipJsonWhitespace(const std::string& text, size_t& pos)
+{
+    while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) pos++;
+}
+
+// Parse the JSON value starting at pos | throws std::runtime_error on malformed input
+json_value ParseJson(const std::string& text, size_t& pos)
+{
+    json_value value;
+    SkipJsonWhitespace(text, pos);
+    if (pos >= text.size()) throw std::runtime_error("unexpected end of JSON");
+
+    if (text[pos] == '{' || text[pos] == '[')
+    {
+        bool isObject = text[pos] == '{';
+        char close = isObject ? '}' : ']';
+        value.type = isObject ? json_value::object_type : json_value::array_type;
+        pos++;
+        SkipJsonWhitespace(text, pos);
+        while (pos < text.size() && text[pos] != close)
+        {
+            if (isObject)
+            {
+                json_value key = ParseJson(text, pos);
+                SkipJsonWhitespace(text, pos);
+                if (key.type != json_value::string_type || pos >= text.size() || text[pos] != ':') throw std::runtime_error("expected JSON key");
+                pos++;
+                value.keys.push_back(key.string);
+            }
+            value.items.push_back(ParseJson(text, pos));
+            SkipJsonWhitespace(text, pos);
+            if (pos < text.size() && text[pos] == ',')
+            {
+                pos++;
+                SkipJsonWhitespace(text, pos);
+            }
+        }
+        if (pos >= text.size()) throw std::runtime_error("unterminated JSON container");
+        pos++;
+    }
+    else if (text[pos] == '"')
+    {
+        value.type = json_value::string_type;
+        pos++;
+        while (pos < text.size() && text[pos] != '"')
+        {
+            if (text[pos] == '\\' && pos + 1 < text.size()) pos++;
+            value.string += text[pos++];
+        }
+        if (pos >= text.size()) throw std::runtime_error("unterminated JSON string");
+        pos++;
+    }
+    else
+    {
+        size_t end = pos;
+        while (end < text.size() && (isalnum(static_cast<unsigned char>(text[end])) || text[end] == '-' || text[end] == '+' || text[end] == '.')) end++;
+        std::string token = text.substr(pos, end - pos);
+        pos = end;
+        if (token != "null")
+        {
+            value.type = json_value::number_type;
+            value.number = std::stod(token);
+        }
+    }
+    return value;
+}
+
+void WriteJson(std::ostream& out, const json_value& value, int indent)
+{
+    std::string padding(indent + 4, ' ');
+    switch (value.type)
+    {
+    case json_value::number_type:
+        out << value.number;
+        break;
+    case json_value::string_type:
+        out << '"';
+        for (char c : value.string)
+        {
+            if (c == '"' || c == '\\') out << '\\';
+            out << c;
+        }
+        out << '"';
+        break;
+    case json_value::array_type:
+        // arrays are kept on one line, so local sizes and trace events stay compact
+        out << "[";
+        for (size_t i = 0; i < value.items.size(); i++)
+        {
+            if (i) out << ", ";
+            WriteJson(out, value.items[i], indent);
+        }
+        out << "]";
+        break;
+    case json_value::object_type:
+        out << "{\n";
+        for (size_t i = 0; i < value.items.size(); i++)
+        {
+            out << padding;
+            WriteJson(out, JsonString(value.keys[i]));
+            out << ": ";
+            WriteJson(out, value.items[i], indent + 4);
+            out << (i + 1 < value.items.size() ? ",\n" : "\n");
+        }
+        out << std::string(indent, ' ') << "}";
+        break;
+    default:
+        out << "null";
+    }
+}
+
+bool WriteTrace(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(traceRecorder.mutex);
+    std::vector<std::string> tracks;
+    json_value traceEvents;
+    traceEvents.type = json_value::array_type;
+    for (const trace_event& event : traceRecorder.events)
+    {
+        size_t tid = std::find(tracks.begin(), tracks.end(), event.track) - tracks.begin();
+        if (tid == tracks.size())
+        {
+            tracks.push_back(event.track);
+
+            json_value threadName;
+            threadName.Set("name", JsonString("thread_name"));
+            threadName.Set("ph", JsonString("M"));
+            threadName.Set("pid", JsonNumber(1));
+            threadName.Set("tid", JsonNumber(static_cast<double>(tid)));
+            json_value metadata;
+            metadata.Set("name", JsonString(event.track));
+            threadName.Set("args", metadata);
+            traceEvents.items.push_back(threadName);
+        }
+
+        json_value complete;
+        complete.Set("name", JsonString(event.name));
+        complete.Set("ph", JsonString("X"));
+        complete.Set("pid", JsonNumber(1));
+        complete.Set("tid", JsonNumber(static_cast<double>(tid)));
+        complete.Set("ts", JsonNumber(event.start));
+        complete.Set("dur", JsonNumber(event.duration));
+        json_value args;
+        args.type = json_value::object_type;
+        for (const auto& arg : event.args)
+        {
+            args.Set(arg.first, JsonNumber(arg.second));
+        }
+        complete.Set("args", args);
+        traceEvents.items.push_back(complete);
+    }
+
+    json_value trace;
+    trace.Set("traceEvents", traceEvents);
+    trace.Set("displayTimeUnit", JsonString("ms"));
+
+    std::ofstream file(path);
+    if (!file) return false;
+    file.precision(15);
+    WriteJson(file, trace);
+    file << std::endl;
+    return true;
+}
+
+bool WriteTraceSummary(const std::string& path, double wallTime)
+{
+    std::lock_guard<std::mutex> lock(traceRecorder.mutex);
+    std::vector<std::pair<std::string, std::string>> stageKeys;
+    std::vector<std::vector<double>> durations;
+    for (const trace_event& event : traceRecorder.events)
+    {
+        std::pair<std::string, std::string> key(event.track, event.name);
+        size_t index = std::find(stageKeys.begin(), stageKeys.end(), key) - stageKeys.begin();
+        if (index == stageKeys.size())
+        {
+            stageKeys.push_back(key);
+            durations.emplace_back();
+        }
+        durations[index].push_back(event.duration);
+    }
+
+    json_value stages;
+    stages.type = json_value::array_type;
+    for (size_t i = 0; i < stageKeys.size(); i++)
+    {
+        double total = 0;
+        for (double duration : durations[i]) total += duration;
+
+        json_value stage;
+        stage.Set("track", JsonString(stageKeys[i].first));
+        stage.Set("name", JsonString(stageKeys[i].second));
+        stage.Set("count", JsonNumber(static_cast<double>(durations[i].size())));
+        stage.Set("total_us", JsonNumber(total));
+        stage.Set("mean_us", JsonNumber(total / durations[i].size()));
+        stage.Set("min_us", JsonNumber(*std::min_element(durations[i].begin(), durations[i].end())));
+        stage.Set("max_us", JsonNumber(*std::max_element(durations[i].begin(), durations[i].end())));
+        stages.items.push_back(stage);
+    }
+
+    json_value summary;
+    summary.Set("wall_time_us", JsonNumber(wallTime));
+    summary.Set("stages", stages);
+
+    std::ofstream file(path);
+    if (!file) return false;
+    file.precision(15);
+    WriteJson(file, summary);
+    file << std::endl;
+    return true;
+}
+
+// Tuning results are stored per device in ../tuning/<device name>.json, with one entry per resized image resolution
+std::string TuningCachePath(const cl::Device& device)
+{
+    std::string name = device.getInfo<CL_DEVICE_NAME>();
+    std::string fileName;
+    for (char c : name)
+    {
+        if (isalnum(static_cast<unsigned char>(c))) fileName += c;
+        else if (!fileName.empty() && fileName.back() != '_') fileName += '_';
+    }
+    return "../tuning/" + fileName + ".json";
+}
+
+json_value ReadTuningCache(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        return json_value();
+    }
+
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    size_t pos = 0;
+    try
+    {
+        return ParseJson(text, pos);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "Warning: ignoring malformed tuning cache " << path << ": " << e.what() << std::endl;
+        return json_value();
+    }
+}
+
+// Load the tuned settings of the device for a resized resolution into cl_info_obj | returns false if there are none
+bool LoadTuning(const cl::Device& device, unsigned int width, unsigned int height)
+{
+    json_value cache = ReadTuningCache(TuningCachePath(device));
+    const json_value* entries = cache.Find("entries");
+    const json_value* entry = entries ? entries->Find(std::to_string(width) + "x" + std::to_string(height)) : nullptr;
+    if (!entry)
+    {
+        return false;
+    }
+
+    const json_value* znccKernel = entry->Find("zncc_kernel");
+    const json_value* znccVecWidth = entry->Find("zncc_vec_width");
+    const json_value* localSizes = entry->Find("local_sizes");
+    if (znccKernel) cl_info_obj.znccKernel = znccKernel->string;
+    if (znccVecWidth) cl_info_obj.znccVecWidth = static_cast<int>(znccVecWidth->number);
+    if (localSizes)
+    {
+        for (size_t i = 0; i < localSizes->keys.size(); i++)
+        {
+            std::vector<size_t> localSize;
+            for (const json_value& size : localSizes->items[i].items)
+            {
+                localSize.push_back(static_cast<size_t>(size.number));
+            }
+            cl_info_obj.localSizes[localSizes->keys[i]] = localSize;
+        }
+    }
+    return true;
+}
+
+void SaveTuning(const cl::Device& device, unsigned int width, unsigned int height)
+{
+    std::string path = TuningCachePath(device);
+    json_value cache = ReadTuningCache(path);
+    json_value entries = cache.Find("entries") ? *cache.Find("entries") : json_value();
+    entries.type = json_value::object_type;
+
+    json_value localSizes;
+    localSizes.type = json_value::object_type;
+    for (const auto& kernelLocalSize : cl_info_obj.localSizes)
+    {
+        json_value sizes;
+        sizes.type = json_value::array_type;
+        for (size_t size : kernelLocalSize.second)
+        {
+            sizes.items.push_back(JsonNumber(static_cast<double>(size)));
+        }
+        localSizes.Set(kernelLocalSize.first, sizes);
+    }
+
+    json_value entry;
+    entry.Set("zncc_kernel", JsonString(cl_info_obj.znccKernel));
+    entry.Set("zncc_vec_width", JsonNumber(cl_info_obj.znccVecWidth));
+    entry.Set("local_sizes", localSizes);
+    entries.Set(std::to_string(width) + "x" + std::to_string(height), entry);
+
+    cache.Set("device", JsonString(device.getInfo<CL_DEVICE_NAME>()));
+    cache.Set("entries", entries);
+
+    std::ofstream file(path);
+    if (!file)
+    {
+        std::cout << "Warning: could not write tuning cache " << path << std::endl;
+        return;
+    }
+    WriteJson(file, cache);
+    file << std::endl;
+    std::cout << "Tuning results saved to " << path << std::endl;
+}
+
+// Number of times every candidate is run while autotuning | the fastest run is used
+const int tuningRepetitions = 3;
+
+// Candidate local sizes with the given number of dimensions that the kernel can be enqueued with
+// an empty candidate stands for cl::NullRange, so the runtime's own choice competes as well
+std::vector<std::vector<size_t>> LocalSizeCandidates(const cl::Kernel& kernel, int dimensions)
+{
+    size_t maxGroupSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(cl_info_obj.device);
+    std::vector<size_t> workItemSizes = cl_info_obj.device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+    std::vector<std::vector<size_t>> candidates(1);
+    const size_t xSizes[] = { 4, 8, 16, 32, 64, 128, 256, 512, 1024 };
+    const size_t ySizes[] = { 1, 2, 4, 8, 16, 32 };
+    for (size_t x : xSizes)
+    {
+        if (x > maxGroupSize || x > workItemSizes[0]) continue;
+        if (dimensions == 1)
+        {
+            candidates.push_back({ x });
+            continue;
+        }
+        for (size_t y : ySizes)
+        {
+            if (x * y > maxGroupSize || y > workItemSizes[1]) continue;
+            candidates.push_back({ x, y });
+        }
+    }
+    return candidates;
+}
+
+// Time run() with every candidate local size of kernelName and keep the fastest one in cl_info_obj.localSizes
+// returns the time of the fastest candidate in nanoseconds
+template<typename Run>
+double TuneLocalSize(const std::string& kernelName, const std::vector<std::vector<size_t>>& candidates, Run run)
+{
+    double bestTime = -1;
+    std::vector<size_t> bestLocalSize;
+    for (const std::vector<size_t>& candidate : candidates)
+    {
+        cl_info_obj.localSizes[kernelName] = candidate;
+        double candidateTime = -1;
+        try
+        {
+            for (int i = 0; i < tuningRepetitions; i++)
+            {
+                run();
+                if (candidateTime < 0 || cl_info_obj.lastRunTime < candidateTime) candidateTime = cl_info_obj.lastRunTime;
+            }
+        }
+        catch (cl::Error&)
+        {
+            // the device rejected this local size (e.g. not enough registers or local memory) | try the next one
+            continue;
+        }
+
+        if (bestTime < 0 || candidateTime < bestTime)
+        {
+            bestTime = candidateTime;
+            bestLocalSize = candidate;
+        }
+    }
+
+    cl_info_obj.localSizes[kernelName] = bestLocalSize;
+    if (bestLocalSize.empty())
+    {
+        // NullRange won, so the kernel keeps being enqueued with the runtime's choice
+        cl_info_obj.localSizes.erase(kernelName);
+    }
+
+    std::cout << "Best local size for " << kernelName << ": ";
+    for (size_t i = 0; i < bestLocalSize.size(); i++) std::cout << (i ? " x " : "") << bestLocalSize[i];
+    std::cout << (bestLocalSize.empty() ? "runtime default" : "") << " (" << bestTime / 1e3 << " microseconds)" << std::endl;
+    return bestTime;
+}
+
+void AutotuneKernels(const cl::Context& context, const std::string& src,
+    const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, int resizeFactor,
+    int winSize, int ndisp, int neighbours, int crossDiff)
+{
+    std::cout << "------------AUTOTUNING------------" << std::endl;
+    host_stage stage("Autotune");
+    cl_info_obj.printProfiling = false;
+    cl_info_obj.recordTrace = false;
+    cl_info_obj.localSizes.clear();
+
+    int newWidth = width / resizeFactor;
+    int newHeight = height / resizeFactor;
+
+    cl::Buffer resizedLeft, resizedRight;
+    TuneLocalSize("grayscale_resize", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "grayscale_resize"), 2), [&]() {
+        resizedLeft = EnqueueGrayScaleResize(leftImage, width, height, resizeFactor);
+    });
+    resizedRight = EnqueueGrayScaleResize(rightImage, width, height, resizeFactor);
+
+    // box statistics | both kernels are one-dimensional
+    cl::Buffer rowSums, statsLeft, statsRight;
+    TuneLocalSize("box_row_sums", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "box_row_sums"), 1), [&]() {
+        rowSums = EnqueueBoxRowSums(resizedLeft, newWidth, newHeight, winSize);
+    });
+    TuneLocalSize("box_stats", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "box_stats"), 1), [&]() {
+        statsLeft = EnqueueBoxColumnStats(rowSums, newWidth, newHeight, winSize);
+    });
+    statsRight = EnqueueBoxStats(resizedRight, newWidth, newHeight, winSize);
+
+    // ZNCC variants | the scalar kernel and every vector width need their own program build
+    // all vector widths share the calc_zncc_vec entry, so the local size of the winning width is kept aside
+    double bestTime = -1;
+    std::string bestKernel;
+    int bestVecWidth = 1;
+    std::vector<size_t> bestVecLocalSize = TunedLocalSize("calc_zncc_vec");
+    const int vecWidths[] = { 1, 4, 8, 16 };
+    for (int vecWidth : vecWidths)
+    {
+        cl_info_obj.program = BuildProgram(context, src, vecWidth);
+        cl_info_obj.znccVecWidth = vecWidth;
+        cl_info_obj.znccKernel = vecWidth > 1 ? "calc_zncc_vec" : "calc_zncc";
+
+        double time = TuneLocalSize(cl_info_obj.znccKernel, LocalSizeCandidates(cl::Kernel(cl_info_obj.program, cl_info_obj.znccKernel.c_str()), 2), [&]() {
+            EnqueueZNCC(resizedLeft, resizedRight, statsLeft, statsRight, newWidth, newHeight, winSize, ndisp);
+        });
+        if (time >= 0 && (bestTime < 0 || time < bestTime))
+        {
+            bestTime = time;
+            bestKernel = cl_info_obj.znccKernel;
+            bestVecWidth = vecWidth;
+            if (vecWidth > 1) bestVecLocalSize = TunedLocalSize("calc_zncc_vec");
+        }
+    }
+
+    // an empty local size is the runtime's choice, which is stored as no entry
+    if (bestVecLocalSize.empty())
+    {
+        cl_info_obj.localSizes.erase("calc_zncc_vec");
+    }
+    else
+    {
+        cl_info_obj.localSizes["calc_zncc_vec"] = bestVecLocalSize;
+    }
+
+    // disparity-parallel kernel with every power of two group size it supports
+    cl_info_obj.znccKernel = "calc_zncc_disparity_parallel";
+    std::vector<std::vector<size_t>> groupCandidates;
+    size_t maxGroupSize = DisparityParallelGroupSize(cl::Kernel(cl_info_obj.program, "calc_zncc_disparity_parallel"), ndisp);
+    for (size_t groupSize = 2; groupSize <= maxGroupSize; groupSize *= 2)
+    {
+        groupCandidates.push_back({ 1, 1, groupSize });
+    }
+    if (!groupCandidates.empty())
+    {
+        double time = TuneLocalSize(cl_info_obj.znccKernel, groupCandidates, [&]() {
+            EnqueueZNCC(resizedLeft, resizedRight, statsLeft, statsRight, newWidth, newHeight, winSize, ndisp);
+        });
+        if (time >= 0 && (bestTime < 0 || time < bestTime))
+        {
+            bestTime = time;
+            bestKernel = cl_info_obj.znccKernel;
+        }
+    }
+
+    // the vector width only matters for calc_zncc_vec, so the other kernels are built without it
+    cl_info_obj.znccKernel = bestKernel;
+    cl_info_obj.znccVecWidth = bestKernel == "calc_zncc_vec" ? bestVecWidth : 1;
+    cl_info_obj.program = BuildProgram(context, src, cl_info_obj.znccVecWidth);
+    std::cout << "Best ZNCC kernel: " << bestKernel << (bestKernel == "calc_zncc_vec" ? " with vector width " + std::to_string(bestVecWidth) : "") << std::endl;
+
+    cl::Buffer znccLeft = EnqueueZNCC(resizedLeft, resizedRight, statsLeft, statsRight, newWidth, newHeight, winSize, ndisp);
+    cl::Buffer znccRight = EnqueueZNCC(resizedRight, resizedLeft, statsRight, statsLeft, newWidth, newHeight, winSize, ndisp, -1);
+
+    cl::Buffer crossChecked;
+    TuneLocalSize("cross_check", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "cross_check"), 2), [&]() {
+        crossChecked = EnqueueCrossCheck(znccLeft, znccRight, newWidth, newHeight, crossDiff);
+    });
+
+    // occlusion filling sizes its local tile from the local size, so the runtime's choice is not a candidate
+    cl::Buffer filled;
+    std::vector<std::vector<size_t>> fillingCandidates = LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "occlusion_filling"), 2);
+    fillingCandidates.erase(fillingCandidates.begin());
+    TuneLocalSize("occlusion_filling", fillingCandidates, [&]() {
+        filled = EnqueueOcclusionFilling(crossChecked, newWidth, newHeight, neighbours);
+    });
+
+    TuneLocalSize("normalize_to_char", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "normalize_to_char"), 1), [&]() {
+        EnqueueNormalizeToChar(filled, newWidth, newHeight, ndisp);
+    });
+
+    // kernels of the sub-pixel, video and keypoint modes
+    cl::Buffer refined;
+    TuneLocalSize("subpixel_refine", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "subpixel_refine"), 2), [&]() {
+        refined = EnqueueSubpixelRefinement(resizedLeft, resizedRight, statsLeft, statsRight, crossChecked, filled,
+            newWidth, newHeight, winSize, ndisp, false);
+    });
+    TuneLocalSize("normalize_float_to_char", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "normalize_float_to_char"), 1), [&]() {
+        EnqueueNormalizeToChar(refined, newWidth, newHeight, ndisp, 1, true);
+    });
+
+    // the cross-checked disparities of the pair stand in for the previous frame
+    temporal_state temporal;
+    temporal.prior = crossChecked;
+    temporal.hasPrior = true;
+    TuneLocalSize("calc_zncc_temporal", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "calc_zncc_temporal"), 2), [&]() {
+        EnqueueZNCCTemporal(resizedLeft, resizedRight, statsLeft, statsRight, newWidth, newHeight, winSize, ndisp, 1, temporal);
+    });
+
+    // the right image stands in for the previous frame of the left one
+    int tileSize = incremental_base().tileSize;
+    TuneLocalSize("tile_changes", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "tile_changes"), 2), [&]() {
+        EnqueueTileChanges(resizedLeft, resizedRight, newWidth, newHeight, tileSize);
+    });
+
+    // a keypoint every tuningPointStride pixels in both directions
+    const int tuningPointStride = 8;
+    std::vector<keypoint> points;
+    for (int y = 0; y < newHeight; y += tuningPointStride)
+    {
+        for (int x = 0; x < newWidth; x += tuningPointStride)
+        {
+            points.push_back({ x, y });
+        }
+    }
+    TuneLocalSize("calc_zncc_points", LocalSizeCandidates(cl::Kernel(cl_info_obj.program, "calc_zncc_points"), 1), [&]() {
+        EnqueueZNCCPoints(resizedLeft, resizedRight, statsLeft, statsRight, points, newWidth, newHeight, winSize, ndisp);
+    });
+
+    cl_info_obj.printProfiling = true;
+    cl_info_obj.recordTrace = true;
+}
+
+std::vector<cl::Device> SelectDevices(const std::string& selector)
+{
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+
+    std::vector<cl::Device> allDevices;
+    std::vector<std::string> platformNames;
+    std::cout << "Available OpenCL devices:" << std::endl;
+    for (const cl::Platform& platform : platforms)
+    {
+        std::vector<cl::Device> platformDevices;
+        try
+        {
+            platform.getDevices(CL_DEVICE_TYPE_ALL, &platformDevices);
+        }
+        catch (cl::Error&)
+        {
+            // platforms without devices report CL_DEVICE_NOT_FOUND
+            continue;
+        }
+        for (const cl::Device& device : platformDevices)
+        {
+            std::cout << "  " << allDevices.size() << ": " << device.getInfo<CL_DEVICE_NAME>() << " (" << platform.getInfo<CL_PLATFORM_NAME>() << ")" << std::endl;
+            allDevices.push_back(device);
+            platformNames.push_back(platform.getInfo<CL_PLATFORM_NAME>());
+        }
+    }
+
+    auto toLower = [](std::string text) {
+        std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+        return text;
+    };
+
+    std::vector<size_t> selected;
+    std::stringstream selectorStream(selector);
+    std::string token;
+    while (std::getline(selectorStream, token, ','))
+    {
+        token = toLower(token);
+        cl_device_type type = 0;
+        if (token == "gpu") type = CL_DEVICE_TYPE_GPU;
+        else if (token == "cpu") type = CL_DEVICE_TYPE_CPU;
+        else if (token == "accelerator") type = CL_DEVICE_TYPE_ACCELERATOR;
+        else if (token == "all") type = CL_DEVICE_TYPE_ALL;
+        bool isIndex = !token.empty() && std::all_of(token.begin(), token.end(), [](unsigned char c) { return isdigit(c); });
+
+        for (size_t i = 0; i < allDevices.size(); i++)
+        {
+            bool matches;
+            if (type) matches = (allDevices[i].getInfo<CL_DEVICE_TYPE>() & type) != 0;
+            else if (isIndex) matches = std::stoul(token) == i;
+            else matches = toLower(allDevices[i].getInfo<CL_DEVICE_NAME>()).find(token) != std::string::npos ||
+                toLower(platformNames[i]).find(token) != std::string::npos;
+
+            if (matches && std::find(selected.begin(), selected.end(), i) == selected.end())
+            {
+                selected.push_back(i);
+            }
+        }
+    }
+
+    std::vector<cl::Device> devices;
+    for (size_t i : selected)
+    {
+        devices.push_back(allDevices[i]);
+    }
+    return devices;
+}
+
+void PrintDeviceInfo(const cl::Device& device)
+{
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+
+    std::cout << "------------HARDWARE INFORMATION------------" << std::endl;
+    auto platName = platform.getInfo<CL_PLATFORM_NAME>();
+    auto devVersion = device.getInfo<CL_DEVICE_VERSION>();
+    auto devDriver = device.getInfo<CL_DRIVER_VERSION>();
+    auto devCVersion = device.getInfo<CL_DEVICE_OPENCL_C_VERSION>();
+
+    std::cout << "Platform name: " << platName << std::endl;
+    std::cout << "Hardware version: " << devVersion << std::endl;
+    std::cout << "Driver version: " << devDriver << std::endl;
+    std::cout << "OpenCL C version: " << devCVersion << std::endl;
+
+    std::cout << "------------DEVICE INFORMATION------------" << std::endl;
+    auto devInfo = device.getInfo<CL_DEVICE_NAME>();
+    auto devMemType = device.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>();
+    auto devMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    auto devPCunits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    auto devClockFreq = device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+    auto devConstBuffSize = device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+    auto devWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    auto devWorkItemSizes = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    auto devWorkItemDim = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS>();
+    auto devMaxReadImageArgs = device.getInfo<CL_DEVICE_MAX_READ_IMAGE_ARGS>();
+
+    std::cout << "Device information: " << devInfo << std::endl;
+    std::cout << "Local memory types: " << devMemType << std::endl;
+    std::cout << "Local memory size: " << devMemSize << std::endl;
+    std::cout << "Parallel Compute units: " << devPCunits << std::endl;
+    std::cout << "Max clock frequency: " << devClockFreq << std::endl;
+    std::cout << "Max constant buffer size: " << devConstBuffSize << std::endl;
+    std::cout << "Work group size: " << devWorkGroupSize << std::endl;
+    for (size_t i = 0; i < devWorkItemSizes.size(); i++)
+    {
+        std::cout << "Work item " << i << " size: " << devWorkItemSizes[i] << std::endl;
+    }
+    std::cout << "Max Work Item Dimensions: " << devWorkItemDim << std::endl;
+    std::cout << "Max read image arguments: " << devMaxReadImageArgs << std::endl;
+}
+
+void InitDevice(const cl::Device& device, const std::string& src, unsigned int width, unsigned int height, bool loadTuning)
+{
+    cl_info_obj = cl_info();
+
+    // load the tuned settings for the resized resolution, as they decide which ZNCC vector width is built
+    cl_info_obj.znccVecWidth = ZNCCVectorWidth(device);
+    if (loadTuning && LoadTuning(device, width, height) && cl_info_obj.printProfiling)
+    {
+        std::cout << "Loaded tuned settings from " << TuningCachePath(device) << std::endl;
+    }
+
+    // create context and build program
+    cl::Context context(device);
+
+    // create command queue with profiling enabled
+    cl_command_queue_properties properties[]{ CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+
+    // fill in custom struct
+    cl_info_obj.context = context;
+    cl_info_obj.program = BuildProgram(context, src, cl_info_obj.znccVecWidth);
+    cl_info_obj.device = device;
+    cl_info_obj.queue = cl::CommandQueue(context, device, properties);
+    cl_info_obj.transferQueue = cl::CommandQueue(context, device, properties);
+    cl_info_obj.source = src;
+}
+
+// Pipeline runs of a parameter set after which a specialized program is built for it
+// one-off parameter sets keep using the generic program, so they don't pay for a build
+const int variantBuildUses = 2;
+
+// -D defines of the specialized program for a parameter set | maxDisparity is the disparity range of the resized image
+std::string VariantDefines(int windowSize, int maxDisparity, int neighbours)
+{
+    return " -D WIN_SIZE=" + std::to_string(windowSize) + " -D MAX_DISP=" + std::to_string(maxDisparity) +
+        " -D N_COUNT=" + std::to_string(neighbours);
+}
+
+// Cache entry of the calling thread's device for the defines | looked up by the full build options,
+// so the variant follows the ZNCC vector width of the generic program
+program_variant& FindVariant(const std::string& defines)
+{
+    return cl_info_obj.variants[BuildOptions(cl_info_obj.znccVecWidth, defines)];
+}
+
+void BuildVariant(program_variant& variant, const std::string& defines)
+{
+    if (variant.built || variant.failed) return;
+    try
+    {
+        variant.program = BuildProgram(cl_info_obj.context, cl_info_obj.source, cl_info_obj.znccVecWidth, defines);
+        variant.built = true;
+        if (cl_info_obj.printProfiling) std::cout << "Built specialized program with" << defines << std::endl;
+    }
+    catch (cl::Error& err)
+    {
+        variant.failed = true;
+        std::cout << "Warning: specialized program with" << defines << " failed to build (" << err.err() << "), using the generic one" << std::endl;
+    }
+}
+
+cl::Program VariantProgram(int windowSize, int maxDisparity, int neighbours)
+{
+    std::string defines = VariantDefines(windowSize, maxDisparity, neighbours);
+    program_variant& variant = FindVariant(defines);
+    variant.uses++;
+    if (variant.uses >= variantBuildUses)
+    {
+        BuildVariant(variant, defines);
+    }
+    return variant.built ? variant.program : cl_info_obj.program;
+}
+
+void PrepareVariant(int windowSize, int maxDisparity, int neighbours)
+{
+    std::string defines = VariantDefines(windowSize, maxDisparity, neighbours);
+    BuildVariant(FindVariant(defines), defines);
+}
+
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+// OpenCL stages of the optimized implementation: device setup and autotuning, the Enqueue function of every kernel
+// and the profiling timeline | the modes of zncc_opencl_optimized.cpp are built from them, and every thread runs
+// them on the device of its own cl_info_obj
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#if defined(__APPLE__) || defined(__MACOSX)
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "../common/zncc_common.h"
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace opencl {
+
+// timeline row of host stages on the calling thread
+extern thread_local std::string hostTraceTrack;
+
+// OpenCL command whose profiling information is read once it has finished
+// hostQueued is taken right before the command was enqueued and is used to place the device clock on the host timeline
+struct pending_command {
+    cl::Event event;
+    std::string name;
+    std::chrono::steady_clock::time_point hostQueued;
+    bool transfer = false;  // enqueued on the transfer queue | shown on its own tracks
+};
+
+// Program built for one parameter set with -D WIN_SIZE, MAX_DISP and N_COUNT
+struct program_variant {
+    cl::Program program;
+    int uses = 0;           // pipeline runs that asked for this parameter set
+    bool built = false;
+    bool failed = false;    // the build failed, so the generic program is used without trying again
+};
+
+// cl_info struct type to hold reused opencl objects
+// every thread has its own copy, so that several devices can run the pipeline at the same time
+struct cl_info {
+    cl::Context context;   
+    cl::Program program;
+    cl::Device device;
+    cl::CommandQueue queue;
+    cl::CommandQueue transferQueue;     // uploads and readbacks of strip streaming, so they overlap the kernels on queue
+    cl::Event profEvent;
+    int znccVecWidth;   // disparities per work-item in calc_zncc_vec | 1 if the scalar calc_zncc kernel is used
+    std::string znccKernel;     // ZNCC kernel picked by the autotuner | empty if it is picked by EnqueueZNCC
+    std::map<std::string, std::vector<size_t>> localSizes;  // tuned local size per kernel | kernels not in the map use cl::NullRange
+    double lastRunTime = 0;     // execution time of the last kernel in nanoseconds
+    bool printProfiling = true;
+    bool recordTrace = true;    // add the commands of this queue to the timeline | off while autotuning
+    std::vector<pending_command> pendingCommands;
+    std::string source;         // kernel source the generic program was built from
+    std::map<std::string, program_variant> variants;  // specialized programs keyed by their build options
+};
+
+extern thread_local cl_info cl_info_obj;
+
+// Times a host stage from construction to destruction
+struct host_stage {
+    std::string name;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    host_stage(const std::string& name) : name(name) {}
+
+    ~host_stage();
+};
+
+// Keep an enqueued command of the calling thread's queue for the timeline
+void TraceCommand(const cl::Event& event, const std::string& name, std::chrono::steady_clock::time_point hostQueued, bool transfer = false);
+
+// Wait for the calling thread's queues and move its commands to the timeline
+// OpenCL 1.2 has no common host and device clock, so the device clock is shifted by the smallest offset
+// that puts every command's queued timestamp after the host enqueued it
+void ResolveTraceCommands();
+
+// Host memory shared with the device | the buffer is allocated by the runtime with CL_MEM_ALLOC_HOST_PTR,
+// so it is page-aligned and mapping it does not copy on devices that share memory with the host
+struct host_buffer {
+    cl::Buffer buffer;
+    unsigned char* data = nullptr;  // host pointer while the buffer is mapped | nullptr while the device owns it
+    size_t size = 0;
+};
+
+// Map the buffer for the host | blocking, so the data can be used right after
+void MapHostBuffer(host_buffer& hostBuffer, cl_map_flags flags, cl::Event* event = NULL);
+
+// Hand the buffer back to the device
+void UnmapHostBuffer(host_buffer& hostBuffer);
+
+// Allocate a host buffer of size bytes, mapped for writing so the host can fill it
+host_buffer AllocateHostBuffer(size_t size, cl_mem_flags deviceAccess);
+
+// Device-readable view of RGBA pixels the host already holds | the runtime may copy them if they are not suitably aligned
+cl::Buffer WrapRGBA(unsigned char* image, unsigned int width, unsigned int height);
+
+// Every Enqueue function takes the number of pairs of a batch | the buffers hold that many images back to back
+// and the kernels run once for the whole batch, with the pair index as the third dimension
+cl::Buffer EnqueueGrayScaleResize(const cl::Buffer& inputImage, unsigned int width, unsigned int height, unsigned int resizeFactor, int pairs = 1);
+
+// Window sums of the pixels and squared pixels along the rows, as int2 | one work-item per row
+// rows are independent, so a batch is summed as one image of height * pairs rows
+cl::Buffer EnqueueBoxRowSums(const cl::Buffer& image, int width, int height, int windowSize, int pairs = 1);
+
+// Window mean and 1 / norm from the row sums, as float2 | one work-item per column
+cl::Buffer EnqueueBoxColumnStats(const cl::Buffer& rowSums, int width, int height, int windowSize, int pairs = 1);
+
+// Mean and 1 / norm of the ZNCC window around every pixel | computed once per image,
+// so the ZNCC kernels only sum the cross term for every disparity
+cl::Buffer EnqueueBoxStats(const cl::Buffer& image, int width, int height, int windowSize, int pairs = 1);
+
+// Rectangles the per-pixel kernels are launched on, with the global work offset at their top left pixel
+// the whole image if no regions are given | regions outside of the image are dropped
+std::vector<roi> LaunchRegions(const std::vector<roi>& regions, int width, int height);
+
+// leftStats and rightStats are the EnqueueBoxStats buffers of the two images
+// ZNCC, cross-checking and occlusion filling can be limited to regions of a single pair | pixels outside of them are left undefined
+cl::Buffer EnqueueZNCC(const cl::Buffer leftImage,
+    const cl::Buffer rightImage,
+    const cl::Buffer leftStats,
+    const cl::Buffer rightStats,
+    int width, int height,
+    int windowSize, int maxDisparity,
+    char isLeftImage = 1, int pairs = 1,
+    const std::vector<roi>& regions = std::vector<roi>(), int minDisparity = 0);
+
+// State a video stream carries from frame to frame | the cross-checked disparities of the previous frame
+// limit the search of the next one to searchRadius around them
+struct temporal_state : temporal_base {
+    cl::Buffer prior;           // cross-checked disparities of the previous frame, in the calling thread's context
+    bool hasPrior = false;
+};
+
+// Disparities a full range ZNCC pass evaluates | border pixels evaluate none
+cl_ulong FullEvaluations(int width, int height, int windowSize, int maxDisparity);
+
+// ZNCC of a single pair limited to the prior of the temporal state | evaluated disparities are added to the state
+cl::Buffer EnqueueZNCCTemporal(const cl::Buffer leftImage,
+    const cl::Buffer rightImage,
+    const cl::Buffer leftStats,
+    const cl::Buffer rightStats,
+    int width, int height,
+    int windowSize, int maxDisparity,
+    char isLeftImage, temporal_state& state, int minDisparity = 0);
+
+// State of incremental re-matching of a video stream | tiles of the resized images that changed since their
+// disparities were computed are matched again, the disparities of all others are kept in a cache on the device
+struct incremental_state : incremental_base {
+    cl::Buffer referenceLeft, referenceRight;   // resized gray images every tile was last matched on
+    cl::Buffer cache;           // occlusion filled disparities of the previous frame
+    bool hasCache = false;
+};
+
+// Sum of the absolute differences of every tile of two resized gray images, read back to the host
+std::vector<cl_uint> EnqueueTileChanges(const cl::Buffer& currentImage, const cl::Buffer& previousImage, int width, int height, int tileSize);
+
+// Copy a rectangle between two buffers of width elements per row on the device
+void EnqueueCopyRegion(const cl::Buffer& source, const cl::Buffer& destination, const roi& region, int width, size_t elementSize, const char* label);
+
+// Enqueue calc_zncc_points for the keypoints of the left image and read back their disparities and scores
+std::vector<point_disparity> EnqueueZNCCPoints(const cl::Buffer leftImage,
+    const cl::Buffer rightImage,
+    const cl::Buffer leftStats,
+    const cl::Buffer rightStats,
+    const std::vector<keypoint>& points,
+    int width, int height,
+    int windowSize, int maxDisparity, int minDisparity = 0);
+
+cl::Buffer EnqueueCrossCheck(const cl::Buffer dispMapLeft,
+    const cl::Buffer dispMapRight,
+    const int width, const int height, 
+    const int crossDiff, const int pairs = 1,
+    const std::vector<roi>& regions = std::vector<roi>());
+
+cl::Buffer EnqueueOcclusionFilling(const cl::Buffer crossCheckedImage, 
+    const int width, const int height, const int nCount, const int pairs = 1,
+    const std::vector<roi>& regions = std::vector<roi>());
+
+// Sub-pixel disparities of a map | pixels the cross-check kept are refined with the left image's ZNCC scores at the
+// disparities on both sides of theirs, all others keep the filled disparity | returns a float buffer
+cl::Buffer EnqueueSubpixelRefinement(const cl::Buffer leftImage,
+    const cl::Buffer rightImage,
+    const cl::Buffer leftStats,
+    const cl::Buffer rightStats,
+    const cl::Buffer crossCheckedImage,
+    const cl::Buffer filledImage,
+    const int width, const int height,
+    const int windowSize, const int maxDisparity,
+    const bool equiangular, const int pairs = 1);
+
+// pixels are normalized independently, so a batch is normalized as one image of height * pairs rows
+// refined selects the float disparities of EnqueueSubpixelRefinement instead of the int ones of occlusion filling
+cl::Buffer EnqueueNormalizeToChar(const cl::Buffer filledImage, 
+    const int width, int height, const int ndisp, const int pairs = 1, const bool refined = false);
+
+// Minimal JSON value used by the tuning cache and the profiling timeline
+struct json_value {
+    enum value_type { null_type, number_type, string_type, array_type, object_type } type = null_type;
+    double number = 0;
+    std::string string;
+    std::vector<std::string> keys;  // object keys, in the same order as items
+    std::vector<json_value> items;  // array items or object values
+
+    const json_value* Find(const std::string& key) const
+    {
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (keys[i] == key) return &items[i];
+        }
+        return nullptr;
+    }
+
+    void Set(const std::string& key, const json_value& value)
+    {
+        type = object_type;
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (keys[i] == key)
+            {
+                items[i] = value;
+                return;
+            }
+        }
+        keys.push_back(key);
+        items.push_back(value);
+    }
+};
+
+json_value JsonNumber(double number);
+
+json_value JsonString(const std::string& string);
+
+void WriteJson(std::ostream& out, const json_value& value, int indent = 0);
+
+// Write the timeline in the Chrome trace event format | every track becomes a named thread of one process
+bool WriteTrace(const std::string& path);
+
+// Write the total, count, mean, min and max duration of every stage per track | durations in microseconds
+bool WriteTraceSummary(const std::string& path, double wallTime);
+
+// JSON cache file at path, e.g. of the tuning or the dispatcher | a null value if it doesn't exist or is malformed
+json_value ReadTuningCache(const std::string& path);
+
+// Store the tuned settings in cl_info_obj as the device's entry for a resized resolution, keeping its other entries
+void SaveTuning(const cl::Device& device, unsigned int width, unsigned int height);
+
+// Benchmark the local sizes of every kernel, and the ZNCC kernel variants, on the actual images
+// the winners are left in cl_info_obj, with cl_info_obj.program rebuilt for the winning ZNCC vector width
+void AutotuneKernels(const cl::Context& context, const std::string& src,
+    const cl::Buffer& leftImage, const cl::Buffer& rightImage,
+    unsigned int width, unsigned int height, int resizeFactor,
+    int winSize, int ndisp, int neighbours, int crossDiff);
+
+// Select OpenCL devices from every platform | selector is a comma separated list of
+// gpu, cpu, accelerator, all, an index from the printed device list or part of a device or platform name (e.g. pocl)
+// devices are returned in the order of the selector without duplicates
+std::vector<cl::Device> SelectDevices(const std::string& selector);
+
+void PrintDeviceInfo(const cl::Device& device);
+
+// Set up the calling thread's cl_info_obj for the device: context, queue, tuned settings and program
+// width and height are the resized resolution the tuned settings are looked up for
+void InitDevice(const cl::Device& device, const std::string& src, unsigned int width, unsigned int height, bool loadTuning = true);
+
+// Program for a pipeline run with the parameter set | the generic program until the set has been used variantBuildUses times
+cl::Program VariantProgram(int windowSize, int maxDisparity, int neighbours);
+
+// Build the specialized program for a parameter set that is used for the whole run, before the pipeline runs
+void PrepareVariant(int windowSize, int maxDisparity, int neighbours);
+
+}
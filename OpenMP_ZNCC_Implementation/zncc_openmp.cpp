@@ -6,240 +6,37 @@
 #include <vector>
 #include <Windows.h>
 
-
-void GrayScaleImageConversion(const std::vector<unsigned char>& image, unsigned int width, unsigned int height, std::vector<unsigned char>& imageGray)
+#include "../common/zncc_common.h"
+#include "../common/heap_allocations.h"
+#include "../common/stereo_workspace.h"
+#include "zncc_openmp_stages.h"
+
+using namespace openmp;
+
+// Whole pipeline on RGBA images of width x height | ndisp is the disparity range of the resized images and
+// the normalized depthmap is left in workspace.depthmap
+// disparities from minDisparity of the resized image up to ndisp are searched
+void RunPipeline(const std::vector<unsigned char>& leftImage, const std::vector<unsigned char>& rightImage,
+    unsigned int width, unsigned int height, unsigned int resizeFactor, int windowSize, int ndisp, int nCount, int crossDiff,
+    stereo_workspace& workspace, int minDisparity = 0)
 {
-    // iterate over every four values, as input is 4 channeled RGBA
-    char channel = 4;
-#pragma omp parallel for
-    for (int i = 0; i < image.size(); i += channel)
-    {
-        // Add up R, G and B values and divide to get grayscale value.
-        // We don't care about the A value, so it is not used.
-        imageGray[i / channel] = (image[i + 0] + image[i + 1] + image[i + 2]) / 3;
-    }
-}
-
-void ResizeImage(std::vector<unsigned char> image, unsigned int width, unsigned int height, unsigned int resizeFactor, std::vector<unsigned char>& imageResized)
-{
-    // Divide image into resizeFactor x resizeFactor blocks and then use the average value of said blocks as the value of the new pixel
-    imageResized.resize((width * height) / (resizeFactor * resizeFactor));
-
-    int newWidth = width / resizeFactor;
-    int newHeight = height / resizeFactor;
-
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < newHeight; ++i)
-    {
-        for (int j = 0; j < newWidth; ++j)
-        {
-            int sum = 0;
-#pragma omp parallel for collapse(2)
-            for (int k = i * resizeFactor; k < (i + 1) * resizeFactor; k++) {
-                for (int l = j * resizeFactor; l < (j + 1) * resizeFactor; l++) {
-                    sum += image[k * width + l];
-                }
-            }
-            imageResized[i * (newWidth)+j] = sum / (resizeFactor * resizeFactor);
-        }
-    }
-}
-
-
-// Apply ZNCC algorithm for a given window size and max disparity
-void CalcZNCC(const std::vector<unsigned char>& leftImage,
-    const std::vector<unsigned char>& rightImage,
-    int width, int height,
-    int windowSize, int maxDisparity,
-    std::vector<int>& disparityMap,
-    char isLeftImage = 1
-)
-{
-    int imgSize = width * height;
-
-    int halfWindowSize = (windowSize - 1) / 2;
-
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < height; y++)
-    {
-        for (int x = 0; x < width; x++)
-        {
-            int bestDisp = 0;
-            float bestZNCC = -100.0;
-            bool isBorderPixel = false;
-
-            // handle borders | keep bestDisp at 0, so borders will be black
-            if (y >= height - halfWindowSize || x >= width - halfWindowSize ||
-                y <= halfWindowSize || x <= halfWindowSize)
-            {
-                isBorderPixel = true;
-            }
-
-            if (!isBorderPixel)
-            {
-#pragma omp parallel for
-                for (int d = 0; d < maxDisparity; d++)
-                {
-                    float zncc = 0.0;
-                    float numerator = 0.0, denominator1 = 0.0, denominator2 = 0.0;
-                    float leftMean = 0.0, rightMean = 0.0;
-
-                    // calculate mean for each window - changes for different disparities, as the rightmean is calculated based on the disparity
-                    int avgCount = 0;
-#pragma omp parallel for collapse(2)
-                    for (int winY = -halfWindowSize; winY < halfWindowSize; winY++)
-                    {
-                        for (int winX = -halfWindowSize; winX < halfWindowSize; winX++)
-                        {
-                            // don't allow pixel to go to previous row
-                            if (d > x + winX)
-                            {
-                                continue;
-                            }
-
-                            int leftPixelIndex = (y + winY) * width + (x + winX);
-                            int rightPixelIndex = (y + winY) * width + (x + winX - isLeftImage * d);
-                            if (rightPixelIndex >= imgSize ||
-                                rightPixelIndex <= 0)
-                            {
-                                continue;
-                            }
-
-                            leftMean += leftImage[leftPixelIndex];
-                            rightMean += rightImage[rightPixelIndex];
-                            avgCount++;
-                        }
-
-                    }
-                    leftMean = leftMean / avgCount;
-                    rightMean = rightMean / avgCount;
-#pragma omp parallel for collapse(2)
-                    for (int winY = -halfWindowSize; winY < halfWindowSize; winY++)
-                    {
-                        for (int winX = -halfWindowSize; winX < halfWindowSize; winX++)
-                        {
-                            // don't allow pixel to go to previous row
-                            if (d > x + winX)
-                            {
-                                continue;
-                            }
-
-                            int leftPixelIndex = (y + winY) * width + (x + winX);
-                            int rightPixelIndex = (y + winY) * width + (x + winX - isLeftImage * d);
-                            if (rightPixelIndex >= imgSize ||
-                                rightPixelIndex <= 0)
-                            {
-                                continue;
-                            }
-
-                            // calculate zncc value for each window
-                            numerator += (leftImage[leftPixelIndex] - leftMean) * (rightImage[rightPixelIndex] - rightMean);
-                            denominator1 += pow(leftImage[leftPixelIndex] - leftMean, 2);
-                            denominator2 += pow(rightImage[rightPixelIndex] - rightMean, 2);
-
-                        }
-
-                    }
-
-                    float denominator = sqrt(denominator1) * sqrt(denominator2);
-                    if (denominator == 0) {
-                        break;
-                    }
-
-                    zncc = numerator / denominator;
-                    if (zncc > bestZNCC)
-                    {
-                        bestZNCC = zncc;
-                        bestDisp = d;
-                    }
-                }
-            }
-
-            disparityMap[y * width + x] = bestDisp;
-        }
-    }
-}
-
-void CrossCheck(const std::vector<int>& dispMapLeft, const std::vector<int>& dispMapRight, const int& width, const int& height, const int& crossDiff, std::vector<int>& crossDispMap)
-{
-    // Loop over all pixels inside the image boundary
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-
-            // Get the disparity values for the current pixel in both directions
-            int dispLeft = dispMapLeft[y * width + x];
-            int dispRight = dispMapRight[y * width + x];
-
-            // Check if the disparity values agree | abs used to account for rounding errors
-            if (std::abs(dispLeft - dispRight) <= crossDiff) {
-                // If the disparities agree, use the left disparity value as the final disparity for the pixel
-                crossDispMap[y * width + x] = dispLeft;
-            }
-            else {
-                // Otherwise, mark the pixel as invalid
-                crossDispMap[y * width + x] = 0;
-            }
-        }
-    }
-}
-
-void OcclusionFilling(const std::vector<int>& dispMap, const int& width, const int& height, const int& nCount, std::vector<int>& dispMapFilled)
-{
-    // Copy the input disparity map to the output disparity map
-    std::copy(dispMap.begin(), dispMap.end(), dispMapFilled.begin());
-#pragma omp parallel for collapse(2)
-    // Loop over all pixels inside the image boundary
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-
-            // handle borders | keep bestDisp at 0, so borders will stay black
-            if (y >= height - (nCount / 2) || x >= width - (nCount / 2) ||
-                y <= nCount / 2 || x <= nCount / 2)
-            {
-                continue;
-            }
-
-            // Check if the current pixel is marked as invalid
-            if (dispMap[y * width + x] == 0) {
-
-                // Initialize the list of valid disparity values in the n-neighborhood of the current pixel
-                std::vector<int> neighbors;
-
-                // Loop over the n-neighbors of the current pixel
-#pragma omp parallel for collapse(2)
-                for (int dy = -nCount / 2; dy <= nCount / 2; dy++) {
-                    for (int dx = -nCount / 2; dx <= nCount / 2; dx++) {
-                        // Skip the center pixel
-                        if (dx == 0 && dy == 0) continue;
-
-                        // Get the disparity value for the current neighbor
-                        int neighbor_disp = dispMap[(y + dy) * width + (x + dx)];
-
-                        // If the neighbor is valid, add its disparity value to the list
-                        if (neighbor_disp > 0) {
-                            neighbors.push_back(neighbor_disp);
-                        }
-                    }
-                }
-
-                // If at least one valid disparity value was found in the n-neighborhood,
-                // set the current pixel's disparity value to the median of the valid values
-                if (!neighbors.empty()) {
-                    dispMapFilled[y * width + x] = neighbors[neighbors.size() / 2];
-                }
-            }
-        }
-    }
-}
-
-void NormalizeToChar(const std::vector<int>& dispMap, const int& width, const int& height, const int& ndisp, std::vector<unsigned char>& normVec)
-{
-    // Loop over all pixels and normalize the disparity values
-#pragma omp parallel for
-    for (int i = 0; i < width * height; i++) {
-        normVec[i] = static_cast<unsigned char>(static_cast<float>(dispMap[i]) / ndisp * 255);
-    }
+    PrepareWorkspace(workspace, width, height, resizeFactor);
+
+    // convert image to grayscale and resize
+    GrayScaleImageConversion(leftImage, width, height, workspace.leftGray);
+    GrayScaleImageConversion(rightImage, width, height, workspace.rightGray);
+    ResizeImage(workspace.leftGray, width, height, resizeFactor, workspace.leftResized);
+    ResizeImage(workspace.rightGray, width, height, resizeFactor, workspace.rightResized);
+
+    width = width / resizeFactor;
+    height = height / resizeFactor;
+
+    // apply zncc, cross-check, occlusion filling and normalization to 8 bit
+    CalcZNCC(workspace.leftResized, workspace.rightResized, width, height, windowSize, ndisp, workspace.leftDisparity, 1, minDisparity);
+    CalcZNCC(workspace.rightResized, workspace.leftResized, width, height, windowSize, ndisp, workspace.rightDisparity, -1, minDisparity);
+    CrossCheck(workspace.leftDisparity, workspace.rightDisparity, width, height, crossDiff, workspace.crossChecked);
+    OcclusionFilling(workspace.crossChecked, width, height, nCount, workspace.filled);
+    NormalizeToChar(workspace.filled, width, height, ndisp, workspace.depthmap);
 }
 
 int main()
@@ -263,6 +60,25 @@ int main()
 
     const char* depthmapOut = "../img/depthmap.png";
 
+    // Middlebury calib.txt of the scene | if it exists, only its [vmin, vmax] disparities are searched instead of
+    // 0 to ndisp, which often is a small part of the range
+    const char* calibrationFile = "../img/calib.txt";
+    int minDisparity = 0;
+    calibration calib;
+    if (ReadCalibration(calibrationFile, calib))
+    {
+        ApplyCalibration(calib, resize_factor, ndisp, minDisparity);
+        std::cout << "Searching disparities " << minDisparity << " to " << ndisp << " from " << calibrationFile << std::endl;
+    }
+
+    // run the pipeline this many times on the pair, reusing one workspace | the heap allocations of the runs
+    // after the first are printed and are 0 once the workspace is sized
+    int runs = 1;
+#ifdef ZNCC_CHECK_ALLOCATIONS
+    // the check needs at least one run on the sized workspace
+    if (runs < 2) runs = 2;
+#endif
+
     // create containers for raw images
     std::vector<unsigned char> leftImage;
     std::vector<unsigned char> rightImage;
@@ -283,41 +99,23 @@ int main()
 
     QueryPerformanceCounter(&start);
 
-    // convert image to grayscale, ignoring the alpha channel
-    std::vector<unsigned char> leftImageGray(width * height);
-    std::vector<unsigned char> rightImageGray(width * height);
-    GrayScaleImageConversion(leftImage, width, height, leftImageGray);
-    GrayScaleImageConversion(rightImage, width, height, rightImageGray);
-
-    // resize image
-    std::vector<unsigned char> leftImageResized(width * height);
-    std::vector<unsigned char> rightImageResized(width * height);
-    ResizeImage(leftImageGray, width, height, resize_factor, leftImageResized);
-    ResizeImage(rightImageGray, width, height, resize_factor, rightImageResized);
-
-    // update values depending on resolution
-    int oldWidth = width;
-    width = width / resize_factor;
-    height = height / resize_factor;
-    ndisp = ndisp * (static_cast<float>(width) / oldWidth);
-
-    // apply zncc
-    std::vector<int> leftImageDisparity(width * height);
-    std::vector<int> rightImageDisparity(width * height);
-    CalcZNCC(leftImageResized, rightImageResized, width, height, win_size, ndisp, leftImageDisparity);
-    CalcZNCC(rightImageResized, leftImageResized, width, height, win_size, ndisp, rightImageDisparity, -1);
-
-    // CrossChecking
-    std::vector<int> crossCheckedMap(width * height);
-    CrossCheck(leftImageDisparity, rightImageDisparity, width, height, crossDiff, crossCheckedMap);
-
-    // occlusion filling
-    std::vector<int> oclussionFilledMap(width * height);
-    OcclusionFilling(crossCheckedMap, width, height, neighbours, oclussionFilledMap);
-
-    // normalization to 8 bit
-    std::vector<unsigned char> depthmapNormalized(width * height);
-    NormalizeToChar(oclussionFilledMap, width, height, ndisp, depthmapNormalized);
+    int resizedDisp = ndisp * (static_cast<float>(width / resize_factor) / width);
+    int resizedMinDisp = minDisparity * (static_cast<float>(width / resize_factor) / width);
+    stereo_workspace workspace;
+    for (int run = 0; run < runs; run++)
+    {
+        long long allocationsBefore = heapAllocations;
+        RunPipeline(leftImage, rightImage, width, height, resize_factor, win_size, resizedDisp, neighbours, crossDiff, workspace, resizedMinDisp);
+        long long allocations = heapAllocations - allocationsBefore;
+        if (run > 0) std::cout << "Run " << run << ": " << allocations << " heap allocations" << std::endl;
+#ifdef ZNCC_CHECK_ALLOCATIONS
+        if (run > 0 && allocations > 0)
+        {
+            std::cerr << "Run " << run << " allocated on the heap although the workspace is sized" << std::endl;
+            return 1;
+        }
+#endif
+    }
 
     // end execution timing and print
     QueryPerformanceCounter(&end);
@@ -328,6 +126,8 @@ int main()
     std::cout << "Elapsed time: " << elapsed_time / 60 << " minutes\n";
 
     // encode resized and grayscaled images (im*_out)
-    error = lodepng::encode(depthmapOut, depthmapNormalized, width, height, LCT_GREY, 8);
+    error = lodepng::encode(depthmapOut, workspace.depthmap, width / resize_factor, height / resize_factor, LCT_GREY, 8);
     if (error) std::cout << "encoder error first image: " << error << ": " << lodepng_error_text(error) << std::endl;
+
+    return 0;
 }
\ No newline at end of file
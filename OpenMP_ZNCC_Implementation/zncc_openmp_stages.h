@@ -0,0 +1,32 @@
+#pragma once
+
+// Stages of the OpenMP pipeline | every stage splits its pixels over the threads of an OpenMP team | zncc_openmp.cpp
+// runs them as a pipeline, and the dispatcher of the optimized OpenCL implementation runs them as its "openmp" backend
+
+#include <vector>
+
+namespace openmp {
+
+void GrayScaleImageConversion(const std::vector<unsigned char>& image, unsigned int width, unsigned int height, std::vector<unsigned char>& imageGray);
+
+void ResizeImage(const std::vector<unsigned char>& image, unsigned int width, unsigned int height, unsigned int resizeFactor, std::vector<unsigned char>& imageResized);
+
+// Apply ZNCC algorithm for a given window size and max disparity | only disparities from minDisparity up to
+// maxDisparity are searched and only rows [firstRow, lastRow) are matched, the other rows of disparityMap are left as
+// they are | lastRow -1 means up to the last row
+void CalcZNCC(const std::vector<unsigned char>& leftImage,
+    const std::vector<unsigned char>& rightImage,
+    int width, int height,
+    int windowSize, int maxDisparity,
+    std::vector<int>& disparityMap,
+    char isLeftImage = 1,
+    int minDisparity = 0, int firstRow = 0, int lastRow = -1
+);
+
+void CrossCheck(const std::vector<int>& dispMapLeft, const std::vector<int>& dispMapRight, const int& width, const int& height, const int& crossDiff, std::vector<int>& crossDispMap);
+
+void OcclusionFilling(const std::vector<int>& dispMap, const int& width, const int& height, const int& nCount, std::vector<int>& dispMapFilled);
+
+void NormalizeToChar(const std::vector<int>& dispMap, const int& width, const int& height, const int& ndisp, std::vector<unsigned char>& normVec);
+
+}
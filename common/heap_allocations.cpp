@@ -0,0 +1,23 @@
+#include "heap_allocations.h"
+
+#include <cstdlib>
+#include <new>
+
+std::atomic<long long> heapAllocations(0);
+
+void* operator new(size_t size)
+{
+    heapAllocations++;
+    if (void* memory = std::malloc(size > 0 ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
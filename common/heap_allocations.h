@@ -0,0 +1,9 @@
+#pragma once
+
+// Heap allocations of the process, counted by the global operator new that heap_allocations.cpp replaces | a program
+// links that file to check that its runs on a sized stereo_workspace don't allocate | built with
+// ZNCC_CHECK_ALLOCATIONS, as the Debug configurations are, the mains fail if one of them does
+
+#include <atomic>
+
+extern std::atomic<long long> heapAllocations;
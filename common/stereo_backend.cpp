@@ -0,0 +1,70 @@
+#include "stereo_backend.h"
+
+#include "../CPU_ZNCC_Implementation/zncc_stages.h"
+#include "../OpenMP_ZNCC_Implementation/zncc_openmp_stages.h"
+
+const char* stereoStageNames[STAGE_COUNT] = { "matching", "post_processing" };
+
+stereo_backend CPUBackend()
+{
+    stereo_backend backend;
+    backend.name = "cpu";
+    backend.match = [](unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height,
+        const zncc_params& params, stereo_maps& maps) {
+        // the stages take the RGBA images as vectors
+        size_t pixels = static_cast<size_t>(width) * height;
+        std::vector<unsigned char> leftGray(pixels), rightGray(pixels), leftResized, rightResized;
+        cpu::GrayScaleImageConversion(std::vector<unsigned char>(leftImage, leftImage + pixels * 4), width, height, leftGray);
+        cpu::GrayScaleImageConversion(std::vector<unsigned char>(rightImage, rightImage + pixels * 4), width, height, rightGray);
+        cpu::ResizeImage(leftGray, width, height, params.resizeFactor, leftResized);
+        cpu::ResizeImage(rightGray, width, height, params.resizeFactor, rightResized);
+
+        maps.width = width / params.resizeFactor;
+        maps.height = height / params.resizeFactor;
+        maps.ndisp = ResizedDisparityRange(params, width);
+        int minDisp = ResizedMinDisparity(params, width);
+        maps.left.resize(static_cast<size_t>(maps.width) * maps.height);
+        maps.right.resize(maps.left.size());
+        cpu::CalcZNCC(leftResized, rightResized, maps.width, maps.height, params.winSize, maps.ndisp, maps.left, 1, 0, 0, minDisp);
+        cpu::CalcZNCC(rightResized, leftResized, maps.width, maps.height, params.winSize, maps.ndisp, maps.right, -1, 0, 0, minDisp);
+    };
+    backend.postProcess = [](const zncc_params& params, stereo_maps& maps) {
+        std::vector<int> crossChecked(maps.left.size());
+        cpu::CrossCheck(maps.left, maps.right, maps.width, maps.height, params.crossDiff, crossChecked);
+        maps.filled.resize(crossChecked.size());
+        cpu::OcclusionFilling(crossChecked, maps.width, maps.height, params.neighbours, maps.filled);
+    };
+    return backend;
+}
+
+stereo_backend OpenMPBackend()
+{
+    stereo_backend backend;
+    backend.name = "openmp";
+    backend.match = [](unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height,
+        const zncc_params& params, stereo_maps& maps) {
+        // the stages take the RGBA images as vectors
+        size_t pixels = static_cast<size_t>(width) * height;
+        std::vector<unsigned char> leftGray(pixels), rightGray(pixels), leftResized, rightResized;
+        openmp::GrayScaleImageConversion(std::vector<unsigned char>(leftImage, leftImage + pixels * 4), width, height, leftGray);
+        openmp::GrayScaleImageConversion(std::vector<unsigned char>(rightImage, rightImage + pixels * 4), width, height, rightGray);
+        openmp::ResizeImage(leftGray, width, height, params.resizeFactor, leftResized);
+        openmp::ResizeImage(rightGray, width, height, params.resizeFactor, rightResized);
+
+        maps.width = width / params.resizeFactor;
+        maps.height = height / params.resizeFactor;
+        maps.ndisp = ResizedDisparityRange(params, width);
+        int minDisp = ResizedMinDisparity(params, width);
+        maps.left.resize(static_cast<size_t>(maps.width) * maps.height);
+        maps.right.resize(maps.left.size());
+        openmp::CalcZNCC(leftResized, rightResized, maps.width, maps.height, params.winSize, maps.ndisp, maps.left, 1, minDisp);
+        openmp::CalcZNCC(rightResized, leftResized, maps.width, maps.height, params.winSize, maps.ndisp, maps.right, -1, minDisp);
+    };
+    backend.postProcess = [](const zncc_params& params, stereo_maps& maps) {
+        std::vector<int> crossChecked(maps.left.size());
+        openmp::CrossCheck(maps.left, maps.right, maps.width, maps.height, params.crossDiff, crossChecked);
+        maps.filled.resize(crossChecked.size());
+        openmp::OcclusionFilling(crossChecked, maps.width, maps.height, params.neighbours, maps.filled);
+    };
+    return backend;
+}
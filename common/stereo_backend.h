@@ -0,0 +1,41 @@
+#pragma once
+
+// Stereo backends | every engine the pipeline can run on implements its stages behind the same interface, so the
+// dispatcher can time them per stage on this machine and mix them, e.g. OpenCL matching with host post-processing
+// the stages pass the disparity maps of the resized pair in host memory
+
+#include "zncc_common.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Disparity maps a pair passes between the stages
+struct stereo_maps {
+    int width = 0, height = 0;      // resized size
+    int ndisp = 0;                  // disparity range of the resized pair
+    std::vector<int> left, right;   // ZNCC disparities of the left and the right image
+    std::vector<int> filled;        // cross-checked and occlusion filled disparities
+};
+
+// Stages a backend is picked for
+enum stereo_stage { STAGE_MATCHING, STAGE_POST_PROCESSING, STAGE_COUNT };
+extern const char* stereoStageNames[STAGE_COUNT];
+
+// Engine running the stages | match fills every field of maps but filled from RGBA images of width x height,
+// postProcess fills maps.filled | pipeline runs both stages without the host round trip between them, empty if
+// the backend has no such path
+struct stereo_backend {
+    std::string name;
+    std::function<void(unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height,
+        const zncc_params& params, stereo_maps& maps)> match;
+    std::function<void(const zncc_params& params, stereo_maps& maps)> postProcess;
+    std::function<void(unsigned char* leftImage, unsigned char* rightImage, unsigned int width, unsigned int height,
+        const zncc_params& params, stereo_maps& maps)> pipeline;
+};
+
+// Backend on the stages of the CPU implementation | single threaded
+stereo_backend CPUBackend();
+
+// Backend on the stages of the OpenMP implementation | every stage split over the threads of an OpenMP team
+stereo_backend OpenMPBackend();
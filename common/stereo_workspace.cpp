@@ -0,0 +1,27 @@
+#include "stereo_workspace.h"
+
+#include <cstddef>
+
+void PrepareWorkspace(stereo_workspace& workspace, unsigned int width, unsigned int height, unsigned int resizeFactor, bool subpixel)
+{
+    size_t refinedSize = subpixel ? static_cast<size_t>(width / resizeFactor) * (height / resizeFactor) : 0;
+    if (workspace.width == width && workspace.height == height && workspace.resizeFactor == resizeFactor &&
+        workspace.refined.size() == refinedSize) return;
+
+    size_t fullSize = static_cast<size_t>(width) * height;
+    size_t resizedSize = static_cast<size_t>(width / resizeFactor) * (height / resizeFactor);
+    workspace.leftGray.assign(fullSize, 0);
+    workspace.rightGray.assign(fullSize, 0);
+    // ResizeImage sizes its output to width * height / resizeFactor^2, which can be larger than the resized image
+    workspace.leftResized.assign(fullSize / (resizeFactor * resizeFactor), 0);
+    workspace.rightResized.assign(fullSize / (resizeFactor * resizeFactor), 0);
+    workspace.leftDisparity.assign(resizedSize, 0);
+    workspace.rightDisparity.assign(resizedSize, 0);
+    workspace.crossChecked.assign(resizedSize, 0);
+    workspace.filled.assign(resizedSize, 0);
+    workspace.refined.assign(refinedSize, 0.0f);
+    workspace.depthmap.assign(resizedSize, 0);
+    workspace.width = width;
+    workspace.height = height;
+    workspace.resizeFactor = resizeFactor;
+}
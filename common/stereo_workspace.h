@@ -0,0 +1,20 @@
+#pragma once
+
+// Buffers of the dense host pipelines of the CPU and OpenMP implementations
+
+#include <vector>
+
+// Intermediate images of the dense pipeline, sized once for an input size and handed to every stage, so that
+// runs on images of the same size, e.g. frames of a video, reuse them without allocating
+struct stereo_workspace {
+    unsigned int width = 0, height = 0, resizeFactor = 0;  // input size and resize factor the buffers are sized for
+    std::vector<unsigned char> leftGray, rightGray;         // full resolution
+    std::vector<unsigned char> leftResized, rightResized;
+    std::vector<int> leftDisparity, rightDisparity, crossChecked, filled;
+    std::vector<float> refined;                             // sub-pixel disparities | empty without refinement
+    std::vector<unsigned char> depthmap;                    // normalized result
+};
+
+// Size the workspace for RGBA inputs of width x height | keeps the buffers if it already has that size
+// with subpixel the sub-pixel disparities get a buffer as well
+void PrepareWorkspace(stereo_workspace& workspace, unsigned int width, unsigned int height, unsigned int resizeFactor, bool subpixel = false);
@@ -0,0 +1,160 @@
+#include "zncc_common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+
+roi GrowRegion(const roi& region, int margin, int width, int height)
+{
+    roi grown;
+    grown.x = std::max(0, region.x - margin);
+    grown.y = std::max(0, region.y - margin);
+    grown.width = std::max(0, std::min(width, region.x + region.width + margin) - grown.x);
+    grown.height = std::max(0, std::min(height, region.y + region.height + margin) - grown.y);
+    return grown;
+}
+
+std::vector<roi> ChangedTiles(const std::vector<unsigned int>& leftDiffs, const std::vector<unsigned int>& rightDiffs,
+    int width, int height, int tileSize, float threshold)
+{
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<roi> tiles;
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        int tileHeight = std::min(tileSize, height - ty * tileSize);
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            int tileWidth = std::min(tileSize, width - tx * tileSize);
+            float limit = threshold * tileWidth * tileHeight;
+            size_t i = static_cast<size_t>(ty) * tilesX + tx;
+            if (leftDiffs[i] <= limit && rightDiffs[i] <= limit) continue;
+
+            // extend the run of the previous tile of this row
+            if (!tiles.empty() && tiles.back().y == ty * tileSize && tiles.back().x + tiles.back().width == tx * tileSize)
+            {
+                tiles.back().width += tileWidth;
+            }
+            else
+            {
+                tiles.push_back({ tx * tileSize, ty * tileSize, tileWidth, tileHeight });
+            }
+        }
+    }
+    return tiles;
+}
+
+std::vector<roi> AffectedRegions(const std::vector<roi>& tiles, int width, int height, int marginX, int marginY)
+{
+    std::vector<roi> regions;
+    for (const roi& tile : tiles)
+    {
+        int x0 = tile.x - marginX, x1 = tile.x + tile.width + marginX;
+        int y0 = tile.y - marginY, y1 = tile.y + tile.height + marginY;
+        if (x0 < 0 || x1 > width)
+        {
+            x0 = 0; x1 = width;
+            y0--; y1++;
+        }
+        roi region = GrowRegion({ x0, y0, x1 - x0, y1 - y0 }, 0, width, height);
+
+        roi* last = regions.empty() ? NULL : &regions.back();
+        if (last && last->x == region.x && last->width == region.width && region.y <= last->y + last->height)
+        {
+            int bottom = std::max(last->y + last->height, region.y + region.height);
+            last->height = bottom - last->y;
+        }
+        else
+        {
+            regions.push_back(region);
+        }
+    }
+    return regions;
+}
+
+// Index of the pixel of a width x height map at resizeFactor that the pixel (x, y) at targetResizeFactor lies in
+size_t UpsampleSource(int x, int y, int width, int height, int resizeFactor, int targetResizeFactor)
+{
+    int sourceX = std::min(width - 1, x * targetResizeFactor / resizeFactor);
+    int sourceY = std::min(height - 1, y * targetResizeFactor / resizeFactor);
+    return static_cast<size_t>(sourceY) * width + sourceX;
+}
+
+void UpsampleDisparities(const std::vector<int>& dispMap, int width, int height, int resizeFactor,
+    int targetWidth, int targetHeight, int targetResizeFactor, std::vector<int>& upsampled)
+{
+    upsampled.resize(static_cast<size_t>(targetWidth) * targetHeight);
+    for (int y = 0; y < targetHeight; y++)
+    {
+        for (int x = 0; x < targetWidth; x++)
+        {
+            int disparity = dispMap[UpsampleSource(x, y, width, height, resizeFactor, targetResizeFactor)];
+            upsampled[y * targetWidth + x] = disparity * resizeFactor / targetResizeFactor;
+        }
+    }
+}
+
+void UpsampleAnytimeResult(anytime_result& result, int width, int height, int resizeFactor,
+    int targetWidth, int targetHeight, int targetResizeFactor)
+{
+    std::vector<int> disparities;
+    UpsampleDisparities(result.disparities, width, height, resizeFactor, targetWidth, targetHeight, targetResizeFactor, disparities);
+    std::vector<unsigned char> quality(disparities.size());
+    for (int y = 0; y < targetHeight; y++)
+    {
+        for (int x = 0; x < targetWidth; x++)
+        {
+            quality[y * targetWidth + x] = result.quality[UpsampleSource(x, y, width, height, resizeFactor, targetResizeFactor)];
+        }
+    }
+    result.disparities.swap(disparities);
+    result.quality.swap(quality);
+}
+
+bool ReadCalibration(const std::string& path, calibration& calib)
+{
+    std::ifstream file(path);
+    if (!file) return false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        size_t equals = line.find('=');
+        if (equals == std::string::npos) continue;
+        std::string key = line.substr(0, equals);
+        const char* value = line.c_str() + equals + 1;
+        if (key == "ndisp") calib.ndisp = std::atoi(value);
+        else if (key == "vmin") calib.vmin = static_cast<float>(std::atof(value));
+        else if (key == "vmax") calib.vmax = static_cast<float>(std::atof(value));
+        else if (key == "doffs") calib.doffs = static_cast<float>(std::atof(value));
+    }
+    return true;
+}
+
+void ApplyCalibration(const calibration& calib, unsigned int resizeFactor, int& ndisp, int& minDisparity)
+{
+    if (calib.vmax > calib.vmin)
+    {
+        minDisparity = static_cast<int>(std::floor(calib.vmin));
+        // one resized disparity more than vmax, as the resized range is rounded down
+        ndisp = static_cast<int>(std::ceil(calib.vmax)) + resizeFactor;
+    }
+    else if (calib.ndisp > 0)
+    {
+        ndisp = calib.ndisp;
+    }
+}
+
+int ResizedDisparityRange(const zncc_params& params, unsigned int width)
+{
+    unsigned int resizedWidth = width / params.resizeFactor;
+    return params.ndisp * (static_cast<float>(resizedWidth) / width);
+}
+
+int ResizedMinDisparity(const zncc_params& params, unsigned int width)
+{
+    unsigned int resizedWidth = width / params.resizeFactor;
+    return params.minDisparity * (static_cast<float>(resizedWidth) / width);
+}
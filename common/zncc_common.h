@@ -0,0 +1,118 @@
+#pragma once
+
+// Pipeline parameters and host-side geometry, bookkeeping and calibration shared by the CPU, OpenMP and OpenCL
+// implementations | nothing in here depends on where the disparities are computed
+
+#include <vector>
+#include <string>
+
+// ZNCC pipeline parameters | ndisp and minDisparity are given for the full resolution image
+// disparities from minDisparity up to ndisp are searched
+struct zncc_params {
+    int ndisp;
+    int minDisparity = 0;
+    int resizeFactor;
+    int winSize;
+    int neighbours;
+    int crossDiff;
+    bool subpixel = false;      // refine the cross-checked disparities to float with the ZNCC scores around their peak
+    bool equiangular = false;   // fit two lines of opposite slope instead of a parabola to the scores
+};
+
+// Rectangle of the resized image | x and y are its top left pixel
+struct roi {
+    int x, y, width, height;
+};
+
+// Clip the rectangle grown by margin pixels on every side to the image
+roi GrowRegion(const roi& region, int margin, int width, int height);
+
+// Pixel of the resized image
+struct keypoint {
+    int x, y;
+};
+
+// Disparity of a keypoint and the ZNCC score of its correlation peak | border points get disparity 0 and score -100
+struct point_disparity {
+    int disparity;
+    float score;
+};
+
+// Settings and counters a video stream carries from frame to frame when the cross-checked disparities of the previous
+// frame limit the search of the next one to searchRadius around them | each implementation adds the prior itself
+struct temporal_base {
+    int frame = 0;
+    int keyframeInterval = 30;  // every keyframeInterval-th frame searches the full range
+    int searchRadius = 4;
+    float minScore = 0.5f;      // a best ZNCC below this falls back to the full range
+    long long evaluations = 0;  // disparities evaluated in the current frame
+    long long fullEvaluations = 0;  // disparities a full range search of the current frame evaluates
+};
+
+// Settings and counters of incremental re-matching of a video | tiles of the resized images that changed since their
+// disparities were computed are matched again | each implementation adds the reference images and the cache itself
+struct incremental_base {
+    int frame = 0;
+    int keyframeInterval = 30;  // every keyframeInterval-th frame is matched in full
+    int tileSize = 16;          // tiles are tileSize x tileSize pixels of the resized image
+    float threshold = 4.0f;     // mean absolute gray difference above which a tile of either image has changed
+    long long recomputedPixels = 0;     // pixels filled again in the current frame, halos included
+};
+
+// Runs of changed tiles along every tile row, as rectangles of the resized image clipped to it | leftDiffs and
+// rightDiffs hold the sum of the absolute differences of every tile, row by row, and a tile has changed if the mean
+// absolute difference of the left or the right image over it is above threshold
+std::vector<roi> ChangedTiles(const std::vector<unsigned int>& leftDiffs, const std::vector<unsigned int>& rightDiffs,
+    int width, int height, int tileSize, float threshold);
+
+// Rectangles of the resized image whose filled disparities a change inside the tiles can reach
+// a pixel's ZNCC reads the windows of both images up to marginX columns and marginY rows away, occlusion filling
+// adds its neighbourhood on top | windows that run past the left or right edge wrap around to the neighbouring
+// row, so a region reaching either edge covers whole rows and one more row above and below
+// regions of consecutive tile rows that cover the same columns are merged
+std::vector<roi> AffectedRegions(const std::vector<roi>& tiles, int width, int height, int marginX, int marginY);
+
+// Quality flags of an anytime disparity map | the low bits hold the level a disparity comes from, 1 for the coarsest,
+// 0 for pixels without a disparity
+const unsigned char QUALITY_FILLED = 0x80;  // the disparity was occlusion filled instead of passing the cross-check
+
+// Factor on the predicted time of a level before an anytime run starts it
+const double anytimeMargin = 1.25;
+
+// Best disparity map an anytime run completed within its budget, at the resolution of the finest level it was given
+struct anytime_result {
+    std::vector<int> disparities;           // occlusion filled disparities of the finest completed level, upsampled
+    std::vector<unsigned char> quality;     // quality flags of every pixel
+    int levelsCompleted = 0;
+};
+
+// Nearest neighbour upsampling of a width x height map of disparities at resizeFactor to the resolution of a finer
+// targetResizeFactor | the disparities are scaled by the ratio of the resize factors | the coarse map can be a row or
+// column short of covering the finer one, as both resizes drop the pixels that don't fill a block, so the source
+// coordinates are clamped to it
+void UpsampleDisparities(const std::vector<int>& dispMap, int width, int height, int resizeFactor,
+    int targetWidth, int targetHeight, int targetResizeFactor, std::vector<int>& upsampled);
+
+// UpsampleDisparities of the disparities and quality flags of a result completed at resizeFactor | the flags are kept
+void UpsampleAnytimeResult(anytime_result& result, int width, int height, int resizeFactor,
+    int targetWidth, int targetHeight, int targetResizeFactor);
+
+// Values of a Middlebury calib.txt that bound the disparity search | disparities of the full resolution image
+struct calibration {
+    int ndisp = 0;              // conservative bound on the number of disparity levels
+    float vmin = 0, vmax = 0;   // tight bounds on the disparities of the scene | both 0 if not given
+    float doffs = 0;            // x-difference of the principal points, only needed to turn disparities into depth
+};
+
+// Read the key=value lines of a calib.txt | false if the file can't be opened
+bool ReadCalibration(const std::string& path, calibration& calib);
+
+// Search only [vmin, vmax] of the calibration if it gives them, otherwise 0 to its ndisp | ndisp and minDisparity
+// are left as they are if it gives neither
+void ApplyCalibration(const calibration& calib, unsigned int resizeFactor, int& ndisp, int& minDisparity);
+
+// Disparity range of the resized image | width is the width of the full resolution image
+int ResizedDisparityRange(const zncc_params& params, unsigned int width);
+
+// Smallest disparity searched in the resized image, rounded down | width is the width of the full resolution image
+int ResizedMinDisparity(const zncc_params& params, unsigned int width);
@@ -1,137 +1,697 @@
-__kernel void convert_grayscale(__read_only image2d_t input_img, __write_only image2d_t out_image)
+// convert_grayscale and resize_image fused into one kernel | global size is the size of the resized image
+// the RGBA input is read directly, so no full resolution grayscale image is written to or read back from the device
+// input is a plain buffer of RGBA pixels, so the host can map it and write the decoded image straight into it
+__kernel void grayscale_resize(const int resize_factor, const __global uchar4* input_img, const int input_width, const int input_height,
+    __global unsigned char* out_image, const int width, const int height)
 {	
-	const int2 coord = (int2)(get_global_id(0), get_global_id(1));
-    const uint4 pixel = read_imageui(input_img, coord);
-    // Add the current value with the next two values and divide by 3
-    const unsigned char sum = (pixel.x + pixel.y + pixel.z) / 3;
+    const int2 idx = (int2)(get_global_id(0), get_global_id(1)); // (width, height) indexes
+    // global size may be padded to a multiple of the work group size
+    if (idx.x >= width || idx.y >= height) return;
 
-    // Store the averaged value in the output iamge at the corresponding index
-    write_imageui(out_image, coord, sum);    
-}
+    // batched pairs are stacked along the third dimension, one image after another in every buffer
+    input_img += get_global_id(2) * input_width * input_height;
+    out_image += get_global_id(2) * width * height;
 
-__kernel void resize_image(const int resize_factor, __read_only image2d_t input_img, __global unsigned char* out_image)
-{	
-    const int2 idx = (int2)(get_global_id(0), get_global_id(1)); // (width, height) indexes
     // iterate through a resize_factor * resize_factor box and take its average as new pixel value
     int sum = 0;
     for (int k = idx.y * resize_factor; k < (idx.y + 1) * resize_factor; k++) {
         for (int l = idx.x * resize_factor; l < (idx.x + 1) * resize_factor; l++) {
-            // get only x value of pixel, as we are using one channel for a grayscale scalar
-            sum += read_imageui(input_img, (int2)(l, k)).x;
+            const uint4 pixel = convert_uint4(input_img[k * input_width + l]);
+            // grayscale value of the pixel is truncated first, same as when it was stored in the 8 bit gray image
+            sum += (pixel.x + pixel.y + pixel.z) / 3;
         }
     }
 
     // add pixel to output buffer
-    out_image[idx.y * get_global_size(0) + idx.x] = (unsigned char)(sum / (resize_factor * resize_factor));
+    out_image[idx.y * width + idx.x] = (unsigned char)(sum / (resize_factor * resize_factor));
 }
 
-__kernel void calc_zncc(const int half_window_size, const char is_left_image,
-    const __global unsigned char* left_image, const __global unsigned char* right_image, __global int* disparity_map, const int max_disparity)
-{	
+// WIN_SIZE, MAX_DISP and N_COUNT may be passed as -D defines to build a variant for one parameter set
+// the kernels then use these constants instead of their arguments, so the compiler can unroll the window,
+// disparity and neighbourhood loops | the arguments are still set, but ignored
+#ifdef WIN_SIZE
+#define HALF_WINDOW_SIZE(argument) ((WIN_SIZE - 1) / 2)
+#else
+#define HALF_WINDOW_SIZE(argument) (argument)
+#endif
+
+#ifdef MAX_DISP
+#define MAX_DISPARITY(argument) (MAX_DISP)
+#else
+#define MAX_DISPARITY(argument) (argument)
+#endif
+
+#ifdef N_COUNT
+#define NEIGHBOUR_COUNT(argument) (N_COUNT)
+#else
+#define NEIGHBOUR_COUNT(argument) (argument)
+#endif
+
+// Box statistics of the ZNCC windows | a window covers [x - half_window_size, x + half_window_size) in both directions
+// box_row_sums adds up the pixels and squared pixels of every row window, global size is the image height
+// columns whose window leaves the row get 0 | rows are independent, so stacked images are summed as one taller image
+__kernel void box_row_sums(const int half_window_size_arg, const __global unsigned char* image, __global int2* row_sums,
+    const int width, const int height)
+{
+    const int half_window_size = HALF_WINDOW_SIZE(half_window_size_arg);
+    const int y = get_global_id(0);
+    // global size may be padded to a multiple of the work group size
+    if (y >= height) return;
+
+    const int row_start = y * width;
+    const int window_width = 2 * half_window_size;
+
+    // running sums over the row | after adding pixel x the window of column x - half_window_size + 1 is complete
+    int2 sums = (int2)(0, 0);
+    for (int x = 0; x < width; x++)
+    {
+        const int pixel = image[row_start + x];
+        sums += (int2)(pixel, pixel * pixel);
+        if (x >= window_width)
+        {
+            const int old_pixel = image[row_start + x - window_width];
+            sums -= (int2)(old_pixel, old_pixel * old_pixel);
+        }
+
+        const int col = x - half_window_size + 1;
+        if (col >= half_window_size)
+        {
+            row_sums[row_start + col] = sums;
+        }
+    }
+
+    for (int col = 0; col < half_window_size && col < width; col++)
+    {
+        row_sums[row_start + col] = (int2)(0, 0);
+    }
+    for (int col = max(width - half_window_size + 1, 0); col < width; col++)
+    {
+        row_sums[row_start + col] = (int2)(0, 0);
+    }
+}
+
+// box_stats adds up the row sums of every column window and stores (mean, 1 / sqrt(sum of squared deviations))
+// global size is (image width, number of stacked images) | pixels whose window leaves the image and windows without
+// variance get (mean, 0)
+__kernel void box_stats(const int half_window_size_arg, const __global int2* row_sums, __global float2* stats,
+    const int width, const int height)
+{
+    const int half_window_size = HALF_WINDOW_SIZE(half_window_size_arg);
+    const int x = get_global_id(0);
+    // global size may be padded to a multiple of the work group size
+    if (x >= width) return;
+
+    // the column window must not cross into the next stacked image
+    row_sums += get_global_id(1) * width * height;
+    stats += get_global_id(1) * width * height;
+
+    const int window_height = 2 * half_window_size;
+    const int n = window_height * window_height;
+    const bool full_columns = x >= half_window_size && x <= width - half_window_size;
+
+    // running sums over the column | after adding row y the window of row y - half_window_size + 1 is complete
+    int2 sums = (int2)(0, 0);
+    for (int y = 0; y < height; y++)
+    {
+        sums += row_sums[y * width + x];
+        if (y >= window_height)
+        {
+            sums -= row_sums[(y - window_height) * width + x];
+        }
+
+        const int row = y - half_window_size + 1;
+        if (row >= half_window_size)
+        {
+            // n times the sum of squared deviations, exact in 64 bits
+            const long deviations = (long)n * sums.y - (long)sums.x * sums.x;
+            const float inv_norm = full_columns && deviations > 0 ? rsqrt((float)deviations / n) : 0.0f;
+            stats[row * width + x] = (float2)((float)sums.x / n, inv_norm);
+        }
+    }
+
+    for (int row = 0; row < half_window_size && row < height; row++)
+    {
+        stats[row * width + x] = (float2)(0.0f, 0.0f);
+    }
+    for (int row = max(height - half_window_size + 1, 0); row < height; row++)
+    {
+        stats[row * width + x] = (float2)(0.0f, 0.0f);
+    }
+}
+
+// ZNCC value of the window centred at idx for a single disparity d
+// returns INVALID_ZNCC if the window has no variance, so it is never picked as the best match
+#define INVALID_ZNCC -100.0f
+
+float window_zncc(const int2 idx, const int d, const int half_window_size, const char is_left_image,
+    const __global unsigned char* left_image, const __global unsigned char* right_image, const int width, const int height)
+{
+    float numerator = 0.0, denominator1 = 0.0, denominator2 = 0.0;
+    float2 means = (0.0, 0.0); // left_mean, right_mean;
+
+    // calculate mean for each window - changes for different disparities, as the right_mean is calculated based on the disparity
+    int avg_count = 0;
+    for (int win_y = -half_window_size; win_y < half_window_size; win_y++)
+    {
+        for (int win_x = -half_window_size; win_x < half_window_size; win_x++)
+        {
+            // don't allow pixel to go to previous row
+            if (d > idx.x + win_x)
+            {
+                continue;
+            }
+
+            // calculate pixel indices for the current window position
+            int left_pixel_index = (idx.y + win_y) * width + (idx.x + win_x);
+            int right_pixel_index = (idx.y + win_y) * width + (idx.x + win_x - is_left_image * d);
+            if (right_pixel_index >= width * height ||
+                right_pixel_index <= 0)
+            {
+                continue;
+            }
+
+            means.x += left_image[left_pixel_index];
+            means.y += right_image[right_pixel_index];
+            avg_count++;
+        }
+
+    }
+    means = native_divide(means, avg_count);
+
+    // calculate numerator and denominators used for zncc calculation
+    for (int win_y = -half_window_size; win_y < half_window_size; win_y++)
+    {
+        for (int win_x = -half_window_size; win_x < half_window_size; win_x++)
+        {
+            // don't allow pixel to go to previous row
+            if (d > idx.x + win_x)
+            {
+                continue;
+            }
+
+            // calculate pixel indices for the current window position
+            int left_pixel_index = (idx.y + win_y) * width + (idx.x + win_x);
+            int right_pixel_index = (idx.y + win_y) * width + (idx.x + win_x - is_left_image * d);
+            if (right_pixel_index >= width * height ||
+                right_pixel_index <= 0)
+            {
+                continue;
+            }
+
+            // calculate numerator and denominators and sum
+            numerator += (left_image[left_pixel_index] - means.x) * (right_image[right_pixel_index] - means.y);
+            denominator1 += pown(left_image[left_pixel_index] - means.x, 2);
+            denominator2 += pown(right_image[right_pixel_index] - means.y, 2);
+
+        }
+
+    }
+
+    float denominator = native_sqrt(denominator1) * native_sqrt(denominator2);
+    if (denominator == 0) {
+        return INVALID_ZNCC;
+    }
+
+    // calculate zncc value
+    return native_divide(numerator, denominator);
+}
+
+// returns true if the window centred at idx does not fit in the image | borders are kept at disparity 0
+bool is_border_pixel(const int2 idx, const int half_window_size, const int width, const int height)
+{
+    return idx.y >= height - half_window_size || idx.x >= width - half_window_size ||
+        idx.y <= half_window_size || idx.x <= half_window_size;
+}
+
+// returns true if window_zncc would use every pixel of both windows for a non-border pixel at disparity d,
+// so the box statistics describe them | otherwise window_zncc masks part of the windows
+bool has_full_windows(const int2 idx, const int d, const int half_window_size, const char is_left_image, const int width)
+{
+    const int match_x = idx.x - is_left_image * d;
+    return d <= idx.x - half_window_size && match_x >= half_window_size && match_x <= width - half_window_size;
+}
+
+// window_zncc with the means and norms taken from the box statistics, so only the cross term is summed per disparity
+// numerator is computed from integer sums, so it is exact like in window_zncc
+float window_zncc_stats(const int2 idx, const int d, const int half_window_size, const char is_left_image,
+    const __global unsigned char* left_image, const __global unsigned char* right_image,
+    const __global float2* left_stats, const __global float2* right_stats, const int width, const int height)
+{
+    if (!has_full_windows(idx, d, half_window_size, is_left_image, width))
+    {
+        return window_zncc(idx, d, half_window_size, is_left_image, left_image, right_image, width, height);
+    }
+
+    const float2 left = left_stats[idx.y * width + idx.x];
+    const float2 right = right_stats[idx.y * width + idx.x - is_left_image * d];
+    if (left.y == 0 || right.y == 0) {
+        return INVALID_ZNCC;
+    }
+
+    int cross = 0;
+    for (int win_y = -half_window_size; win_y < half_window_size; win_y++)
+    {
+        const int row_start = (idx.y + win_y) * width;
+        for (int win_x = -half_window_size; win_x < half_window_size; win_x++)
+        {
+            const int col = idx.x + win_x;
+            cross += left_image[row_start + col] * right_image[row_start + col - is_left_image * d];
+        }
+    }
+
+    // sum((l - left_mean) * (r - right_mean)) = (n * sum(l * r) - sum(l) * sum(r)) / n
+    const int n = 4 * half_window_size * half_window_size;
+    const long numerator = (long)n * cross - (long)convert_int_rte(left.x * n) * convert_int_rte(right.x * n);
+    return (float)numerator / n * left.y * right.y;
+}
+
+// disparities from min_disparity up to max_disparity are searched, in this and every other ZNCC kernel
+// min_disparity comes from the calibration's vmin | pixels whose windows have no variance in the range stay 0
+__kernel void calc_zncc(const int half_window_size_arg, const char is_left_image,
+    const __global unsigned char* left_image, const __global unsigned char* right_image,
+    const __global float2* left_stats, const __global float2* right_stats, __global int* disparity_map, const int max_disparity_arg,
+    const int min_disparity, const int width, const int height)
+{
+    const int half_window_size = HALF_WINDOW_SIZE(half_window_size_arg);
+    const int max_disparity = MAX_DISPARITY(max_disparity_arg);
     const int2 idx = (int2)(get_global_id(0), get_global_id(1)); // (width, height) indexes
+    // global size may be padded to a multiple of the work group size
+    if (idx.x >= width || idx.y >= height) return;
 
-    const int width = get_global_size(0);
-    const int height = get_global_size(1);
+    // batched pairs are stacked along the third dimension, one image after another in every buffer
+    const int pair_offset = get_global_id(2) * width * height;
+    left_image += pair_offset;
+    right_image += pair_offset;
+    left_stats += pair_offset;
+    right_stats += pair_offset;
+    disparity_map += pair_offset;
 
     int best_disp = 0;
-    float best_ZNCC = -100.0;
+    float best_ZNCC = INVALID_ZNCC;
 
     // handle borders | keep best_disp at 0, so borders will be black
-    if (!(idx.y >= height - half_window_size || idx.x >= width - half_window_size ||
-        idx.y <= half_window_size || idx.x <= half_window_size))
+    if (!is_border_pixel(idx, half_window_size, width, height))
     {
         // go over all disparity values
-        for (int d = 0; d < max_disparity; d++)
+        for (int d = min_disparity; d < max_disparity; d++)
         {
-            float zncc = 0.0;
-            float numerator = 0.0, denominator1 = 0.0, denominator2 = 0.0;
-            float2 means = (0.0, 0.0); // left_mean, right_mean;
+            float zncc = window_zncc_stats(idx, d, half_window_size, is_left_image, left_image, right_image,
+                left_stats, right_stats, width, height);
 
-            // calculate mean for each window - changes for different disparities, as the right_mean is calculated based on the disparity
-            int avg_count = 0;
-            for (int win_y = -half_window_size; win_y < half_window_size; win_y++)
+            // compare current zncc value to the current best value and update
+            // value and disparity that led to it if new zncc value is better
+            if (zncc > best_ZNCC)
             {
-                for (int win_x = -half_window_size; win_x < half_window_size; win_x++)
-                {
-                    // don't allow pixel to go to previous row
-                    if (d > idx.x + win_x)
-                    {
-                        continue;
-                    }
+                best_ZNCC = zncc;
+                best_disp = d;
+            }
+        }
+    }
+   
+    // add pixel to output buffer
+    disparity_map[idx.y * width + idx.x] = best_disp;
+}
 
-                    // calculate pixel indices for the current window position
-                    int left_pixel_index = (idx.y + win_y) * width + (idx.x + win_x);
-                    int right_pixel_index = (idx.y + win_y) * width + (idx.x + win_x - is_left_image * d);
-                    if (right_pixel_index >= width * height ||
-                        right_pixel_index <= 0)
-                    {
-                        continue;
-                    }
+// best disparity in [first, last) and its score | best_disp is left at 0 and INVALID_ZNCC returned if no window has variance
+float best_zncc_in_range(const int2 idx, const int first, const int last, const int half_window_size, const char is_left_image,
+    const __global unsigned char* left_image, const __global unsigned char* right_image,
+    const __global float2* left_stats, const __global float2* right_stats, const int width, const int height, int* best_disp)
+{
+    float best_ZNCC = INVALID_ZNCC;
+    *best_disp = 0;
+    for (int d = first; d < last; d++)
+    {
+        float zncc = window_zncc_stats(idx, d, half_window_size, is_left_image, left_image, right_image,
+            left_stats, right_stats, width, height);
+        if (zncc > best_ZNCC)
+        {
+            best_ZNCC = zncc;
+            *best_disp = d;
+        }
+    }
+    return best_ZNCC;
+}
 
-                    means.x += left_image[left_pixel_index];
-                    means.y += right_image[right_pixel_index];
-                    avg_count++;
-                }
+// calc_zncc for frames of a video | every pixel searches only search_radius around its prior, the previous frame's
+// cross-checked disparity, and pixels without a prior (0) search the full range
+// where the peak degrades, i.e. the best score is below min_score or the best disparity is on the edge of the limited
+// range, the rest of the range is searched as well, so those pixels get the same disparity as from calc_zncc
+// the number of disparities evaluated is added to evaluations
+__kernel void calc_zncc_temporal(const int half_window_size_arg, const char is_left_image,
+    const __global unsigned char* left_image, const __global unsigned char* right_image,
+    const __global float2* left_stats, const __global float2* right_stats, __global int* disparity_map, const int max_disparity_arg,
+    const int min_disparity, const int width, const int height, const __global int* prior, const int search_radius, const float min_score,
+    volatile __global uint* evaluations)
+{
+    const int half_window_size = HALF_WINDOW_SIZE(half_window_size_arg);
+    const int max_disparity = MAX_DISPARITY(max_disparity_arg);
+    const int2 idx = (int2)(get_global_id(0), get_global_id(1)); // (width, height) indexes
+    // global size may be padded to a multiple of the work group size
+    if (idx.x >= width || idx.y >= height) return;
 
+    int best_disp = 0;
+
+    // handle borders | keep best_disp at 0, so borders will be black
+    if (!is_border_pixel(idx, half_window_size, width, height))
+    {
+        const int prior_disp = prior[idx.y * width + idx.x];
+        const int first = prior_disp > 0 ? max(min_disparity, prior_disp - search_radius) : min_disparity;
+        const int last = prior_disp > 0 ? min(max_disparity, prior_disp + search_radius + 1) : max_disparity;
+        float best_ZNCC = best_zncc_in_range(idx, first, last, half_window_size, is_left_image, left_image, right_image,
+            left_stats, right_stats, width, height, &best_disp);
+        uint evaluated = max(0, last - first);
+
+        const bool on_edge = (best_disp == first && first > min_disparity) || (best_disp == last - 1 && last < max_disparity);
+        if (prior_disp > 0 && (best_ZNCC < min_score || on_edge))
+        {
+            // ties go to the smaller disparity like in calc_zncc
+            int below_disp, above_disp;
+            const float below = best_zncc_in_range(idx, min_disparity, first, half_window_size, is_left_image, left_image, right_image,
+                left_stats, right_stats, width, height, &below_disp);
+            const float above = best_zncc_in_range(idx, last, max_disparity, half_window_size, is_left_image, left_image, right_image,
+                left_stats, right_stats, width, height, &above_disp);
+            evaluated += (first - min_disparity) + (max_disparity - last);
+
+            if (below >= best_ZNCC && below > INVALID_ZNCC)
+            {
+                best_ZNCC = below;
+                best_disp = below_disp;
+            }
+            if (above > best_ZNCC)
+            {
+                best_ZNCC = above;
+                best_disp = above_disp;
             }
-            means = native_divide(means, avg_count);
+        }
+        atomic_add(evaluations, evaluated);
+    }
 
-            // calculate numerator and denominators used for zncc calculation
-            for (int win_y = -half_window_size; win_y < half_window_size; win_y++)
+    disparity_map[idx.y * width + idx.x] = best_disp;
+}
+
+// calc_zncc for a list of keypoints with one work-item per point | points are (x, y) pixels of the resized image
+// the best disparity and its ZNCC score are written at the point's index, border points get disparity 0 and INVALID_ZNCC
+__kernel void calc_zncc_points(const int half_window_size_arg, const char is_left_image,
+    const __global unsigned char* left_image, const __global unsigned char* right_image,
+    const __global float2* left_stats, const __global float2* right_stats,
+    const __global int2* points, __global int* disparities, __global float* scores, const int point_count,
+    const int max_disparity_arg, const int min_disparity, const int width, const int height)
+{
+    const int half_window_size = HALF_WINDOW_SIZE(half_window_size_arg);
+    const int max_disparity = MAX_DISPARITY(max_disparity_arg);
+    const int i = get_global_id(0);
+    // global size may be padded to a multiple of the work group size
+    if (i >= point_count) return;
+
+    const int2 idx = points[i];
+    int best_disp = 0;
+    float best_ZNCC = INVALID_ZNCC;
+
+    if (!is_border_pixel(idx, half_window_size, width, height))
+    {
+        for (int d = min_disparity; d < max_disparity; d++)
+        {
+            float zncc = window_zncc_stats(idx, d, half_window_size, is_left_image, left_image, right_image,
+                left_stats, right_stats, width, height);
+            if (zncc > best_ZNCC)
             {
-                for (int win_x = -half_window_size; win_x < half_window_size; win_x++)
+                best_ZNCC = zncc;
+                best_disp = d;
+            }
+        }
+    }
+
+    disparities[i] = best_disp;
+    scores[i] = best_ZNCC;
+}
+
+// 3D variant of calc_zncc | global size is (width, height * pairs, local size), local size is (1, 1, power of two)
+// every work-item of a group evaluates every get_local_size(2)-th disparity of the same pixel
+// and the (score, disparity) pairs are then reduced to the best match in local memory
+// the third dimension is taken by the disparities, so batched pairs are stacked along the second one
+__kernel void calc_zncc_disparity_parallel(const int half_window_size_arg, const char is_left_image,
+    const __global unsigned char* left_image, const __global unsigned char* right_image,
+    const __global float2* left_stats, const __global float2* right_stats, __global int* disparity_map, const int max_disparity_arg,
+    const int min_disparity, const int width, const int height, __local float* best_scores, __local int* best_disps)
+{
+    const int half_window_size = HALF_WINDOW_SIZE(half_window_size_arg);
+    const int max_disparity = MAX_DISPARITY(max_disparity_arg);
+    const int2 idx = (int2)(get_global_id(0), get_global_id(1) % height); // (width, height) indexes
+    const int lid = get_local_id(2);
+    const int group_size = get_local_size(2);
+
+    const int pair_offset = get_global_id(1) / height * width * height;
+    left_image += pair_offset;
+    right_image += pair_offset;
+    left_stats += pair_offset;
+    right_stats += pair_offset;
+    disparity_map += pair_offset;
+
+    int best_disp = 0;
+    float best_ZNCC = INVALID_ZNCC;
+
+    // the whole group works on the same pixel, so the border check is uniform and no work-item skips the barriers below
+    if (!is_border_pixel(idx, half_window_size, width, height))
+    {
+        // disparities are visited in increasing order, so ties keep the smallest disparity like calc_zncc
+        for (int d = min_disparity + lid; d < max_disparity; d += group_size)
+        {
+            float zncc = window_zncc_stats(idx, d, half_window_size, is_left_image, left_image, right_image,
+                left_stats, right_stats, width, height);
+            if (zncc > best_ZNCC)
+            {
+                best_ZNCC = zncc;
+                best_disp = d;
+            }
+        }
+    }
+
+    best_scores[lid] = best_ZNCC;
+    best_disps[lid] = best_disp;
+
+    // tree reduction over the group | on equal scores the smaller disparity wins
+    for (int stride = group_size / 2; stride > 0; stride >>= 1)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < stride)
+        {
+            float other_score = best_scores[lid + stride];
+            int other_disp = best_disps[lid + stride];
+            if (other_score > best_scores[lid] ||
+                (other_score == best_scores[lid] && other_disp < best_disps[lid]))
+            {
+                best_scores[lid] = other_score;
+                best_disps[lid] = other_disp;
+            }
+        }
+    }
+
+    if (lid == 0)
+    {
+        disparity_map[idx.y * width + idx.x] = best_disps[0];
+    }
+}
+
+#ifdef ZNCC_VEC_WIDTH
+// ZNCC_VEC_WIDTH (4, 8 or 16) passed as a -D define when building | picked from CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+#define floatv CONCAT(float, ZNCC_VEC_WIDTH)
+#define intv CONCAT(int, ZNCC_VEC_WIDTH)
+#define uintv CONCAT(uint, ZNCC_VEC_WIDTH)
+#define vloadv CONCAT(vload, ZNCC_VEC_WIDTH)
+#define vstorev CONCAT(vstore, ZNCC_VEC_WIDTH)
+#define convert_floatv CONCAT(convert_float, ZNCC_VEC_WIDTH)
+#define convert_intv CONCAT(convert_int, ZNCC_VEC_WIDTH)
+
+__constant uint lane_ids[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+// right image pixels at column col - is_left_image * (d0 + lane) of the row starting at row_start, one disparity per lane
+// the pixels of consecutive disparities are next to each other in the row, so they are read with a single vload
+floatv load_disparity_lanes(const __global unsigned char* right_image, const int row_start, const int col, const int d0,
+    const char is_left_image, const int image_size)
+{
+    // for the left image the disparities go right to left in memory, so the loaded vector is reversed afterwards
+    const int base = is_left_image == 1 ? row_start + col - d0 - (ZNCC_VEC_WIDTH - 1) : row_start + col + d0;
+
+    floatv pixels;
+    if (base >= 0 && base + ZNCC_VEC_WIDTH <= image_size)
+    {
+        pixels = convert_floatv(vloadv(0, right_image + base));
+    }
+    else
+    {
+        // lanes outside of the image are masked out by the caller, so they only have to be readable
+        unsigned char edge[ZNCC_VEC_WIDTH];
+        for (int i = 0; i < ZNCC_VEC_WIDTH; i++)
+        {
+            edge[i] = (base + i >= 0 && base + i < image_size) ? right_image[base + i] : 0;
+        }
+        pixels = convert_floatv(vloadv(0, edge));
+    }
+
+    if (is_left_image == 1)
+    {
+        pixels = shuffle(pixels, (uintv)(ZNCC_VEC_WIDTH - 1) - vloadv(0, lane_ids));
+    }
+    return pixels;
+}
+
+// calc_zncc with ZNCC_VEC_WIDTH consecutive disparities evaluated at once, one per vector lane
+// blocks of disparities with full windows use the box statistics, the others mask window pixels per lane
+// with the same rules as window_zncc, so the result is the same as calc_zncc
+__kernel void calc_zncc_vec(const int half_window_size_arg, const char is_left_image,
+    const __global unsigned char* left_image, const __global unsigned char* right_image,
+    const __global float2* left_stats, const __global float2* right_stats, __global int* disparity_map, const int max_disparity_arg,
+    const int min_disparity, const int width, const int height)
+{
+    const int half_window_size = HALF_WINDOW_SIZE(half_window_size_arg);
+    const int max_disparity = MAX_DISPARITY(max_disparity_arg);
+    const int2 idx = (int2)(get_global_id(0), get_global_id(1)); // (width, height) indexes
+    // global size may be padded to a multiple of the work group size
+    if (idx.x >= width || idx.y >= height) return;
+
+    // batched pairs are stacked along the third dimension, one image after another in every buffer
+    const int pair_offset = get_global_id(2) * width * height;
+    left_image += pair_offset;
+    right_image += pair_offset;
+    left_stats += pair_offset;
+    right_stats += pair_offset;
+    disparity_map += pair_offset;
+
+    const int image_size = width * height;
+    const intv lanes = convert_intv(vloadv(0, lane_ids));
+
+    int best_disp = 0;
+    float best_ZNCC = INVALID_ZNCC;
+
+    // handle borders | keep best_disp at 0, so borders will be black
+    if (!is_border_pixel(idx, half_window_size, width, height))
+    {
+        // go over the disparity values ZNCC_VEC_WIDTH at a time
+        const int n = 4 * half_window_size * half_window_size;
+        const float2 left = left_stats[idx.y * width + idx.x];
+        const int left_sum = convert_int_rte(left.x * n);
+
+        for (int d0 = min_disparity; d0 < max_disparity; d0 += ZNCC_VEC_WIDTH)
+        {
+            // disparities are checked from the first to the last lane, so the condition holds for all lanes if it holds for both
+            const int d_last = min(d0 + ZNCC_VEC_WIDTH, max_disparity) - 1;
+            if (has_full_windows(idx, d0, half_window_size, is_left_image, width) &&
+                has_full_windows(idx, d_last, half_window_size, is_left_image, width))
+            {
+                // only the cross term is summed | row sums stay below 2^24, so they are exact as floats
+                intv cross = 0;
+                for (int win_y = -half_window_size; win_y < half_window_size; win_y++)
                 {
-                    // don't allow pixel to go to previous row
-                    if (d > idx.x + win_x)
+                    const int row_start = (idx.y + win_y) * width;
+                    floatv row_cross = 0.0f;
+                    for (int win_x = -half_window_size; win_x < half_window_size; win_x++)
                     {
-                        continue;
+                        const int col = idx.x + win_x;
+                        row_cross += left_image[row_start + col] * load_disparity_lanes(right_image, row_start, col, d0, is_left_image, image_size);
                     }
+                    cross += convert_intv(row_cross);
+                }
+
+                int lane_cross[ZNCC_VEC_WIDTH];
+                vstorev(cross, 0, lane_cross);
 
-                    // calculate pixel indices for the current window position
-                    int left_pixel_index = (idx.y + win_y) * width + (idx.x + win_x);
-                    int right_pixel_index = (idx.y + win_y) * width + (idx.x + win_x - is_left_image * d);
-                    if (right_pixel_index >= width * height ||
-                        right_pixel_index <= 0)
+                // pick the best lane in increasing disparity order, so ties keep the smallest disparity like calc_zncc
+                for (int i = 0; d0 + i <= d_last; i++)
+                {
+                    const float2 right = right_stats[idx.y * width + idx.x - is_left_image * (d0 + i)];
+                    if (left.y == 0 || right.y == 0) continue;
+
+                    const long numerator = (long)n * lane_cross[i] - (long)left_sum * convert_int_rte(right.x * n);
+                    const float zncc = (float)numerator / n * left.y * right.y;
+                    if (zncc > best_ZNCC)
                     {
-                        continue;
+                        best_ZNCC = zncc;
+                        best_disp = d0 + i;
                     }
+                }
+                continue;
+            }
 
-                    // calculate numerator and denominators and sum
-                    numerator += (left_image[left_pixel_index] - means.x) * (right_image[right_pixel_index] - means.y);
-                    denominator1 += pown(left_image[left_pixel_index] - means.x, 2);
-                    denominator2 += pown(right_image[right_pixel_index] - means.y, 2);
+            const intv disparities = d0 + lanes;
+            floatv left_sum = 0.0f, right_sum = 0.0f, avg_count = 0.0f;
 
+            // calculate the means of every lane
+            for (int win_y = -half_window_size; win_y < half_window_size; win_y++)
+            {
+                const int row_start = (idx.y + win_y) * width;
+                for (int win_x = -half_window_size; win_x < half_window_size; win_x++)
+                {
+                    const int col = idx.x + win_x;
+                    const intv right_pixel_index = row_start + col - is_left_image * disparities;
+                    // don't allow pixel to go to previous row and stay inside the image | 1.0 for lanes that use this pixel
+                    const floatv mask = convert_floatv((disparities <= col) & (disparities < max_disparity) &
+                        (right_pixel_index < image_size) & (right_pixel_index > 0) & 1);
+
+                    left_sum += mask * left_image[row_start + col];
+                    right_sum += mask * load_disparity_lanes(right_image, row_start, col, d0, is_left_image, image_size);
+                    avg_count += mask;
                 }
+            }
+            const floatv left_mean = native_divide(left_sum, avg_count);
+            const floatv right_mean = native_divide(right_sum, avg_count);
 
+            // calculate numerator and denominators used for zncc calculation
+            floatv numerator = 0.0f, denominator1 = 0.0f, denominator2 = 0.0f;
+            for (int win_y = -half_window_size; win_y < half_window_size; win_y++)
+            {
+                const int row_start = (idx.y + win_y) * width;
+                for (int win_x = -half_window_size; win_x < half_window_size; win_x++)
+                {
+                    const int col = idx.x + win_x;
+                    const intv right_pixel_index = row_start + col - is_left_image * disparities;
+                    const floatv mask = convert_floatv((disparities <= col) & (disparities < max_disparity) &
+                        (right_pixel_index < image_size) & (right_pixel_index > 0) & 1);
+
+                    const floatv left_diff = mask * (left_image[row_start + col] - left_mean);
+                    const floatv right_diff = mask * (load_disparity_lanes(right_image, row_start, col, d0, is_left_image, image_size) - right_mean);
+                    numerator += left_diff * right_diff;
+                    denominator1 += left_diff * left_diff;
+                    denominator2 += right_diff * right_diff;
+                }
             }
 
-            float denominator = native_sqrt(denominator1) * native_sqrt(denominator2);
-            if (denominator != 0) {
-                // calculate zncc value
-                zncc = native_divide(numerator, denominator);
+            float zncc[ZNCC_VEC_WIDTH];
+            float denominator[ZNCC_VEC_WIDTH];
+            vstorev(native_sqrt(denominator1) * native_sqrt(denominator2), 0, denominator);
+            vstorev(native_divide(numerator, native_sqrt(denominator1) * native_sqrt(denominator2)), 0, zncc);
 
-                // compare current zncc value to the current best value and update
-                // value and disparity that led to it if new zncc value is better
-                if (zncc > best_ZNCC)
+            // pick the best lane in increasing disparity order, so ties keep the smallest disparity like calc_zncc
+            for (int i = 0; i < ZNCC_VEC_WIDTH && d0 + i < max_disparity; i++)
+            {
+                if (denominator[i] != 0 && zncc[i] > best_ZNCC)
                 {
-                    best_ZNCC = zncc;
-                    best_disp = d;
+                    best_ZNCC = zncc[i];
+                    best_disp = d0 + i;
                 }
             }
         }
     }
-   
+
     // add pixel to output buffer
     disparity_map[idx.y * width + idx.x] = best_disp;
 }
+#endif
 
 __kernel void cross_check(const int cross_diff,
-    const __global int* left_image, const __global int* right_image,  __global int* cross_checked_image)
+    const __global int* left_image, const __global int* right_image,  __global int* cross_checked_image,
+    const int width, const int height)
 {	
     const int2 idx = (int2)(get_global_id(0), get_global_id(1)); // (width, height) indexes
+    // global size may be padded to a multiple of the work group size
+    if (idx.x >= width || idx.y >= height) return;
 
-    const int width = get_global_size(0);
-    const int height = get_global_size(1);
+    // batched pairs are stacked along the third dimension, one image after another in every buffer
+    const int pair_offset = get_global_id(2) * width * height;
+    left_image += pair_offset;
+    right_image += pair_offset;
+    cross_checked_image += pair_offset;
 
     // Get the disparity values for the current pixel in both directions
     int disp_left = left_image[idx.y * width + idx.x];
@@ -149,59 +709,205 @@ __kernel void cross_check(const int cross_diff,
     
 }
 
-__kernel void occlusion_filling(const int n_count,
-    __global int* cross_checked_image)
-{	
+// Occlusion filling reads cross_checked_image and writes filled_image, so every pixel sees the same unfilled neighbours
+// regardless of the order the work-groups run in | the host has to give a local size, as the work-group's tile plus
+// a halo of n_count / 2 pixels is staged in tile, which holds
+// (get_local_size(0) + n_count / 2 * 2) * (get_local_size(1) + n_count / 2 * 2) ints
+__kernel void occlusion_filling(const int n_count_arg,
+    const __global int* cross_checked_image, __global int* filled_image,
+    const int width, const int height, __local int* tile)
+{
+    const int n_count = NEIGHBOUR_COUNT(n_count_arg);
+    const int radius = n_count / 2;
     const int2 idx = (int2)(get_global_id(0), get_global_id(1)); // (width, height) indexes
+    const int2 lid = (int2)(get_local_id(0), get_local_id(1));
+    const int2 group_size = (int2)(get_local_size(0), get_local_size(1));
+    // from the global ids, so that launches with a global work offset (regions of interest) stage the right tile
+    const int2 tile_origin = idx - lid - radius;
+    const int tile_width = group_size.x + 2 * radius;
+    const int tile_height = group_size.y + 2 * radius;
+
+    // batched pairs are stacked along the third dimension | groups are one deep, so the tile belongs to one pair
+    const int pair_offset = get_global_id(2) * width * height;
+    cross_checked_image += pair_offset;
+    filled_image += pair_offset;
+
+    // stage the tile with the whole group | pixels outside of the image are stored as invalid
+    for (int ty = lid.y; ty < tile_height; ty += group_size.y)
+    {
+        for (int tx = lid.x; tx < tile_width; tx += group_size.x)
+        {
+            const int2 pixel = tile_origin + (int2)(tx, ty);
+            tile[ty * tile_width + tx] = pixel.x >= 0 && pixel.x < width && pixel.y >= 0 && pixel.y < height ?
+                cross_checked_image[pixel.y * width + pixel.x] : 0;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // global size may be padded to a multiple of the work group size | padded work-items only help to stage the tile
+    if (idx.x >= width || idx.y >= height) return;
 
-    const int width = get_global_size(0);
-    const int height = get_global_size(1);
+    const int centre = (lid.y + radius) * tile_width + lid.x + radius;
+    int disparity = tile[centre];
 
     // handle borders | keep bestDisp at 0, so borders will stay black
-    if (!(idx.y >= height - (n_count / 2) || idx.x >= width - (n_count / 2) ||
-        idx.y <= n_count / 2 || idx.x <= n_count / 2))
+    // invalid pixels get the median of the valid (non-zero) disparities in their n-neighbourhood
+    // the centre pixel is invalid itself, so it is skipped by the validity check
+    if (disparity == 0 && !(idx.y >= height - radius || idx.x >= width - radius ||
+        idx.y <= radius || idx.x <= radius))
     {
-        // Check if the current pixel is marked as invalid
-        if (cross_checked_image[idx.y * width + idx.x] == 0) {
-
-            // Initialize the list of valid disparity values in the n-neighborhood of the current pixel
-            int i = 0;
-
-            // NEIGHBOUR_SIZE passed as a -D define when building
-            int neighbours[NEIGHBOUR_SIZE];
+        // count the valid neighbours and the range of their disparities
+        int count = 0, low = INT_MAX, high = 0;
+        for (int dy = -radius; dy <= radius; dy++)
+        {
+            for (int dx = -radius; dx <= radius; dx++)
+            {
+                const int neighbour_disp = tile[centre + dy * tile_width + dx];
+                if (neighbour_disp > 0)
+                {
+                    count++;
+                    low = min(low, neighbour_disp);
+                    high = max(high, neighbour_disp);
+                }
+            }
+        }
 
-            // Loop over the n-neighbors of the current pixel
-            for (int dy = -n_count / 2; dy <= n_count / 2; dy++) {
-                for (int dx = -n_count / 2; dx <= n_count / 2; dx++) {
-                    // Skip the center pixel
-                    if (!(dx == 0 && dy == 0))
+        // the median is the smallest disparity with more than count / 2 neighbours at or below it
+        // it is found by bisection over the range, counting the neighbours below the midpoint on every step,
+        // so no list of the neighbours has to be kept
+        if (count > 0)
+        {
+            const int rank = count / 2;
+            while (low < high)
+            {
+                const int mid = low + (high - low) / 2;
+                int at_or_below = 0;
+                for (int dy = -radius; dy <= radius; dy++)
+                {
+                    for (int dx = -radius; dx <= radius; dx++)
                     {
-                        // Get the disparity value for the current neighbor
-                        int neighbor_disp = cross_checked_image[(idx.y + dy) * width + (idx.x + dx)];
-
-                        // If the neighbor is valid, add its disparity value to the list
-                        if (neighbor_disp > 0) {
-                            neighbours[i] = neighbor_disp;
-                            i++;
-                        }
+                        const int neighbour_disp = tile[centre + dy * tile_width + dx];
+                        at_or_below += neighbour_disp > 0 && neighbour_disp <= mid;
                     }
                 }
-            }
 
-            // If at least one valid disparity value was found in the n-neighborhood,
-            // set the current pixel's disparity value to the median of the valid values
-            if (i > 0) {
-                cross_checked_image[idx.y * width + idx.x] = neighbours[(i + 1) / 2];
+                if (at_or_below > rank) high = mid;
+                else low = mid + 1;
             }
+            disparity = low;
         }
     }
+
+    filled_image[idx.y * width + idx.x] = disparity;
 }
 
+// Sub-pixel offset of the ZNCC peak at d from the scores at d - 1, d and d + 1, in [-0.5, 0.5] | a parabola through
+// the three scores, or with equiangular two lines of opposite slope through them, 0 if d is not a peak
+float subpixel_offset(const float below, const float peak, const float above, const char equiangular)
+{
+    if (peak < below || peak < above) return 0.0f;
+
+    float offset;
+    if (equiangular)
+    {
+        const float slope = peak - min(below, above);
+        if (slope <= 0.0f) return 0.0f;
+        offset = 0.5f * (above - below) / slope;
+    }
+    else
+    {
+        const float curvature = below - 2.0f * peak + above;
+        if (curvature >= 0.0f) return 0.0f;
+        offset = 0.5f * (below - above) / curvature;
+    }
+    return clamp(offset, -0.5f, 0.5f);
+}
+
+// Float disparities of the occlusion filled map | pixels whose disparity was kept by the cross-check are refined with
+// the ZNCC scores of the left image at the neighbouring disparities, filled pixels keep their integer disparity
+__kernel void subpixel_refine(const int half_window_size_arg, const char equiangular,
+    const __global unsigned char* left_image, const __global unsigned char* right_image,
+    const __global float2* left_stats, const __global float2* right_stats,
+    const __global int* cross_checked_image, const __global int* filled_image, __global float* refined_image,
+    const int max_disparity_arg, const int width, const int height)
+{
+    const int half_window_size = HALF_WINDOW_SIZE(half_window_size_arg);
+    const int max_disparity = MAX_DISPARITY(max_disparity_arg);
+    const int2 idx = (int2)(get_global_id(0), get_global_id(1)); // (width, height) indexes
+    // global size may be padded to a multiple of the work group size
+    if (idx.x >= width || idx.y >= height) return;
+
+    // batched pairs are stacked along the third dimension, one image after another in every buffer
+    const int pair_offset = get_global_id(2) * width * height;
+    left_image += pair_offset;
+    right_image += pair_offset;
+    left_stats += pair_offset;
+    right_stats += pair_offset;
+    cross_checked_image += pair_offset;
+    filled_image += pair_offset;
+    refined_image += pair_offset;
+
+    const int d = cross_checked_image[idx.y * width + idx.x];
+    float disparity = (float)filled_image[idx.y * width + idx.x];
+
+    // the scores on both sides of d are needed | cross-checked disparities are never on the border
+    if (d > 0 && d + 1 < max_disparity)
+    {
+        const float below = window_zncc_stats(idx, d - 1, half_window_size, 1, left_image, right_image, left_stats, right_stats, width, height);
+        const float peak = window_zncc_stats(idx, d, half_window_size, 1, left_image, right_image, left_stats, right_stats, width, height);
+        const float above = window_zncc_stats(idx, d + 1, half_window_size, 1, left_image, right_image, left_stats, right_stats, width, height);
+        if (below != INVALID_ZNCC && above != INVALID_ZNCC)
+        {
+            disparity = d + subpixel_offset(below, peak, above, equiangular);
+        }
+    }
+    refined_image[idx.y * width + idx.x] = disparity;
+}
+
+// size covers every stacked image of a batch, as the pixels are normalized independently
 __kernel void normalize_to_char(const int n_disp,
-    const __global int* filled_image, __global unsigned char* norm_image)
+    const __global int* filled_image, __global unsigned char* norm_image, const int size)
 {	
     const int i = get_global_id(0);
+    // global size may be padded to a multiple of the work group size
+    if (i >= size) return;
 
     // normalize disparity image to grayscale (char)
     norm_image[i] = (unsigned char)(((float)(filled_image[i])) / n_disp * 255);
-}
\ No newline at end of file
+}
+
+// normalize_to_char for the float disparities of subpixel_refine
+__kernel void normalize_float_to_char(const int n_disp,
+    const __global float* refined_image, __global unsigned char* norm_image, const int size)
+{
+    const int i = get_global_id(0);
+    // global size may be padded to a multiple of the work group size
+    if (i >= size) return;
+
+    norm_image[i] = (unsigned char)(refined_image[i] / n_disp * 255);
+}
+
+// Sum of the absolute differences of two resized gray images over every tile_size x tile_size tile, for skipping
+// unchanged tiles of a video | one work-item per tile, tiles on the right and bottom edges are clipped to the image
+__kernel void tile_changes(const int tile_size,
+    const __global unsigned char* current_image, const __global unsigned char* previous_image,
+    __global uint* tile_diffs, const int width, const int height)
+{
+    const int2 tile = (int2)(get_global_id(0), get_global_id(1));
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    // global size may be padded to a multiple of the work group size
+    if (tile.x >= tiles_x || tile.y >= tiles_y) return;
+
+    const int2 first = tile * tile_size;
+    const int2 last = min(first + tile_size, (int2)(width, height));
+    uint sum = 0;
+    for (int y = first.y; y < last.y; y++)
+    {
+        for (int x = first.x; x < last.x; x++)
+        {
+            sum += abs_diff(current_image[y * width + x], previous_image[y * width + x]);
+        }
+    }
+    tile_diffs[tile.y * tiles_x + tile.x] = sum;
+}